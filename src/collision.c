@@ -0,0 +1,123 @@
+/*************************************************************************
+
+Software collision detector, see collision.h.
+
+A collision starts when the magnitude of the filtered acceleration exceeds collision_accel, less than
+collision_jerk_time seconds after its jerk exceeded collision_jerk (the jerk peaks before the acceleration,
+so a slow acceleration of the car is never a collision), and it ends when the magnitude stays below
+collision_release for collision_release_time seconds (hysteresis, so a rebound is not a new collision).
+Impacts mostly in the vertical axis (the horizontal part below collision_horizontal times the magnitude)
+are bumps of the ground, not collisions.
+
+The low pass filter has its cutoff at collision_cutoff (limited to ODR/4) and a wide transition band,
+so it has few taps: its delay is about 10 ms at 238 Hz and above. An impact at the threshold of the
+interrupt generator of the accelerometer (1 g during 20 ms) keeps most of its peak through it.
+
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "collision.h"
+
+
+static const double collision_cutoff = 50.0;        // In Hz
+static const double collision_accel = 0.5;          // In g
+static const double collision_jerk = 20.0;          // In g/s
+static const double collision_jerk_time = 0.05;     // In seconds
+static const double collision_release = 0.2;        // In g
+static const double collision_release_time = 0.1;   // In seconds
+static const double collision_horizontal = 0.5;
+static const double collision_rise_time = 0.02;     // Longest time from the start of an impact to collision_accel, in seconds
+static const double collision_confirm_margin = 0.05;  // In seconds, see Collision_confirmTime()
+
+
+
+/* Design the filters for the sampling frequency odr, in Hz. Returns -1 on error */
+int Collision_init(Collision_t *c, double odr)
+{
+double *taps, fc;
+unsigned num_taps;
+int rc, i;
+
+   memset(c, 0, sizeof(*c));
+   c->odr = odr;
+   fc = collision_cutoff < odr/4 ? collision_cutoff : odr/4;
+   taps = LPFilter_design(fc, 3*fc, odr, &num_taps);
+   if (taps == NULL) return -1;
+   for (i = 0, rc = 0; i < 3 && rc == 0; i++) rc = FIRf_init(&c->filter[i], taps, num_taps);
+   free(taps);
+   if (rc < 0) return -1;
+   c->delay = (num_taps - 1)/2;
+   return 0;
+}
+
+
+void Collision_close(Collision_t *c)
+{
+int i;
+
+   for (i = 0; i < 3; i++) FIRf_close(&c->filter[i]);
+}
+
+
+/*
+Update the detector with the acceleration without gravity of a sample (a, in g), dt seconds after
+the previous one. Returns true while a collision is in progress.
+The direction of the impact is where the car was hit from, opposite to the acceleration at the peak
+of the collision, in the horizontal plane of the car: 0 degrees is the front, 90 the left side,
+-90 the right side and 180 the back.
+*/
+bool Collision_update(Collision_t *c, const double a[3], double dt)
+{
+double f[3], mag, jerk;
+int i;
+
+   c->samples++;
+   for (i = 0, jerk = 0; i < 3; i++) {
+      FIRf_put(&c->filter[i], a[i]);
+      f[i] = FIRf_get(&c->filter[i]);
+      jerk += (f[i] - c->a[i])*(f[i] - c->a[i]);
+      c->a[i] = f[i];
+   }
+   jerk = sqrt(jerk)/dt;
+   mag = sqrt(f[0]*f[0] + f[1]*f[1] + f[2]*f[2]);
+   if (!c->armed) return false;
+
+   if (!c->active) {
+      if (jerk > collision_jerk) c->jerk_sample = c->samples;
+      if (mag < collision_accel || (c->samples - c->jerk_sample)/c->odr > collision_jerk_time) return false;
+      if (hypot(f[0], f[1]) < collision_horizontal*mag) return false;
+      c->impact_sample = c->samples > c->delay ? c->samples - c->delay : 0;
+      c->quiet_sample = c->samples;
+      c->peak = 0;
+      c->active = true;
+   }
+   if (mag > c->peak) {
+      c->peak = mag;
+      c->direction = atan2(-f[1], -f[0])*180/M_PI;
+   }
+   if (mag > collision_release) c->quiet_sample = c->samples;
+   else if ((c->samples - c->quiet_sample)/c->odr > collision_release_time) c->active = false;
+   return c->active;
+}
+
+
+/* Longest time from the start of an impact at the threshold to its detection, in seconds */
+double Collision_latency(const Collision_t *c)
+{
+   return c->delay/c->odr + collision_rise_time;
+}
+
+
+/*
+Time after the interrupt of the accelerometer within which the collision must be detected, in seconds,
+when the samples are read every read_period seconds: the latency of the detector, the time until
+the read which brings the samples where it is detected, and a margin.
+*/
+double Collision_confirmTime(const Collision_t *c, double read_period)
+{
+   return Collision_latency(c) + read_period + collision_confirm_margin;
+}
@@ -0,0 +1,40 @@
+#ifndef COLLISION_H
+#define COLLISION_H
+
+/*************************************************************************
+Software collision detector of the IMU. It works on the acceleration of the car without gravity,
+in g, in the 3 axes of the sensor: the accelerometer samples minus the gravity given by the attitude
+of the fusion engine (see Fusion_getLinearAcceleration()). It is passed through a short low pass
+filter, much faster than the one used for the fusion, so that an impact is detected a few
+milliseconds after it happens.
+tools/collision_test checks it with synthetic impacts, at all the ODRs of the accelerometer.
+
+*****************************************************************************/
+
+#include <stdbool.h>
+#include "filter.h"
+
+
+typedef struct {
+  FIRf_t filter[3];          // Short low pass filters of the acceleration
+  double odr;                // Sampling frequency, in Hz
+  unsigned delay;            // Delay of the filters, in samples
+  double a[3];               // Last filtered acceleration, in g
+  unsigned long samples;     // Samples processed
+  unsigned long jerk_sample, quiet_sample;  // Last samples with a high jerk, and with a high acceleration
+  unsigned long impact_sample;  // Estimated sample of the start of the current (or last) collision
+  double peak;               // Peak of the magnitude during the current collision, in g
+  double direction;          // Direction the collision came from, at the peak, in degrees (see Collision_update())
+  bool armed;                // Set by the caller when the gravity is known; no collision is detected before
+  bool active;               // A collision is in progress
+} Collision_t;
+
+
+int Collision_init(Collision_t *c, double odr);
+void Collision_close(Collision_t *c);
+bool Collision_update(Collision_t *c, const double a[3], double dt);
+double Collision_latency(const Collision_t *c);
+double Collision_confirmTime(const Collision_t *c, double read_period);
+
+
+#endif // COLLISION_H
@@ -46,7 +46,7 @@ all copies or substantial portions of the Software.
 
 
 
-#define DEFAULT_g0 9.8189
+#define DEFAULT_g0 EKF_GRAVITY
 #define DEFAULT_state {0,0,1,0,0,0}
 #define DEFAULT_q_dcm2 (0.1*0.1)
 #define DEFAULT_q_gyro_bias2 (0.0001*0.0001)
@@ -54,109 +54,132 @@ all copies or substantial portions of the Software.
 #define DEFAULT_r_a2 (10*10)
 #define DEFAULT_q_dcm2_init (1*1)
 #define DEFAULT_q_gyro_bias2_init (0.1*0.1)
+#define DEFAULT_q_yaw2 (0.01*0.01)
+#define DEFAULT_r_mag2 (0.02*0.02)
+#define DEFAULT_p_yaw2_init (M_PI*M_PI)
+#define DEFAULT_mag_noise2 (0.1*0.1)
+#define DEFAULT_mag_gate 3
+#define DEFAULT_mag_norm_tol 0.15
+#define DEFAULT_mag_dip_tol (10*M_PI/180)
 
 #define VARIANCE_MIN_LIMIT (0.1*0) //set this to a small positive number or 0 to disable the feature.
 #define VARIANCE_SAFETY_INCREMENT (0.1*0) //set this to a small positive number or 0 to disable the feature.
 
-const double Gravity = DEFAULT_g0;  // A magnitude of gravity
-const double *State = NULL;  // An initial state as a array of six floats, DCM states and bias states
-const double *Covariance = NULL;  // A covariance matrix (size of 6x6 floats, array of 36 floats in row-major order). 
-//If a custom covariance matrix is given, parameters InitialDCMVariance and InitialBiasVariance are not used.
-const double DCMVariance = DEFAULT_q_dcm2;  // a variance for DCM state update, Q(0,0), Q(1,1), and Q(2,2)
-const double BiasVariance = DEFAULT_q_gyro_bias2;  // a variance for bias state update, Q(3,3), Q(4,4), and Q(5,5)
-const double InitialDCMVariance = DEFAULT_q_dcm2_init;  // an initial variance for DCM state, P(0,0), P(1,1), and P(2,2). If Covariance matrix is given, this parameter is not used.
-const double InitialBiasVariance = DEFAULT_q_gyro_bias2_init;  // an initial variance for bias state, P(3,3), P(4,4), and P(5,5). If Covariance matrix is given, this parameter is not used.
-const double MeasurementVariance = DEFAULT_r_acc2;  // a constant part of the variance for measurement update, R(0,0), R(1,1), and R(2,2)
-const double MeasurementVarianceVariableGain = DEFAULT_r_a2;  // a gain for the variable part of the variance for measurement update, R(0,0), R(1,1), and R(2,2)
-
-double g0, inv_g0, inv_g0_2;
-double x0, x1, x2, x3, x4, x5;
-double q_dcm2;
-double q_gyro_bias2;
-double r_acc2;
-double r_a2;
-double a0, a1, a2;
-double P00, P01, P02, P03, P04, P05;
-double P11, P12, P13, P14, P15;
-double P22, P23, P24, P25;
-double P33, P34, P35;
-double P44, P45;
-double P55;
-double fr0, fr1, fr2;
+
+
+/* Default parameters of the filter */
+void EKF_defaultParams(EKFParams_t *par)
+{
+   par->g0 = DEFAULT_g0;
+   par->q_dcm2 = DEFAULT_q_dcm2;
+   par->q_gyro_bias2 = DEFAULT_q_gyro_bias2;
+   par->r_acc2 = DEFAULT_r_acc2;
+   par->r_a2 = DEFAULT_r_a2;
+   par->p_dcm2_init = DEFAULT_q_dcm2_init;
+   par->p_gyro_bias2_init = DEFAULT_q_gyro_bias2_init;
+   par->state = NULL;
+   par->covariance = NULL;
+   par->q_yaw2 = DEFAULT_q_yaw2;
+   par->r_mag2 = DEFAULT_r_mag2;
+   par->p_yaw2_init = DEFAULT_p_yaw2_init;
+   par->mag_noise2 = DEFAULT_mag_noise2;
+   par->mag_gate = DEFAULT_mag_gate;
+   par->mag_norm_tol = DEFAULT_mag_norm_tol;
+   par->mag_dip_tol = DEFAULT_mag_dip_tol;
+}
+
+
+/* Set the filter to its initial state. If par is NULL, the default parameters are used */
+void EKF_init(EKF_t *e, const EKFParams_t *par)
+{
+double temp[] = DEFAULT_state;
+const double *C;
+int i;
+
+   if (par) e->par = *par;
+   else EKF_defaultParams(&e->par);
    
-extern double roll, pitch, yaw;
+   if (e->par.state != NULL) {
+      for (i = 0; i < 6; ++i) temp[i] = e->par.state[i];
+   }
+   e->x0 = temp[0]; e->x1 = temp[1]; e->x2 = temp[2]; e->x3 = temp[3]; e->x4 = temp[4]; e->x5 = temp[5];
+   C = e->par.covariance;
+   if (C == NULL) {
+      e->P00 = e->par.p_dcm2_init;
+      e->P01 = e->P02 = e->P03 = e->P04 = e->P05 = 0;
+      e->P11 = e->par.p_dcm2_init;
+      e->P12 = e->P13 = e->P14 = e->P15 = 0;
+      e->P22 = e->par.p_dcm2_init;
+      e->P23 = e->P24 = e->P25 = 0;
+      e->P33 = e->par.p_gyro_bias2_init;
+      e->P34 = e->P35 = 0;
+      e->P44 = e->par.p_gyro_bias2_init;
+      e->P45 = 0;
+      e->P55 = e->par.p_gyro_bias2_init;
+   }
+   else {
+      e->P00 = C[0]; e->P01 = C[1]; e->P02 = C[2]; e->P03 = C[3]; e->P04 = C[4]; e->P05 = C[5];
+      e->P11 = C[7]; e->P12 = C[8]; e->P13 = C[9]; e->P14 = C[10]; e->P15 = C[11];
+      e->P22 = C[14]; e->P23 = C[15]; e->P24 = C[16]; e->P25 = C[17];
+      e->P33 = C[21]; e->P34 = C[22]; e->P35 = C[23];
+      e->P44 = C[28]; e->P45 = C[29];
+      e->P55 = C[35];
+   }
+   
+   e->inv_g0 = 1.0 / e->par.g0;
+   e->inv_g0_2 = e->inv_g0 * e->inv_g0;
+   e->fr0 = 1.0; //first row for alternative rotation computation
+   e->fr1 = 0.0; //default is yaw = 0 which happens when fr = [1, 0, 0]
+   e->fr2 = 0.0;
+   e->a0 = e->a1 = e->a2 = 0;
+   e->roll = e->pitch = e->yaw = 0;
+   e->yaw_var = e->par.p_yaw2_init;
+   e->mag_norm = e->mag_dip = 0;
+   e->mag_field_time = e->mag_heading_time = 0;
+   e->mag_accepted = e->mag_rejected = 0;
+}
+
+
+/* Attitude estimated by the last call to EKF_update(), in degrees */
+void EKF_getAttitude(const EKF_t *e, double *yaw, double *pitch, double *roll)
+{
+   *yaw = e->yaw;
+   *pitch = e->pitch;
+   *roll = e->roll;
+}
 
 
+/* Non-gravitational acceleration estimated by the last call to EKF_update(), in m/s^2 */
+void EKF_getAcceleration(const EKF_t *e, double a[3])
+{
+   a[0] = e->a0;
+   a[1] = e->a1;
+   a[2] = e->a2;
+}
+
 
 /*    
 Gyroscope: Xgyro (u0 - in radians/sec), Ygyro (u1 - in radians/sec), Zgyro (u2 - in radians/sec), 
-Accelerometer: Xaccel (z0 - in g), Yaccel (z1 - in g), Zaccel (z2 - in g),
+Accelerometer: Xaccel (z0 - in m/s^2), Yaccel (z1 - in m/s^2), Zaccel (z2 - in m/s^2),
 interval (h - sample period)
+The state is copied to local variables, so that the compiler can keep it in registers 
+(it does not know whether the stores through e alias it), and stored back at the end.
 */
-void EKFUpdateStatus(double u0, double u1, double u2, double z0, double z1, double z2, double h)
+void EKF_update(EKF_t *e, double u0, double u1, double u2, double z0, double z1, double z2, double h)
 {
-double temp[] = DEFAULT_state;
 double x_last[3];
-int i;
-static bool initialized;
-
-   if (!initialized) {
-      if (State != NULL) {
-         for (i = 0; i < 6; ++i) temp[i] = State[i];
-      }
-      x0 = temp[0]; x1 = temp[1]; x2 = temp[2]; x3 = temp[3]; x4 = temp[4]; x5 = temp[5];
-      if (Covariance == NULL) {
-         P00 = InitialDCMVariance;
-         P01 = P02 = P03 = P04 = P05 = 0;
-         P11 = InitialDCMVariance;
-         P12 = P13 = P14 = P15 = 0;
-         P22 = InitialDCMVariance;
-         P23 = P24 = P25 = 0;
-         P33 = InitialBiasVariance;
-         P34 = P35 = 0;
-         P44 = InitialBiasVariance;
-         P45 = 0;
-         P55 = InitialBiasVariance;
-      }
-      else {
-         P00 = Covariance[0];
-         P01 = Covariance[1];
-         P02 = Covariance[2];
-         P03 = Covariance[3];
-         P04 = Covariance[4];
-         P05 = Covariance[5];
-         P11 = Covariance[7];
-         P12 = Covariance[8];
-         P13 = Covariance[9];
-         P14 = Covariance[10];
-         P15 = Covariance[11];
-         P22 = Covariance[14];
-         P23 = Covariance[15];
-         P24 = Covariance[16];
-         P25 = Covariance[17];
-         P33 = Covariance[21];
-         P34 = Covariance[22];
-         P35 = Covariance[23];
-         P44 = Covariance[28];
-         P45 = Covariance[29];
-         P55 = Covariance[35];
-      }
-   
-      g0 = Gravity;
-      q_dcm2 = DCMVariance;
-      q_gyro_bias2 = BiasVariance;
-      r_acc2 = MeasurementVariance;
-      r_a2 = MeasurementVarianceVariableGain;
-      
-      
-      inv_g0 = 1.0 / g0;
-      inv_g0_2 = inv_g0 * inv_g0;
-      fr0 = 1.0; //first row for alternative rotation computation
-      fr1 = 0.0; //default is yaw = 0 which happens when fr = [1, 0, 0]
-      fr2 = 0.0;
-      
-      initialized = true;
-   }
+const double g0 = e->par.g0, inv_g0 = e->inv_g0, inv_g0_2 = e->inv_g0_2;
+const double q_dcm2 = e->par.q_dcm2, q_gyro_bias2 = e->par.q_gyro_bias2;
+const double r_acc2 = e->par.r_acc2, r_a2 = e->par.r_a2;
+double x0 = e->x0, x1 = e->x1, x2 = e->x2, x3 = e->x3, x4 = e->x4, x5 = e->x5;
+double P00 = e->P00, P01 = e->P01, P02 = e->P02, P03 = e->P03, P04 = e->P04, P05 = e->P05;
+double P11 = e->P11, P12 = e->P12, P13 = e->P13, P14 = e->P14, P15 = e->P15;
+double P22 = e->P22, P23 = e->P23, P24 = e->P24, P25 = e->P25;
+double P33 = e->P33, P34 = e->P34, P35 = e->P35;
+double P44 = e->P44, P45 = e->P45;
+double P55 = e->P55;
+double fr0 = e->fr0, fr1 = e->fr1, fr2 = e->fr2;
+double yaw = e->yaw*M_PI/180;
 
 	// save last state to memory for rotation estimation
 	x_last[0] = x0;
@@ -396,17 +419,107 @@ static bool initialized;
 		fr2 *= invlen;
 
 		// calculate yaw from first and second row
-		yaw = 180/M_PI*atan2(sr0,fr0);
+		yaw = atan2(sr0,fr0);
 	}   
    
    // compute new pitch and roll angles from a posteriori states
-	pitch = 180/M_PI*asin(-x0);
-	roll = 180/M_PI*atan2(x1,x2);
+	yaw *= 180/M_PI;
+	double pitch = 180/M_PI*asin(-x0);
+	double roll = 180/M_PI*atan2(x1,x2);
 
 	// save the estimated non-gravitational acceleration
-	a0 = (z0-x0)*g0;
-	a1 = (z1-x1)*g0;
-	a2 = (z2-x2)*g0;
+	e->a0 = (z0-x0)*g0;
+	e->a1 = (z1-x1)*g0;
+	e->a2 = (z2-x2)*g0;
+
+   // store the state
+   e->x0 = x0; e->x1 = x1; e->x2 = x2; e->x3 = x3; e->x4 = x4; e->x5 = x5;
+   e->P00 = P00; e->P01 = P01; e->P02 = P02; e->P03 = P03; e->P04 = P04; e->P05 = P05;
+   e->P11 = P11; e->P12 = P12; e->P13 = P13; e->P14 = P14; e->P15 = P15;
+   e->P22 = P22; e->P23 = P23; e->P24 = P24; e->P25 = P25;
+   e->P33 = P33; e->P34 = P34; e->P35 = P35;
+   e->P44 = P44; e->P45 = P45;
+   e->P55 = P55;
+   e->fr0 = fr0; e->fr1 = fr1; e->fr2 = fr2;
+   e->yaw = yaw; e->pitch = pitch; e->roll = roll;
+   e->yaw_var += h*e->par.q_yaw2;
+}
+
+
+
+/*
+Sequential update of the heading with the magnetometer (m0, m1, m2, in any unit), after EKF_update().
+h is the time since the previous call, in s: the variance of the measurement is r_mag2/h, so that 
+the correction does not depend on how often it is called (eg at each sample, with the interpolated
+magnetometer data of imuRead()).
+The yaw is not a state of the EKF: it is kept as a scalar Kalman filter, whose variance grows with 
+q_yaw2 while the yaw is integrated from the gyroscope. The correction rotates the first row of the DCM
+around the vertical, towards the horizontal component of the field, which is taken as the X axis 
+of the world (magnetic north); the last row, and so the roll, pitch and gyroscope bias, are not changed. 
+The heading is only measured once the tilt has converged. A measurement is rejected (and the yaw keeps 
+being integrated) if the magnitude of the field or its angle with the vertical differ from their reference, 
+eg near iron or motors, or if the innovation is larger than mag_gate standard deviations. The reference 
+is learnt from the accepted measurements, and taken again if the field is rejected for EKF_MAG_RESET_TIME 
+(eg the car has moved to another place). If the heading is rejected for EKF_MAG_ACQUIRE_TIME, its variance 
+is set to the initial one, so that it is acquired again.
+*/
+void EKF_updateMag(EKF_t *e, double m0, double m1, double m2, double h)
+{
+double norm, dip, mv, mh0, mh1, mh2, ex, ey, sr0, sr1, sr2, innov, r, k, a, c, s, fr0, fr1, fr2;
 
+   norm = sqrt(m0*m0 + m1*m1 + m2*m2);
+   if (norm == 0 || h <= 0 || e->P00 + e->P11 + e->P22 > EKF_MAG_TILT_VARIANCE) return;
+   mv = m0*e->x0 + m1*e->x1 + m2*e->x2;  // Vertical component (upwards)
+   dip = acos(fmax(-1, fmin(1, mv/norm)));
+   
+   // Gate the disturbances of the field with its reference
+   if (e->mag_norm == 0 || e->mag_field_time > EKF_MAG_RESET_TIME) {
+      e->mag_norm = norm;
+      e->mag_dip = dip;
+   }
+   if (fabs(norm/e->mag_norm - 1) > e->par.mag_norm_tol || fabs(dip - e->mag_dip) > e->par.mag_dip_tol) {
+      e->mag_field_time += h;
+      e->mag_rejected++;
+      return;
+   }
+   e->mag_field_time = 0;
+   
+   // Heading of the horizontal component of the field, in the current estimate of the world frame
+   mh0 = m0 - mv*e->x0; mh1 = m1 - mv*e->x1; mh2 = m2 - mv*e->x2;
+   sr0 = e->x1*e->fr2 - e->x2*e->fr1;  // Second row of the DCM: last row x first row
+   sr1 = e->x2*e->fr0 - e->x0*e->fr2;
+   sr2 = e->x0*e->fr1 - e->x1*e->fr0;
+   ex = mh0*e->fr0 + mh1*e->fr1 + mh2*e->fr2;
+   ey = mh0*sr0 + mh1*sr1 + mh2*sr2;
+   innov = atan2(ey, ex);
+   
+   if (e->mag_heading_time > EKF_MAG_ACQUIRE_TIME) {
+      e->yaw_var = e->par.p_yaw2_init;
+      e->mag_heading_time = 0;
+   }
+   if (innov*innov > e->par.mag_gate*e->par.mag_gate*(e->yaw_var + e->par.mag_noise2)) {
+      e->mag_heading_time += h;
+      e->mag_rejected++;
+      return;
+   }
+   e->mag_heading_time = 0;
+   e->mag_accepted++;
+   e->mag_norm += (norm - e->mag_norm)*h/EKF_MAG_REFERENCE_TAU;
+   e->mag_dip += (dip - e->mag_dip)*h/EKF_MAG_REFERENCE_TAU;
+   
+   // Scalar Kalman update of the yaw
+   r = e->par.r_mag2/h;
+   k = e->yaw_var/(e->yaw_var + r);
+   e->yaw_var *= 1 - k;
+   a = k*innov;
+   
+   // Rotate the first row by a around the vertical, towards the field
+   c = cos(a); s = sin(a);
+   fr0 = c*e->fr0 + s*sr0;
+   fr1 = c*e->fr1 + s*sr1;
+   fr2 = c*e->fr2 + s*sr2;
+   e->fr0 = fr0; e->fr1 = fr1; e->fr2 = fr2;
+   sr0 = e->x1*fr2 - e->x2*fr1;
+   e->yaw = 180/M_PI*atan2(sr0, fr0);
 }
 
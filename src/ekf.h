@@ -1,8 +1,69 @@
 #ifndef EKF_H
 #define EKF_H
 
+/*************************************************************************
+DCM extended Kalman filter (see ekf.c). Each EKF_t is an independent instance, with its own 
+state, covariance and parameters, so several filters can run side by side, eg with different 
+parameters, or in different threads (an instance must not be used by two threads at the same time).
 
-void EKFUpdateStatus(double u0, double u1, double u2, double z0, double z1, double z2, double h);
+*****************************************************************************/
+
+
+#define EKF_GRAVITY 9.8189  // Magnitude of gravity, in m/s^2
+
+/* Magnetometer heading update, see EKF_updateMag() */
+#define EKF_MAG_TILT_VARIANCE 0.01  // The heading is not measured until the variance of the last row of the DCM is smaller
+#define EKF_MAG_REFERENCE_TAU 10.0  // Time constant of the reference magnitude and angle of the field, in s
+#define EKF_MAG_RESET_TIME 5.0      // After rejecting the field for this time, its reference is taken again
+#define EKF_MAG_ACQUIRE_TIME 30.0   // After rejecting the heading for this time, it is acquired again
+
+/* Parameters of the filter. EKF_defaultParams() fills in the values of the paper */
+typedef struct {
+  double g0;                   // Magnitude of gravity
+  double q_dcm2;               // Variance for DCM state update, Q(0,0), Q(1,1), and Q(2,2)
+  double q_gyro_bias2;         // Variance for bias state update, Q(3,3), Q(4,4), and Q(5,5)
+  double r_acc2;               // Constant part of the variance for measurement update, R(0,0), R(1,1), and R(2,2)
+  double r_a2;                 // Gain for the variable part of the variance for measurement update
+  double p_dcm2_init;          // Initial variance for DCM state, P(0,0), P(1,1), and P(2,2)
+  double p_gyro_bias2_init;    // Initial variance for bias state, P(3,3), P(4,4), and P(5,5)
+  const double *state;         // Initial state (6 values, DCM and bias states), or NULL for the default
+  const double *covariance;    // Initial covariance (6x6, row-major), or NULL to use p_dcm2_init and p_gyro_bias2_init
+  // Magnetometer heading update, EKF_updateMag()
+  double q_yaw2;               // Growth of the variance of the yaw integrated from the gyroscope, in rad^2/s
+  double r_mag2;               // Variance of the heading from the magnetometer, in rad^2*s (it is divided by the interval)
+  double p_yaw2_init;          // Initial variance of the yaw, in rad^2
+  double mag_noise2;           // Variance of the heading of a single measurement, in rad^2, for the gate
+  double mag_gate;             // Gate of the innovation of the heading, in standard deviations
+  double mag_norm_tol;         // Tolerance of the magnitude of the field, relative to its reference
+  double mag_dip_tol;          // Tolerance of the angle between the field and the vertical, in rad
+} EKFParams_t;
+
+typedef struct {
+  EKFParams_t par;
+  double inv_g0, inv_g0_2;
+  double x0, x1, x2, x3, x4, x5;                // State: last row of the DCM, and gyroscope bias
+  double P00, P01, P02, P03, P04, P05;          // Covariance, upper triangle
+  double P11, P12, P13, P14, P15;
+  double P22, P23, P24, P25;
+  double P33, P34, P35;
+  double P44, P45;
+  double P55;
+  double fr0, fr1, fr2;                         // First row of the DCM, for the yaw
+  double a0, a1, a2;                            // Estimated non-gravitational acceleration, in m/s^2
+  double roll, pitch, yaw;                      // Estimated attitude, in degrees
+  double yaw_var;                               // Variance of the yaw, in rad^2
+  double mag_norm, mag_dip;                     // Reference magnitude and angle with the vertical of the magnetic field
+  double mag_field_time, mag_heading_time;      // Time rejecting the magnetometer by its field and by its heading, in s
+  unsigned long mag_accepted, mag_rejected;     // Magnetometer measurements used and rejected by the gates
+} EKF_t;
+
+
+void EKF_defaultParams(EKFParams_t *par);
+void EKF_init(EKF_t *e, const EKFParams_t *par);
+void EKF_update(EKF_t *e, double u0, double u1, double u2, double z0, double z1, double z2, double h);
+void EKF_updateMag(EKF_t *e, double m0, double m1, double m2, double h);
+void EKF_getAttitude(const EKF_t *e, double *yaw, double *pitch, double *roll);
+void EKF_getAcceleration(const EKF_t *e, double a[3]);
 
 
 #endif // EKF_H
@@ -0,0 +1,340 @@
+/*************************************************************************
+
+Single precision DCM extended Kalman filter, see ekf32.h and ekf.c.
+
+The state is x = (DCM last row d, gyroscope bias b), and with the bias corrected rate w = u - b,
+the model is d' = d - h*(w x d), b' = b. The covariance P is 6x6 and symmetric. Its updates
+are written as products of matrices, using that the Jacobians of the prediction and of the
+normalization of d have the form
+
+        | M  N |
+    F = |      |       (M and N are 3x3)
+        | 0  I |
+
+so F*P only changes the first 3 rows of P, and F*P*F' = F*(F*P)', as P is symmetric.
+The matrices are kept unpacked during an update, as 6 rows of 8 floats (the last 2 are 0),
+so that the inner loops are operations on whole rows, of fixed length and without remainder
+(see row_madd()). Only the upper triangle is stored back, so the covariance stays exactly symmetric.
+
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "ekf32.h"
+
+
+#define N 6   // Size of the state
+#define W 8   // Length of the rows of the unpacked matrices
+
+typedef float Matrix_t[N][W];
+
+#define VARIANCE_MIN_LIMIT (0.1f*0) //set this to a small positive number or 0 to disable the feature.
+#define VARIANCE_SAFETY_INCREMENT (0.1f*0) //set this to a small positive number or 0 to disable the feature.
+
+/* Position of P(i,j) in the packed covariance */
+static const unsigned char packed[N][N] = {
+   { 0,  1,  2,  3,  4,  5},
+   { 1,  6,  7,  8,  9, 10},
+   { 2,  7, 11, 12, 13, 14},
+   { 3,  8, 12, 15, 16, 17},
+   { 4,  9, 13, 16, 18, 19},
+   { 5, 10, 14, 17, 19, 20}
+};
+
+
+
+/*
+r += g*a, for rows of W floats. GCC does not auto-vectorize float code for 32 bit NEON without
+-funsafe-math-optimizations, so there is a NEON version with intrinsics (2 vectors per row).
+The portable version is vectorized by the compiler on other targets; Pi Zero has no NEON.
+*/
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static inline void row_madd(float *restrict r, float g, const float *restrict a)
+{
+   vst1q_f32(r, vmlaq_n_f32(vld1q_f32(r), vld1q_f32(a), g));
+   vst1q_f32(r + 4, vmlaq_n_f32(vld1q_f32(r + 4), vld1q_f32(a + 4), g));
+}
+#else
+static inline void row_madd(float *restrict r, float g, const float *restrict a)
+{
+int j;
+
+   for (j = 0; j < W; j++) r[j] += g*a[j];
+}
+#endif
+
+
+static void unpack(const float *restrict p, Matrix_t P)
+{
+int i, j;
+
+   memset(P, 0, sizeof(Matrix_t));
+   for (i = 0; i < N; i++)
+      for (j = 0; j < N; j++) P[i][j] = p[packed[i][j]];
+}
+
+
+static void pack(const Matrix_t P, float *restrict p)
+{
+int i, j;
+
+   for (i = 0; i < N; i++)
+      for (j = i; j < N; j++) p[packed[i][j]] = P[i][j];
+}
+
+
+/* C = F*B, where F has the form of the header: only its first 3 rows (F3) are given */
+static void mul_top(const float F3[restrict 3][W], const float B[restrict N][W], float C[restrict N][W])
+{
+int i, j, k;
+
+   for (i = 0; i < 3; i++) {
+      for (j = 0; j < W; j++) C[i][j] = 0;
+      for (k = 0; k < N; k++) row_madd(C[i], F3[i][k], B[k]);
+   }
+   memcpy(C[3], B[3], 3*sizeof(C[0]));
+}
+
+
+/* P = F*P*F', where F has the form of the header and P is symmetric */
+static void congruence(const float F3[3][W], Matrix_t P)
+{
+Matrix_t T, Tt;
+int i, j;
+
+   mul_top(F3, P, T);
+   memset(Tt, 0, sizeof(Tt));
+   for (i = 0; i < N; i++)
+      for (j = 0; j < N; j++) Tt[i][j] = T[j][i];
+   mul_top(F3, Tt, P);
+}
+
+
+
+/* Set the filter to its initial state. If par is NULL, the default parameters are used */
+void EKF32_init(EKF32_t *e, const EKFParams_t *par)
+{
+static const float state[N] = {0, 0, 1, 0, 0, 0};
+int i, j;
+
+   memset(e, 0, sizeof(*e));
+   if (par) e->par = *par;
+   else EKF_defaultParams(&e->par);
+
+   for (i = 0; i < N; i++) e->x[i] = e->par.state? e->par.state[i] : state[i];
+   for (i = 0; i < N; i++) {
+      if (e->par.covariance) {
+         for (j = i; j < N; j++) e->P[packed[i][j]] = e->par.covariance[i*N+j];
+      }
+      else e->P[packed[i][i]] = i<3? e->par.p_dcm2_init : e->par.p_gyro_bias2_init;
+   }
+   e->inv_g0 = 1.0 / e->par.g0;
+   e->inv_g0_2 = e->inv_g0 * e->inv_g0;
+   e->fr[0] = 1.0f;  // default is yaw = 0 which happens when fr = [1, 0, 0]
+   e->yaw_var = e->par.p_yaw2_init;
+}
+
+
+/* Attitude estimated by the last call to EKF32_update(), in degrees */
+void EKF32_getAttitude(const EKF32_t *e, double *yaw, double *pitch, double *roll)
+{
+   *yaw = e->yaw;
+   *pitch = e->pitch;
+   *roll = e->roll;
+}
+
+
+/* Non-gravitational acceleration estimated by the last call to EKF32_update(), in m/s^2 */
+void EKF32_getAcceleration(const EKF32_t *e, double a[3])
+{
+   a[0] = e->a[0];
+   a[1] = e->a[1];
+   a[2] = e->a[2];
+}
+
+
+/*
+Same inputs as EKF_update(): gyroscope (u, in rad/s), accelerometer (z, in m/s^2),
+and interval (h - sample period, in s)
+*/
+void EKF32_update(EKF32_t *e, float u0, float u1, float u2, float z0, float z1, float z2, float h)
+{
+_Alignas(16) Matrix_t P;
+_Alignas(16) float PH[3][W], K[3][W], xp[W];
+float F3[3][W] = {{0}};
+float S[3][3], Si[3][3], y[3], d[3], w[3], sr[3], fr[3];
+float hh = h*h, q_dcm = hh*(float)e->par.q_dcm2, q_bias = hh*(float)e->par.q_gyro_bias2;
+float det, r, len, inv, inv_len3;
+int i, j, k;
+
+   unpack(e->P, P);
+   memcpy(d, e->x, sizeof(d));  // Last state, for the yaw
+
+   /*** Prediction ***/
+   w[0] = u0 - e->x[3]; w[1] = u1 - e->x[4]; w[2] = u2 - e->x[5];
+   memcpy(xp, e->x, sizeof(xp));
+   xp[0] = d[0] - h*(w[1]*d[2] - w[2]*d[1]);
+   xp[1] = d[1] - h*(w[2]*d[0] - w[0]*d[2]);
+   xp[2] = d[2] - h*(w[0]*d[1] - w[1]*d[0]);
+
+   // Jacobian: M = I - h*[w]x, N = -h*[d]x
+   F3[0][0] = 1;       F3[0][1] = h*w[2];  F3[0][2] = -h*w[1]; F3[0][3] = 0;       F3[0][4] = h*d[2];  F3[0][5] = -h*d[1];
+   F3[1][0] = -h*w[2]; F3[1][1] = 1;       F3[1][2] = h*w[0];  F3[1][3] = -h*d[2]; F3[1][4] = 0;       F3[1][5] = h*d[0];
+   F3[2][0] = h*w[1];  F3[2][1] = -h*w[0]; F3[2][2] = 1;       F3[2][3] = h*d[1];  F3[2][4] = -h*d[0]; F3[2][5] = 0;
+   congruence(F3, P);
+   for (i = 0; i < 3; i++) P[i][i] += q_dcm;
+   for (i = 3; i < N; i++) P[i][i] += q_bias;
+
+   /*** Measurement update (accelerometers, H = [I 0]) ***/
+   z0 *= e->inv_g0; z1 *= e->inv_g0; z2 *= e->inv_g0;
+   y[0] = z0 - xp[0]; y[1] = z1 - xp[1]; y[2] = z2 - xp[2];
+   r = ((float)e->par.r_acc2 + sqrtf(y[0]*y[0]+y[1]*y[1]+y[2]*y[2])*(float)e->par.g0*(float)e->par.r_a2) * e->inv_g0_2;
+
+   // innovation covariance S = H*P*H' + R, and its inverse
+   for (i = 0; i < 3; i++)
+      for (j = 0; j < 3; j++) S[i][j] = P[i][j];
+   for (i = 0; i < 3; i++) {
+      S[i][i] += r;
+      if (S[i][i] < VARIANCE_MIN_LIMIT) S[i][i] = VARIANCE_MIN_LIMIT;
+   }
+   Si[0][0] = S[1][1]*S[2][2] - S[1][2]*S[1][2];
+   Si[0][1] = S[0][2]*S[1][2] - S[0][1]*S[2][2];
+   Si[0][2] = S[0][1]*S[1][2] - S[0][2]*S[1][1];
+   Si[1][1] = S[0][0]*S[2][2] - S[0][2]*S[0][2];
+   Si[1][2] = S[0][1]*S[0][2] - S[0][0]*S[1][2];
+   Si[2][2] = S[0][0]*S[1][1] - S[0][1]*S[0][1];
+   det = S[0][0]*Si[0][0] + S[0][1]*Si[0][1] + S[0][2]*Si[0][2];
+   inv = 1.0f / det;
+   for (i = 0; i < 3; i++)
+      for (j = i; j < 3; j++) Si[j][i] = Si[i][j] *= inv;
+
+   // Kalman gain K = P*H'*inv(S); row k of K holds its column k. P*H' are the first 3 columns of P,
+   // which are its first 3 rows (PH), as P is symmetric
+   memcpy(PH, P, sizeof(PH));
+   for (k = 0; k < 3; k++) {
+      for (j = 0; j < W; j++) K[k][j] = 0;
+      for (i = 0; i < 3; i++) row_madd(K[k], Si[i][k], PH[i]);
+   }
+
+   // a posteriori state: x = x + K*y
+   for (k = 0; k < 3; k++) row_madd(xp, y[k], K[k]);
+
+   // a posteriori covariance, in Joseph form as ekf.c: P = (I-K*H)*P*(I-K*H)' + K*R*K', with R = r*I.
+   // It keeps P positive definite in single precision, where P - K*H*P loses it.
+   // First T = (I-K*H)*P = P - K*H*P, then P = T - T*H'*K' + r*K*K', row by row
+   for (i = 0; i < N; i++)
+      for (k = 0; k < 3; k++) row_madd(P[i], -K[k][i], PH[k]);
+   for (i = 0; i < N; i++) {
+      const float t[3] = {P[i][0], P[i][1], P[i][2]};  // Row i of T*H'
+      for (k = 0; k < 3; k++) row_madd(P[i], r*K[k][i] - t[k], K[k]);
+   }
+
+   /*** Normalization of the DCM row, and of the covariance with its Jacobian (I - x*x'/|x|^2)/|x| ***/
+   len = sqrtf(xp[0]*xp[0] + xp[1]*xp[1] + xp[2]*xp[2]);
+   inv_len3 = 1.0f / (len*len*len);
+   memset(F3, 0, sizeof(F3));
+   for (i = 0; i < 3; i++)
+      for (j = 0; j < 3; j++) F3[i][j] = ((i==j? len*len : 0) - xp[i]*xp[j]) * inv_len3;
+   congruence(F3, P);
+   for (i = 0; i < N; i++) {
+      P[i][i] += VARIANCE_SAFETY_INCREMENT;
+      if (P[i][i] < VARIANCE_MIN_LIMIT) P[i][i] = VARIANCE_MIN_LIMIT;
+   }
+   xp[0] /= len; xp[1] /= len; xp[2] /= len;
+   pack(P, e->P);
+   memcpy(e->x, xp, sizeof(e->x));
+
+   /*** Euler angles, integrating the first row of the DCM as in ekf.c ***/
+   w[0] = u0 - xp[3]; w[1] = u1 - xp[4]; w[2] = u2 - xp[5];
+   memcpy(fr, e->fr, sizeof(fr));
+   sr[0] = -fr[1]*d[2]+fr[2]*d[1]-h*(d[1]*(fr[1]*w[0]-fr[0]*w[1])+d[2]*(fr[2]*w[0]-fr[0]*w[2]));
+   sr[1] = fr[0]*d[2]-fr[2]*d[0]+h*(d[0]*(fr[1]*w[0]-fr[0]*w[1])-d[2]*(fr[2]*w[1]-fr[1]*w[2]));
+   sr[2] = -fr[0]*d[1]+fr[1]*d[0]+h*(d[0]*(fr[2]*w[0]-fr[0]*w[2])+d[1]*(fr[2]*w[1]-fr[1]*w[2]));
+   inv = 1.0f / sqrtf(sr[0]*sr[0] + sr[1]*sr[1] + sr[2]*sr[2]);
+   sr[0] *= inv; sr[1] *= inv; sr[2] *= inv;
+
+   // recompute the first row (ensure perpendicularity)
+   fr[0] = sr[1]*d[2] - sr[2]*d[1];
+   fr[1] = -sr[0]*d[2] + sr[2]*d[0];
+   fr[2] = sr[0]*d[1] - sr[1]*d[0];
+   inv = 1.0f / sqrtf(fr[0]*fr[0] + fr[1]*fr[1] + fr[2]*fr[2]);
+   e->fr[0] = fr[0]*inv; e->fr[1] = fr[1]*inv; e->fr[2] = fr[2]*inv;
+
+   e->yaw = 180/M_PI*atan2f(sr[0], e->fr[0]);
+   e->pitch = 180/M_PI*asinf(-xp[0]);
+   e->roll = 180/M_PI*atan2f(xp[1], xp[2]);
+
+   // save the estimated non-gravitational acceleration
+   e->a[0] = (z0-xp[0])*(float)e->par.g0;
+   e->a[1] = (z1-xp[1])*(float)e->par.g0;
+   e->a[2] = (z2-xp[2])*(float)e->par.g0;
+   e->yaw_var += h*(float)e->par.q_yaw2;
+}
+
+
+/* Magnetometer heading update, as EKF_updateMag() */
+void EKF32_updateMag(EKF32_t *e, float m0, float m1, float m2, float h)
+{
+const float *x = e->x;
+float norm, dip, mv, mh[3], sr[3], fr[3], ex, ey, innov, r, k, a, c, s, gate2;
+
+   norm = sqrtf(m0*m0 + m1*m1 + m2*m2);
+   if (norm == 0 || h <= 0 || e->P[packed[0][0]] + e->P[packed[1][1]] + e->P[packed[2][2]] > EKF_MAG_TILT_VARIANCE) return;
+   mv = m0*x[0] + m1*x[1] + m2*x[2];
+   dip = acosf(fmaxf(-1, fminf(1, mv/norm)));
+
+   // Gate the disturbances of the field with its reference
+   if (e->mag_norm == 0 || e->mag_field_time > EKF_MAG_RESET_TIME) {
+      e->mag_norm = norm;
+      e->mag_dip = dip;
+   }
+   if (fabsf(norm/e->mag_norm - 1) > (float)e->par.mag_norm_tol || fabsf(dip - e->mag_dip) > (float)e->par.mag_dip_tol) {
+      e->mag_field_time += h;
+      e->mag_rejected++;
+      return;
+   }
+   e->mag_field_time = 0;
+
+   // Heading of the horizontal component of the field, in the current estimate of the world frame
+   mh[0] = m0 - mv*x[0]; mh[1] = m1 - mv*x[1]; mh[2] = m2 - mv*x[2];
+   sr[0] = x[1]*e->fr[2] - x[2]*e->fr[1];
+   sr[1] = x[2]*e->fr[0] - x[0]*e->fr[2];
+   sr[2] = x[0]*e->fr[1] - x[1]*e->fr[0];
+   ex = mh[0]*e->fr[0] + mh[1]*e->fr[1] + mh[2]*e->fr[2];
+   ey = mh[0]*sr[0] + mh[1]*sr[1] + mh[2]*sr[2];
+   innov = atan2f(ey, ex);
+
+   if (e->mag_heading_time > EKF_MAG_ACQUIRE_TIME) {
+      e->yaw_var = e->par.p_yaw2_init;
+      e->mag_heading_time = 0;
+   }
+   gate2 = (float)(e->par.mag_gate*e->par.mag_gate);
+   if (innov*innov > gate2*(e->yaw_var + (float)e->par.mag_noise2)) {
+      e->mag_heading_time += h;
+      e->mag_rejected++;
+      return;
+   }
+   e->mag_heading_time = 0;
+   e->mag_accepted++;
+   e->mag_norm += (norm - e->mag_norm)*h/(float)EKF_MAG_REFERENCE_TAU;
+   e->mag_dip += (dip - e->mag_dip)*h/(float)EKF_MAG_REFERENCE_TAU;
+
+   // Scalar Kalman update of the yaw, and rotation of the first row around the vertical
+   r = (float)e->par.r_mag2/h;
+   k = e->yaw_var/(e->yaw_var + r);
+   e->yaw_var *= 1 - k;
+   a = k*innov;
+   c = cosf(a); s = sinf(a);
+   fr[0] = c*e->fr[0] + s*sr[0];
+   fr[1] = c*e->fr[1] + s*sr[1];
+   fr[2] = c*e->fr[2] + s*sr[2];
+   memcpy(e->fr, fr, sizeof(fr));
+   e->yaw = 180/M_PI*atan2f(x[1]*fr[2] - x[2]*fr[1], fr[0]);
+}
@@ -0,0 +1,42 @@
+#ifndef EKF32_H
+#define EKF32_H
+
+/*************************************************************************
+Single precision version of the DCM extended Kalman filter of ekf.c, for CPUs where double is 
+expensive (Pi Zero) or to use the NEON unit (Pi 2/3, which has no double precision NEON).
+It uses the same model and parameters, and the Joseph form of the covariance update, but the matrices are computed with operations 
+on rows of 8 floats, instead of the expanded scalar expressions of ekf.c. They use NEON intrinsics if the compiler targets it 
+(see row_madd() in ekf32.c), otherwise a loop which the compiler vectorizes on other targets. 
+The covariance is symmetric: only its 21 unique terms are stored, packed by rows.
+tools/ekf_compare compares its accuracy and speed with ekf.c on a recording of the IMU.
+
+*****************************************************************************/
+
+#include "ekf.h"
+
+
+#define EKF32_PACKED 24   // 21 unique terms of the covariance, padded to a multiple of 4
+
+typedef struct {
+  EKFParams_t par;
+  float inv_g0, inv_g0_2;
+  _Alignas(16) float x[8];              // State: last row of the DCM, and gyroscope bias; padded with 0
+  _Alignas(16) float P[EKF32_PACKED];   // Covariance, upper triangle packed by rows: P00..P05, P11..P15, ..., P55
+  float fr[3];                          // First row of the DCM, for the yaw
+  float a[3];                           // Estimated non-gravitational acceleration, in m/s^2
+  float roll, pitch, yaw;               // Estimated attitude, in degrees
+  float yaw_var;                        // Variance of the yaw, in rad^2 (see EKF_updateMag())
+  float mag_norm, mag_dip;              // Reference magnitude and angle with the vertical of the magnetic field
+  float mag_field_time, mag_heading_time;  // Time rejecting the magnetometer by its field and by its heading, in s
+  unsigned long mag_accepted, mag_rejected;
+} EKF32_t;
+
+
+void EKF32_init(EKF32_t *e, const EKFParams_t *par);
+void EKF32_update(EKF32_t *e, float u0, float u1, float u2, float z0, float z1, float z2, float h);
+void EKF32_updateMag(EKF32_t *e, float m0, float m1, float m2, float h);
+void EKF32_getAttitude(const EKF32_t *e, double *yaw, double *pitch, double *roll);
+void EKF32_getAcceleration(const EKF32_t *e, double a[3]);
+
+
+#endif // EKF32_H
@@ -0,0 +1,404 @@
+/*************************************************************************
+
+Digital FIR filters used by the IMU module.
+Filter_t is a plain FIR filter with a circular history buffer.
+Interpolator_t is a polyphase interpolating filter, used for upsampling.
+FIRf_t is a single precision FIR filter with a mirrored history, for the hot path.
+LPFilter_design() calculates low pass taps for any sampling frequency.
+Its dot product uses NEON if the compiler targets it (eg Raspberry Pi 2/3 with -mfpu=neon),
+otherwise a portable version which the compiler can auto-vectorize (Pi Zero has no NEON).
+
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "filter.h"
+
+
+#define ERR(ret, format, arg...)                                       \
+   {                                                                   \
+         fprintf(stderr, "%s: " format "\n" , __func__ , ## arg);      \
+         return ret;                                                   \
+   }
+
+   
+
+/*****************************************************
+
+Digital FIR filter. A LPF is used for filterig magnetometer data.
+It is used to interpolate after upsampling from ODR_M to ODR_AG.
+It is designed to work with these combinations (upsampling x3 or x6):
+ODR_M=80, ODR_AG=476; ODR_M=80, ODR_AG=238;
+ODR_M=40, ODR_AG=238; ODR_M=40, ODR_AG=119; 
+ODR_M=20, ODR_AG=119; ODR_M=20, ODR_AG=59.5; 
+ODR_M=10, ODR_AG=59.5; 
+
+******************************************************/
+/*
+
+FIR filter designed with
+ http://t-filter.appspot.com
+
+sampling frequency: 240 Hz
+
+* 0 Hz - 4 Hz
+  gain = 1
+  desired ripple = 2 dB
+  actual ripple = 1.0141307953166252 dB
+
+* 5 Hz - 19 Hz
+  gain = 1
+  desired ripple = 35 dB
+  actual ripple = 33.758521533154735 dB
+
+* 20 Hz - 120 Hz
+  gain = 0
+  desired attenuation = -40 dB
+  actual attenuation = -43.613766226277974 dB
+
+*/
+
+double LP_20_240_filter_taps[] = {
+  0.0017433948030936106,
+  0.009143190985861756,
+  0.012133516280499421,
+  0.01983655704542007,
+  0.02830242809740451,
+  0.03812682806131509,
+  0.048540195172121076,
+  0.05892094411702151,
+  0.06848428950018577,
+  0.07647321877548367,
+  0.08222112771837956,
+  0.08523022650867189,
+  0.08523022650867189,
+  0.08222112771837956,
+  0.07647321877548367,
+  0.06848428950018577,
+  0.05892094411702151,
+  0.048540195172121076,
+  0.03812682806131509,
+  0.02830242809740451,
+  0.01983655704542007,
+  0.012133516280499421,
+  0.009143190985861756,
+  0.0017433948030936106
+};
+
+
+/*
+
+FIR filter designed with
+ http://t-filter.appspot.com
+
+sampling frequency: 240 Hz
+
+* 0 Hz - 2 Hz
+  gain = 1
+  desired ripple = 2 dB
+  actual ripple = 0.9673152635399324 dB
+
+* 3 Hz - 9 Hz
+  gain = 1
+  desired ripple = 35 dB
+  actual ripple = 26.642185422323546 dB
+
+* 10 Hz - 120 Hz
+  gain = 0
+  desired attenuation = -40 dB
+  actual attenuation = -41.61351226633883 dB
+
+*/
+
+double LP_10_240_filter_taps[] = {
+  0.005971139238851345,
+  0.004284876252226764,
+  0.005706608900364033,
+  0.007354427109791928,
+  0.0092055716099583,
+  0.01126528584840552,
+  0.013511905734478582,
+  0.015911620908019886,
+  0.018440918457958876,
+  0.021063915357805933,
+  0.023731627358926564,
+  0.026398828810262873,
+  0.029019156588604933,
+  0.03154122957077722,
+  0.033914554393050085,
+  0.036088808744910154,
+  0.03801579844329516,
+  0.039655081367493177,
+  0.04097170597229545,
+  0.041935178632098835,
+  0.04252308474795214,
+  0.042720929310042295,
+  0.04252308474795214,
+  0.041935178632098835,
+  0.04097170597229545,
+  0.039655081367493177,
+  0.03801579844329516,
+  0.036088808744910154,
+  0.033914554393050085,
+  0.03154122957077722,
+  0.029019156588604933,
+  0.026398828810262873,
+  0.023731627358926564,
+  0.021063915357805933,
+  0.018440918457958876,
+  0.015911620908019886,
+  0.013511905734478582,
+  0.01126528584840552,
+  0.0092055716099583,
+  0.007354427109791928,
+  0.005706608900364033,
+  0.004284876252226764,
+  0.005971139238851345
+};
+
+
+/*
+Design a low pass FIR filter with the windowed sinc method, using a Hamming window
+(about 53 dB of stopband attenuation). All frequencies are in Hz.
+The cutoff frequency fc is the -6 dB point, in the middle of the transition band, whose width
+is trans_bw. The number of taps is 3.3*fs/trans_bw, rounded up to an odd number (so the filter 
+has an integer delay). The DC gain is 1.
+Returns an array of taps allocated with malloc and stores its size in tap_list_size, or NULL on error.
+*/
+double *LPFilter_design(double fc, double trans_bw, double fs, unsigned *tap_list_size)
+{
+double *taps, x, sum = 0;
+unsigned n, i;
+
+   if (tap_list_size == NULL) ERR(NULL, "Invalid size pointer");
+   if (fc <= 0 || fc >= fs/2 || trans_bw <= 0) ERR(NULL, "Invalid filter frequencies: fc=%g Hz, fs=%g Hz", fc, fs);
+   n = ceil(3.3*fs/trans_bw);
+   n |= 1;
+   taps = malloc(n*sizeof(double));
+   if (taps == NULL) ERR(NULL, "Cannot allocate memory: %s", strerror(errno));
+   for (i = 0; i < n; i++) {
+      x = i - (n-1)/2.0;  // Distance to the center tap
+      taps[i] = x==0 ? 2*fc/fs : sin(2*M_PI*fc/fs*x)/(M_PI*x);
+      if (n > 1) taps[i] *= 0.54 - 0.46*cos(2*M_PI*i/(n-1));
+      sum += taps[i];
+   }
+   for (i = 0; i < n; i++) taps[i] /= sum;
+   *tap_list_size = n;
+   return taps;
+}
+
+
+int LPFilter_init(Filter_t *f, double *tap_array, unsigned tap_list_size) 
+{
+   if (f == NULL) ERR(-1, "Invalid filter descriptor");
+   if (tap_array == NULL || tap_list_size == 0) ERR(-1, "Invalid tap array for filter");
+   f->last_index = 0;
+   f->taps_num = tap_list_size;
+   f->taps = tap_array;
+   f->history = calloc(tap_list_size, sizeof(double));
+   if (f->history == NULL) ERR(-1, "Cannot allocate memory: %s", strerror(errno));
+   return 0;
+}
+
+
+void LPFilter_close(Filter_t *f) 
+{
+   if (f->history) free(f->history);
+   f->history = NULL;
+}
+
+
+void LPFilter_setDCgain(Filter_t *f, double gain_value)
+{
+int i;
+double DC_gain = 0;  
+
+   if (f == NULL) ERR(, "Invalid filter descriptor");
+   // Calculate current DC gain
+   for (i = 0; i < f->taps_num; i++) DC_gain += f->taps[i];
+   if (DC_gain == 0) ERR(, "DC gain of filter is zero, cannot set gain");
+   // Now, change taps so that the new DC gain is 'gain_value'
+   for (i = 0; i < f->taps_num; i++) f->taps[i] *= gain_value/DC_gain;     
+}
+
+
+
+/*
+Initialise a polyphase interpolator for upsampling by 'factor', using the low pass filter
+given in tap_array (designed for the upsampled rate).
+When upsampling by zero-stuffing, only one of every 'factor' samples in the filter history 
+is not zero. For output phase p (0 <= p < factor), the non-zero samples meet the taps 
+p, p+factor, p+2*factor... so each phase is a short filter of ceil(taps/factor) taps. 
+The taps are copied, reordered by phase and scaled so that the DC gain is 'factor', 
+compensating the gain reduction due to the 0-valued samples. The tap array is not modified.
+*/
+int Interpolator_init(Interpolator_t *f, const double *tap_array, unsigned tap_list_size, unsigned factor)
+{
+int p, j;
+double DC_gain = 0;  
+
+   if (f == NULL) ERR(-1, "Invalid filter descriptor");
+   if (tap_array == NULL || tap_list_size == 0) ERR(-1, "Invalid tap array for filter");
+   if (factor == 0) ERR(-1, "Invalid upsampling factor");
+   
+   for (j = 0; j < tap_list_size; j++) DC_gain += tap_array[j];
+   if (DC_gain == 0) ERR(-1, "DC gain of filter is zero, cannot set gain");
+   
+   f->factor = factor;
+   f->phase = 0;
+   f->last_index = 0;
+   f->phase_len = (tap_list_size + factor - 1)/factor;
+   f->history = calloc(f->phase_len, sizeof(double));
+   f->phase_taps = calloc(factor*f->phase_len, sizeof(double));  // Taps beyond tap_list_size stay as 0
+   if (f->history == NULL || f->phase_taps == NULL) {
+      Interpolator_close(f);
+      ERR(-1, "Cannot allocate memory: %s", strerror(errno));
+   }
+   
+   for (p = 0; p < factor; p++) 
+      for (j = 0; p + j*factor < tap_list_size; j++) 
+         f->phase_taps[p*f->phase_len + j] = tap_array[p + j*factor] * factor/DC_gain;
+   return 0;
+}
+
+
+void Interpolator_close(Interpolator_t *f) 
+{
+   if (f->history) free(f->history);
+   if (f->phase_taps) free(f->phase_taps);
+   f->history = f->phase_taps = NULL;
+}
+
+
+/*
+Get the next output sample of the interpolator, at the upsampled rate.
+It must be called 'factor' times per input sample. The input value is only taken 
+in phase 0; in the other phases it is ignored (it corresponds to a 0-valued sample).
+*/
+double Interpolator_get(Interpolator_t *f, double input)
+{
+double acc = 0;
+const double *taps;
+int index, j;
+
+   if (f->phase == 0) {
+      f->history[f->last_index++] = input;
+      if (f->last_index == f->phase_len) f->last_index = 0;
+   }
+   
+   taps = f->phase_taps + f->phase*f->phase_len;
+   index = f->last_index;
+   for (j = 0; j < f->phase_len; j++) {
+      index = (index != 0) ? index-1 : f->phase_len-1;
+      acc += f->history[index] * taps[j];
+   }
+   
+   if (++f->phase == f->factor) f->phase = 0;
+   return acc;
+}
+
+
+/*
+Get the next n output samples of the interpolator, for the same input value.
+As in Interpolator_get(), the input is only taken when phase 0 is reached.
+*/
+void Interpolator_block(Interpolator_t *f, double input, double *output, unsigned n)
+{
+unsigned i;
+
+   for (i = 0; i < n; i++) output[i] = Interpolator_get(f, input);
+}
+
+
+
+int FIRf_init(FIRf_t *f, const double *tap_array, unsigned tap_list_size)
+{
+int i;
+
+   if (f == NULL) ERR(-1, "Invalid filter descriptor");
+   if (tap_array == NULL || tap_list_size == 0) ERR(-1, "Invalid tap array for filter");
+   f->last_index = 0;
+   f->taps_num = tap_list_size;
+   f->taps_len = (tap_list_size + 3) & ~3;  // Round up to a multiple of 4
+   f->history = calloc(f->taps_num + f->taps_len, sizeof(float));
+   f->taps = aligned_alloc(16, f->taps_len*sizeof(float));
+   if (f->history == NULL || f->taps == NULL) {
+      FIRf_close(f);
+      ERR(-1, "Cannot allocate memory: %s", strerror(errno));
+   }
+   
+   // Reverse order: taps[0] is applied to the oldest sample. Padding taps are 0
+   for (i = 0; i < f->taps_len; i++) 
+      f->taps[i] = (i < tap_list_size) ? tap_array[tap_list_size-1-i] : 0.0f;
+   return 0;
+}
+
+
+void FIRf_close(FIRf_t *f) 
+{
+   if (f->history) free(f->history);
+   if (f->taps) free(f->taps);
+   f->history = f->taps = NULL;
+}
+
+
+void FIRf_setDCgain(FIRf_t *f, float gain_value)
+{
+int i;
+float DC_gain = 0;  
+
+   if (f == NULL) ERR(, "Invalid filter descriptor");
+   for (i = 0; i < f->taps_len; i++) DC_gain += f->taps[i];
+   if (DC_gain == 0) ERR(, "DC gain of filter is zero, cannot set gain");
+   for (i = 0; i < f->taps_len; i++) f->taps[i] *= gain_value/DC_gain;     
+}
+
+
+/*
+Dot product of n floats, n must be a multiple of 4. 
+'taps' must be 16 byte aligned, 'x' can have any alignment.
+*/
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+float FIRf_dot(const float *x, const float *taps, unsigned n)
+{
+float32x4_t acc = vdupq_n_f32(0.0f);
+float32x2_t sum;
+unsigned i;
+
+   for (i = 0; i < n; i += 4) 
+      acc = vmlaq_f32(acc, vld1q_f32(x + i), vld1q_f32(taps + i));
+   sum = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+   return vget_lane_f32(vpadd_f32(sum, sum), 0);
+}
+#else
+float FIRf_dot(const float *restrict x, const float *restrict taps, unsigned n)
+{
+float acc[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+unsigned i, j;
+
+   // 4 independent accumulators, so that the compiler can use SIMD without reordering sums
+   for (i = 0; i < n; i += 4) 
+      for (j = 0; j < 4; j++) acc[j] += x[i+j] * taps[i+j];
+   return (acc[0] + acc[2]) + (acc[1] + acc[3]);
+}
+#endif
+
+
+/* Filter n samples: output[i] is the filter output after input[i] is put in the filter */
+void FIRf_block(FIRf_t *f, const float *input, float *output, unsigned n)
+{
+unsigned i;
+
+   for (i = 0; i < n; i++) {
+      FIRf_put(f, input[i]);
+      output[i] = FIRf_dot(f->history + f->last_index, f->taps, f->taps_len);
+   }
+}
@@ -0,0 +1,99 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+/*************************************************************************
+Digital FIR filters used by the IMU module
+
+*****************************************************************************/
+
+
+typedef struct {
+  double *history, *taps;
+  unsigned int last_index, taps_num;
+} Filter_t;
+
+
+/*
+Polyphase interpolator. It is equivalent to inserting factor-1 0-valued samples
+after each input sample and passing the result through a FIR low pass filter,
+but only the taps which fall on real samples are computed.
+*/
+typedef struct {
+  double *history;     // Last input samples, only the real ones (no 0-valued samples)
+  double *phase_taps;  // Taps reordered by phase: 'factor' rows of 'phase_len' taps, DC gain included
+  unsigned int last_index, phase_len, factor, phase;
+} Interpolator_t;
+
+
+/*
+Single precision FIR filter with a mirrored history. Each sample is stored twice, 
+taps_num positions apart, so that the last taps_num samples are always contiguous 
+in memory and the dot product with the taps needs no wrap around check. 
+The taps are stored in reverse order (oldest sample first) and padded with zeros 
+to a multiple of 4, so that the dot product can be done 4 floats at a time.
+*/
+typedef struct {
+  float *history;   // taps_num+taps_len values, see FIRf_put
+  float *taps;      // taps_len values, 16 byte aligned
+  unsigned int last_index, taps_num, taps_len;
+} FIRf_t;
+
+
+// Tap tables. The low pass ones are designed for a sampling frequency of 240 Hz, see LPFilter_design() for other rates
+extern double LP_20_240_filter_taps[24];
+extern double LP_10_240_filter_taps[43];
+
+
+int LPFilter_init(Filter_t *f, double *tap_array, unsigned tap_list_size);
+void LPFilter_close(Filter_t *f);
+void LPFilter_setDCgain(Filter_t *f, double gain_value);
+double *LPFilter_design(double fc, double trans_bw, double fs, unsigned *tap_list_size);
+
+int Interpolator_init(Interpolator_t *f, const double *tap_array, unsigned tap_list_size, unsigned factor);
+void Interpolator_close(Interpolator_t *f);
+double Interpolator_get(Interpolator_t *f, double input);
+void Interpolator_block(Interpolator_t *f, double input, double *output, unsigned n);
+
+int FIRf_init(FIRf_t *f, const double *tap_array, unsigned tap_list_size);
+void FIRf_close(FIRf_t *f);
+void FIRf_setDCgain(FIRf_t *f, float gain_value);
+float FIRf_dot(const float *x, const float *taps, unsigned n);
+void FIRf_block(FIRf_t *f, const float *input, float *output, unsigned n);
+
+
+static inline void LPFilter_put(Filter_t *f, double input)
+{
+  f->history[f->last_index++] = input;
+  if (f->last_index == f->taps_num) f->last_index = 0;
+}
+
+
+static inline double LPFilter_get(const Filter_t *f)
+{
+  double acc = 0;
+  int index = f->last_index, i;
+
+  for (i = 0; i < f->taps_num; i++) {
+    index = (index != 0) ? index-1 : f->taps_num-1;
+    acc += f->history[index] * f->taps[i];
+  }
+  return acc;
+}
+
+
+static inline void FIRf_put(FIRf_t *f, float input)
+{
+  f->history[f->last_index] = input;
+  f->history[f->last_index + f->taps_num] = input;
+  if (++f->last_index == f->taps_num) f->last_index = 0;
+}
+
+
+// The last taps_num samples, oldest first, start at history[last_index]
+static inline float FIRf_get(const FIRf_t *f)
+{
+  return FIRf_dot(f->history + f->last_index, f->taps, f->taps_len);
+}
+
+
+#endif // FILTER_H
@@ -0,0 +1,528 @@
+/*************************************************************************
+
+Attitude fusion engines. Each one is a table of functions (FusionEngine_t), and its state 
+is kept in a Fusion_t instance, so each processing pipeline of imu.c has its own.
+The time spent in each update is measured, to compare the cost of the engines.
+The engines use the same axis as imu.c: X forwards, Y to the left, Z up.
+
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+
+#include "fusion.h"
+#include "ekf.h"
+#include "ekf32.h"
+
+
+#define ERR(ret, format, arg...)                                       \
+   {                                                                   \
+         fprintf(stderr, "%s: " format "\n" , __func__ , ## arg);      \
+         return ret;                                                   \
+   }
+
+
+/************************* Madgwick *************************/
+
+/// Quote from kriswinner regarding beta parameter:
+/* 
+There is a tradeoff in the beta parameter between accuracy and response speed.
+In the original Madgwick study, beta of 0.041 (corresponding to GyroMeasError of 2.7 degrees/s) was found to give optimal accuracy.
+However, with this value, the LSM9SD0 response time is about 10 seconds to a stable initial quaternion.
+Subsequent changes also require a longish lag time to a stable output, not fast enough for a quadcopter or robot car!
+By increasing beta (GyroMeasError) by about a factor of fifteen, the response time constant is reduced to ~2 sec
+I haven't noticed any reduction in solution accuracy. This is essentially the I coefficient in a PID control sense; 
+the bigger the feedback coefficient, the faster the solution converges, usually at the expense of accuracy. 
+In any case, this is the free parameter in the Madgwick filtering and fusion scheme. 
+*/
+
+// gyroscope measurement error in rads/s (start at 40 deg/s)
+#define GyroMeasError (M_PI * (40.0/180.0))
+static const double beta = 1.73205/2 * GyroMeasError;   // compute beta, sqrt(3/4)*GyroMeasError
+// After a warm start, imu.c multiplies beta by a decaying gain (see Fusion_setGain()), to converge faster
+
+
+// Implementation of Sebastian Madgwick's "...efficient orientation filter for... inertial/magnetic sensor arrays"
+// (see https://x-io.co.uk/open-source-imu-and-ahrs-algorithms for examples and more details)
+// which fuses acceleration, rotation rate, and magnetic moments to produce a quaternion-based estimate of absolute
+// device orientation -- which can be converted to yaw, pitch, and roll. Useful for stabilizing quadcopters, etc.
+// The performance of the orientation filter is at least as good as conventional Kalman-based filtering algorithms
+// but is much less computationally intensive---it can be performed on a 3.3 V Pro Mini operating at 8 MHz!
+// Original code and explanation: https://github.com/kriswiner/LSM9DS1
+static void madgwick_update(Fusion_t *f, double ax, double ay, double az, double gx, double gy, double gz, double mx, double my, double mz)
+{
+double *q = f->s.q, deltat = f->deltat;
+double q1 = q[0], q2 = q[1], q3 = q[2], q4 = q[3];   // short name local variable for readability
+double norm;
+double hx, hy, _2bx, _2bz;
+double s1, s2, s3, s4;
+double qDot1, qDot2, qDot3, qDot4;
+
+// Auxiliary variables to avoid repeated arithmetic
+double _2q1mx, _2q1my, _2q1mz, _2q2mx;
+double _4bx, _4bz;
+double _2q1 = 2.0 * q1, _2q2 = 2.0 * q2, _2q3 = 2.0 * q3, _2q4 = 2.0 * q4;
+double _2q1q3 = 2.0 * q1 * q3, _2q3q4 = 2.0 * q3 * q4;
+double q1q1 = q1 * q1, q1q2 = q1 * q2, q1q3 = q1 * q3, q1q4 = q1 * q4;
+double q2q2 = q2 * q2, q2q3 = q2 * q3, q2q4 = q2 * q4;
+double q3q3 = q3 * q3, q3q4 = q3 * q4;
+double q4q4 = q4 * q4;
+
+   // Normalise accelerometer measurement
+   norm = sqrt(ax * ax + ay * ay + az * az);
+   if (norm == 0.0) return; // handle NaN
+   norm = 1.0/norm;
+   ax *= norm;
+   ay *= norm;
+   az *= norm;
+
+   // Normalise magnetometer measurement
+   norm = sqrt(mx * mx + my * my + mz * mz);
+   if (norm == 0.0) return; // handle NaN
+   norm = 1.0/norm;
+   mx *= norm;
+   my *= norm;
+   mz *= norm;
+
+   // Reference direction of Earth's magnetic field
+   _2q1mx = 2.0 * q1 * mx;
+   _2q1my = 2.0 * q1 * my;
+   _2q1mz = 2.0 * q1 * mz;
+   _2q2mx = 2.0 * q2 * mx;
+   hx = mx * q1q1 - _2q1my * q4 + _2q1mz * q3 + mx * q2q2 + _2q2 * my * q3 + _2q2 * mz * q4 - mx * q3q3 - mx * q4q4;
+   hy = _2q1mx * q4 + my * q1q1 - _2q1mz * q2 + _2q2mx * q3 - my * q2q2 + my * q3q3 + _2q3 * mz * q4 - my * q4q4;
+   _2bx = sqrt(hx * hx + hy * hy);
+   _2bz = -_2q1mx * q3 + _2q1my * q2 + mz * q1q1 + _2q2mx * q4 - mz * q2q2 + _2q3 * my * q4 - mz * q3q3 + mz * q4q4;
+   _4bx = 2.0 * _2bx;
+   _4bz = 2.0 * _2bz;
+
+   // Gradient descent algorithm corrective step
+   s1 = -_2q3 * (2.0 * q2q4 - _2q1q3 - ax) + _2q2 * (2.0 * q1q2 + _2q3q4 - ay) - _2bz * q3 * (_2bx * (0.5 - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (-_2bx * q4 + _2bz * q2) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + _2bx * q3 * (_2bx * (q1q3 + q2q4) + _2bz * (0.5 - q2q2 - q3q3) - mz);
+   s2 = _2q4 * (2.0 * q2q4 - _2q1q3 - ax) + _2q1 * (2.0 * q1q2 + _2q3q4 - ay) - 4.0 * q2 * (1.0 - 2.0 * q2q2 - 2.0 * q3q3 - az) + _2bz * q4 * (_2bx * (0.5 - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (_2bx * q3 + _2bz * q1) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + (_2bx * q4 - _4bz * q2) * (_2bx * (q1q3 + q2q4) + _2bz * (0.5 - q2q2 - q3q3) - mz);
+   s3 = -_2q1 * (2.0 * q2q4 - _2q1q3 - ax) + _2q4 * (2.0 * q1q2 + _2q3q4 - ay) - 4.0 * q3 * (1.0 - 2.0 * q2q2 - 2.0 * q3q3 - az) + (-_4bx * q3 - _2bz * q1) * (_2bx * (0.5 - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (_2bx * q2 + _2bz * q4) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + (_2bx * q1 - _4bz * q3) * (_2bx * (q1q3 + q2q4) + _2bz * (0.5 - q2q2 - q3q3) - mz);
+   s4 = _2q2 * (2.0 * q2q4 - _2q1q3 - ax) + _2q3 * (2.0 * q1q2 + _2q3q4 - ay) + (-_4bx * q4 + _2bz * q2) * (_2bx * (0.5 - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (-_2bx * q1 + _2bz * q3) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + _2bx * q2 * (_2bx * (q1q3 + q2q4) + _2bz * (0.5 - q2q2 - q3q3) - mz);
+   norm = sqrt(s1 * s1 + s2 * s2 + s3 * s3 + s4 * s4);    // normalise step magnitude
+   norm = norm > 0 ? 1.0/norm : 0;   // No step if the estimation matches the measurements exactly
+   s1 *= norm;
+   s2 *= norm;
+   s3 *= norm;
+   s4 *= norm;
+
+   // Compute rate of change of quaternion
+   qDot1 = 0.5 * (-q2 * gx - q3 * gy - q4 * gz) - beta * f->gain * s1;
+   qDot2 = 0.5 * (q1 * gx + q3 * gz - q4 * gy) - beta * f->gain * s2;
+   qDot3 = 0.5 * (q1 * gy - q2 * gz + q4 * gx) - beta * f->gain * s3;
+   qDot4 = 0.5 * (q1 * gz + q2 * gy - q3 * gx) - beta * f->gain * s4;
+
+   // Integrate to yield quaternion
+   q1 += qDot1 * deltat;
+   q2 += qDot2 * deltat;
+   q3 += qDot3 * deltat;
+   q4 += qDot4 * deltat;
+   norm = sqrt(q1 * q1 + q2 * q2 + q3 * q3 + q4 * q4);    // normalise quaternion
+   norm = 1.0/norm;
+   q[0] = q1 * norm;
+   q[1] = q2 * norm;
+   q[2] = q3 * norm;
+   q[3] = q4 * norm;
+}
+
+
+static void quaternion_init(double q[4])
+{
+   q[0] = 1.0; q[1] = q[2] = q[3] = 0.0;
+}
+
+
+// Quaternion of the Tait-Bryan angles (z-y'-x'' rotation), in radians
+void Fusion_attitudeToQuaternion(double yaw, double pitch, double roll, double q[4])
+{
+double cy, sy, cp, sp, cr, sr;
+
+   cy = cos(yaw/2); sy = sin(yaw/2);
+   cp = cos(pitch/2); sp = sin(pitch/2);
+   cr = cos(roll/2); sr = sin(roll/2);
+   q[0] = cr*cp*cy + sr*sp*sy;
+   q[1] = sr*cp*cy - cr*sp*sy;
+   q[2] = cr*sp*cy + sr*cp*sy;
+   q[3] = cr*cp*sy - sr*sp*cy;
+}
+
+
+// Tait-Bryan angles of a quaternion, in radians, see getAttitude() in imu.c
+void Fusion_quaternionToAttitude(const double q[4], double *yaw, double *pitch, double *roll)
+{
+   *yaw   = atan2(2.0 * (q[1]*q[2] + q[0]*q[3]), q[0]*q[0] + q[1]*q[1] - q[2]*q[2] - q[3]*q[3]);  
+   *pitch = -asin(2.0 * (q[1]*q[3] - q[0]*q[2]));
+   *roll  = atan2(2.0 * (q[0]*q[1] + q[2]*q[3]), q[0]*q[0] - q[1]*q[1] - q[2]*q[2] + q[3]*q[3]);
+}
+
+
+static void madgwick_init(Fusion_t *f)
+{
+   quaternion_init(f->s.q);
+}
+
+
+static void madgwick_attitude(const Fusion_t *f, double *yaw, double *pitch, double *roll)
+{
+   Fusion_quaternionToAttitude(f->s.q, yaw, pitch, roll);
+}
+
+
+static void madgwick_quaternion(const Fusion_t *f, double q[4])
+{
+   memcpy(q, f->s.q, 4*sizeof(double));
+}
+
+
+static void madgwick_set_quaternion(Fusion_t *f, const double q[4])
+{
+   memcpy(f->s.q, q, 4*sizeof(double));
+}
+
+
+
+/************************* Mahony *************************/
+
+/*
+Proportional and integral gains of the Mahony filter (2*Kp and 2*Ki).
+The integral term corrects the gyroscope bias; it is disabled by default, 
+as the bias is already tracked by imu.c while the car is stationary.
+*/
+static const double twoKp = 2.0 * 0.5;
+static const double twoKi = 2.0 * 0.0;
+
+static void mahony_init(Fusion_t *f)
+{
+   quaternion_init(f->s.mahony.q);
+   f->s.mahony.integral[0] = f->s.mahony.integral[1] = f->s.mahony.integral[2] = 0.0;
+}
+
+
+// Implementation of Mahony's AHRS algorithm, a complementary filter on the rotation group: 
+// the error between the measured and estimated directions of gravity and magnetic field corrects 
+// the gyroscope rate with a PI controller. Cheaper than Madgwick, no gradient is computed.
+// (see https://x-io.co.uk/open-source-imu-and-ahrs-algorithms)
+static void mahony_update(Fusion_t *f, double ax, double ay, double az, double gx, double gy, double gz, double mx, double my, double mz)
+{
+double *q = f->s.mahony.q, *integral = f->s.mahony.integral;
+double q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3], qa, qb, qc;
+double norm;
+double q0q0, q0q1, q0q2, q0q3, q1q1, q1q2, q1q3, q2q2, q2q3, q3q3;
+double hx, hy, bx, bz;
+double halfvx, halfvy, halfvz, halfwx, halfwy, halfwz;
+double halfex, halfey, halfez;
+
+   // Normalise accelerometer measurement
+   norm = sqrt(ax * ax + ay * ay + az * az);
+   if (norm == 0.0) return; // handle NaN
+   norm = 1.0/norm;
+   ax *= norm;
+   ay *= norm;
+   az *= norm;
+
+   // Normalise magnetometer measurement
+   norm = sqrt(mx * mx + my * my + mz * mz);
+   if (norm == 0.0) return; // handle NaN
+   norm = 1.0/norm;
+   mx *= norm;
+   my *= norm;
+   mz *= norm;
+
+   // Auxiliary variables to avoid repeated arithmetic
+   q0q0 = q0 * q0; q0q1 = q0 * q1; q0q2 = q0 * q2; q0q3 = q0 * q3;
+   q1q1 = q1 * q1; q1q2 = q1 * q2; q1q3 = q1 * q3;
+   q2q2 = q2 * q2; q2q3 = q2 * q3;
+   q3q3 = q3 * q3;
+
+   // Reference direction of Earth's magnetic field
+   hx = 2.0 * (mx * (0.5 - q2q2 - q3q3) + my * (q1q2 - q0q3) + mz * (q1q3 + q0q2));
+   hy = 2.0 * (mx * (q1q2 + q0q3) + my * (0.5 - q1q1 - q3q3) + mz * (q2q3 - q0q1));
+   bx = sqrt(hx * hx + hy * hy);
+   bz = 2.0 * (mx * (q1q3 - q0q2) + my * (q2q3 + q0q1) + mz * (0.5 - q1q1 - q2q2));
+
+   // Estimated direction of gravity and magnetic field
+   halfvx = q1q3 - q0q2;
+   halfvy = q0q1 + q2q3;
+   halfvz = q0q0 - 0.5 + q3q3;
+   halfwx = bx * (0.5 - q2q2 - q3q3) + bz * (q1q3 - q0q2);
+   halfwy = bx * (q1q2 - q0q3) + bz * (q0q1 + q2q3);
+   halfwz = bx * (q0q2 + q1q3) + bz * (0.5 - q1q1 - q2q2);
+
+   // Error is sum of cross product between estimated direction and measured direction of field vectors
+   halfex = (ay * halfvz - az * halfvy) + (my * halfwz - mz * halfwy);
+   halfey = (az * halfvx - ax * halfvz) + (mz * halfwx - mx * halfwz);
+   halfez = (ax * halfvy - ay * halfvx) + (mx * halfwy - my * halfwx);
+
+   // Integral feedback
+   if (twoKi > 0.0) {
+      integral[0] += twoKi * halfex * f->deltat;
+      integral[1] += twoKi * halfey * f->deltat;
+      integral[2] += twoKi * halfez * f->deltat;
+      gx += integral[0];
+      gy += integral[1];
+      gz += integral[2];
+   }
+
+   // Proportional feedback
+   gx += twoKp * f->gain * halfex;
+   gy += twoKp * f->gain * halfey;
+   gz += twoKp * f->gain * halfez;
+
+   // Integrate rate of change of quaternion
+   gx *= 0.5 * f->deltat;
+   gy *= 0.5 * f->deltat;
+   gz *= 0.5 * f->deltat;
+   qa = q0; qb = q1; qc = q2;
+   q0 += -qb * gx - qc * gy - q3 * gz;
+   q1 += qa * gx + qc * gz - q3 * gy;
+   q2 += qa * gy - qb * gz + q3 * gx;
+   q3 += qa * gz + qb * gy - qc * gx;
+
+   norm = sqrt(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);    // normalise quaternion
+   norm = 1.0/norm;
+   q[0] = q0 * norm;
+   q[1] = q1 * norm;
+   q[2] = q2 * norm;
+   q[3] = q3 * norm;
+}
+
+
+static void mahony_attitude(const Fusion_t *f, double *yaw, double *pitch, double *roll)
+{
+   Fusion_quaternionToAttitude(f->s.mahony.q, yaw, pitch, roll);
+}
+
+
+static void mahony_quaternion(const Fusion_t *f, double q[4])
+{
+   memcpy(q, f->s.mahony.q, 4*sizeof(double));
+}
+
+
+static void mahony_set_quaternion(Fusion_t *f, const double q[4])
+{
+   memcpy(f->s.mahony.q, q, 4*sizeof(double));
+}
+
+
+
+/************************* DCM extended Kalman filter *************************/
+
+/*
+The EKF of ekf.c estimates the gravity direction and the gyroscope bias; it does not use the magnetometer,
+so the yaw is only integrated from the gyroscope. The "-mag" engines add the heading update of EKF_updateMag(),
+which keeps the yaw referenced to the magnetic north as in Madgwick and Mahony.
+Each Fusion_t has its own instance, with the default parameters.
+*/
+static void ekf_init(Fusion_t *f)
+{
+   EKF_init(&f->s.ekf, NULL);
+}
+
+
+static void ekf_update(Fusion_t *f, double ax, double ay, double az, double gx, double gy, double gz, double mx, double my, double mz)
+{
+   EKF_update(&f->s.ekf, gx, gy, gz, ax*EKF_GRAVITY, ay*EKF_GRAVITY, az*EKF_GRAVITY, f->deltat);  // The EKF works in m/s^2
+}
+
+
+static void ekf_mag_update(Fusion_t *f, double ax, double ay, double az, double gx, double gy, double gz, double mx, double my, double mz)
+{
+   EKF_update(&f->s.ekf, gx, gy, gz, ax*EKF_GRAVITY, ay*EKF_GRAVITY, az*EKF_GRAVITY, f->deltat);
+   EKF_updateMag(&f->s.ekf, mx, my, mz, f->deltat);
+}
+
+
+static void ekf_attitude(const Fusion_t *f, double *yaw, double *pitch, double *roll)
+{
+   EKF_getAttitude(&f->s.ekf, yaw, pitch, roll);
+   *yaw *= M_PI/180; *pitch *= M_PI/180; *roll *= M_PI/180;
+}
+
+
+// The EKF has no quaternion, it is obtained from the Tait-Bryan angles
+static void ekf_quaternion(const Fusion_t *f, double q[4])
+{
+double yaw, pitch, roll;
+
+   ekf_attitude(f, &yaw, &pitch, &roll);
+   Fusion_attitudeToQuaternion(yaw, pitch, roll, q);
+}
+
+
+// The state of the EKF is the gravity direction, the last row of the DCM
+static void ekf_gravity(const Fusion_t *f, double g[3])
+{
+   g[0] = f->s.ekf.x0;
+   g[1] = f->s.ekf.x1;
+   g[2] = f->s.ekf.x2;
+}
+
+
+/* Single precision version of the EKF (ekf32.c), cheaper on the Pi Zero and vectorized with NEON */
+static void ekf32_init(Fusion_t *f)
+{
+   EKF32_init(&f->s.ekf32, NULL);
+}
+
+
+static void ekf32_update(Fusion_t *f, double ax, double ay, double az, double gx, double gy, double gz, double mx, double my, double mz)
+{
+   EKF32_update(&f->s.ekf32, gx, gy, gz, ax*EKF_GRAVITY, ay*EKF_GRAVITY, az*EKF_GRAVITY, f->deltat);
+}
+
+
+static void ekf32_mag_update(Fusion_t *f, double ax, double ay, double az, double gx, double gy, double gz, double mx, double my, double mz)
+{
+   EKF32_update(&f->s.ekf32, gx, gy, gz, ax*EKF_GRAVITY, ay*EKF_GRAVITY, az*EKF_GRAVITY, f->deltat);
+   EKF32_updateMag(&f->s.ekf32, mx, my, mz, f->deltat);
+}
+
+
+static void ekf32_attitude(const Fusion_t *f, double *yaw, double *pitch, double *roll)
+{
+   EKF32_getAttitude(&f->s.ekf32, yaw, pitch, roll);
+   *yaw *= M_PI/180; *pitch *= M_PI/180; *roll *= M_PI/180;
+}
+
+
+static void ekf32_quaternion(const Fusion_t *f, double q[4])
+{
+double yaw, pitch, roll;
+
+   ekf32_attitude(f, &yaw, &pitch, &roll);
+   Fusion_attitudeToQuaternion(yaw, pitch, roll, q);
+}
+
+
+static void ekf32_gravity(const Fusion_t *f, double g[3])
+{
+   g[0] = f->s.ekf32.x[0];
+   g[1] = f->s.ekf32.x[1];
+   g[2] = f->s.ekf32.x[2];
+}
+
+
+
+/************************* Interface *************************/
+
+static const FusionEngine_t engines[] = {
+   {"madgwick", madgwick_init, madgwick_update, madgwick_attitude, madgwick_quaternion, madgwick_set_quaternion, NULL},
+   {"mahony", mahony_init, mahony_update, mahony_attitude, mahony_quaternion, mahony_set_quaternion, NULL},
+   {"ekf", ekf_init, ekf_update, ekf_attitude, ekf_quaternion, NULL, ekf_gravity},  // It estimates the gravity direction by itself
+   {"ekf32", ekf32_init, ekf32_update, ekf32_attitude, ekf32_quaternion, NULL, ekf32_gravity},
+   {"ekf-mag", ekf_init, ekf_mag_update, ekf_attitude, ekf_quaternion, NULL, ekf_gravity},
+   {"ekf32-mag", ekf32_init, ekf32_mag_update, ekf32_attitude, ekf32_quaternion, NULL, ekf32_gravity},
+};
+
+
+/* Find an engine by its name. Returns NULL if there is none with that name */
+const FusionEngine_t* Fusion_find(const char *name)
+{
+int i;
+
+   for (i = 0; i < sizeof(engines)/sizeof(engines[0]); i++) 
+      if (!strcmp(name, engines[i].name)) return &engines[i];
+   ERR(NULL, "Unknown fusion engine: %s", name);
+}
+
+
+void Fusion_init(Fusion_t *f, const FusionEngine_t *engine, double deltat)
+{
+   memset(f, 0, sizeof(*f));
+   f->engine = engine;
+   f->deltat = deltat;
+   f->gain = 1.0;
+   engine->init(f);
+}
+
+
+/* dt is the time since the previous update, in seconds; deltat given in Fusion_init() is only the nominal value */
+void Fusion_update(Fusion_t *f, double ax, double ay, double az, double gx, double gy, double gz, double mx, double my, double mz, double dt)
+{
+struct timespec t0, t1;
+
+   f->deltat = dt;
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+   f->engine->update(f, ax, ay, az, gx, gy, gz, mx, my, mz);
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   f->ns += (t1.tv_sec - t0.tv_sec)*1000000000LL + (t1.tv_nsec - t0.tv_nsec);
+   f->updates++;
+}
+
+
+void Fusion_getAttitude(const Fusion_t *f, double *yaw, double *pitch, double *roll)
+{
+   f->engine->getAttitude(f, yaw, pitch, roll);
+}
+
+
+void Fusion_getQuaternion(const Fusion_t *f, double q[4])
+{
+   f->engine->getQuaternion(f, q);
+}
+
+
+/*
+Acceleration of the car without gravity, in g and in the axes of the sensor: the accelerometer 
+sample (ax, ay, az, in g) minus the gravity given by the current attitude. The sample need not be 
+the filtered one given to Fusion_update(), eg the collision detector uses the raw samples, as the 
+gravity changes slowly.
+*/
+void Fusion_getLinearAcceleration(const Fusion_t *f, double ax, double ay, double az, double a[3])
+{
+double q[4], g[3];
+
+   if (f->engine->getGravity) f->engine->getGravity(f, g);
+   else {
+      f->engine->getQuaternion(f, q);
+      g[0] = 2*(q[1]*q[3] - q[0]*q[2]);
+      g[1] = 2*(q[0]*q[1] + q[2]*q[3]);
+      g[2] = q[0]*q[0] - q[1]*q[1] - q[2]*q[2] + q[3]*q[3];
+   }
+   a[0] = ax - g[0];
+   a[1] = ay - g[1];
+   a[2] = az - g[2];
+}
+
+
+/* Set the attitude, in radians, eg from the accelerometer and magnetometer. Returns -1 if the engine does not support it */
+int Fusion_setAttitude(Fusion_t *f, double yaw, double pitch, double roll)
+{
+double q[4];
+
+   if (f->engine->setQuaternion == NULL) return -1;
+   Fusion_attitudeToQuaternion(yaw, pitch, roll, q);
+   f->engine->setQuaternion(f, q);
+   return 0;
+}
+
+
+/* Multiply the feedback gain of the engine, to converge faster (gain > 1) or to trust the gyroscope more (gain < 1) */
+void Fusion_setGain(Fusion_t *f, double gain)
+{
+   f->gain = gain;
+}
+
+
+/* Start the EKF engines again with other parameters, eg to tune them. Returns -1 if the engine is not an EKF */
+int Fusion_setEKFParams(Fusion_t *f, const EKFParams_t *par)
+{
+   if (f->engine->init == ekf_init) EKF_init(&f->s.ekf, par);
+   else if (f->engine->init == ekf32_init) EKF32_init(&f->s.ekf32, par);
+   else return -1;
+   return 0;
+}
+
+
+/* Mean time of an update, in microseconds */
+double Fusion_cost(const Fusion_t *f)
+{
+   return f->updates ? f->ns/1000.0/f->updates : 0;
+}
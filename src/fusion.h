@@ -0,0 +1,61 @@
+#ifndef FUSION_H
+#define FUSION_H
+
+/*************************************************************************
+Attitude fusion engines: Madgwick, Mahony and the DCM extended Kalman filter (ekf.c, and ekf32.c in single precision).
+All of them are used through the same interface, so the engine can be selected at runtime.
+
+*****************************************************************************/
+
+#include <stdint.h>
+#include "ekf.h"
+#include "ekf32.h"
+
+
+typedef struct Fusion Fusion_t;
+
+/* Functions of an engine. The accelerometer is in g, the gyroscope in rad/s, the magnetometer in any unit */
+typedef struct {
+  const char *name;
+  void (*init)(Fusion_t *f);
+  void (*update)(Fusion_t *f, double ax, double ay, double az, double gx, double gy, double gz, double mx, double my, double mz);
+  void (*getAttitude)(const Fusion_t *f, double *yaw, double *pitch, double *roll);  // In radians
+  void (*getQuaternion)(const Fusion_t *f, double q[4]);
+  void (*setQuaternion)(Fusion_t *f, const double q[4]);  // NULL if the state cannot be set
+  void (*getGravity)(const Fusion_t *f, double g[3]);  // Gravity in the axes of the sensor, in g; NULL to take it from the quaternion
+} FusionEngine_t;
+
+/* An instance of a fusion engine */
+struct Fusion {
+  const FusionEngine_t *engine;
+  double deltat;             // Time since the previous update, in seconds
+  double gain;               // Multiplier of the feedback gain (beta, Kp); 1 in steady state
+  union {
+    double q[4];             // Madgwick quaternion
+    struct {
+      double q[4];           // Mahony quaternion
+      double integral[3];    // Integral feedback
+    } mahony;
+    EKF_t ekf;               // DCM extended Kalman filter
+    EKF32_t ekf32;           // Its single precision version
+  } s;
+  uint64_t ns;               // Time spent in updates, in nanoseconds
+  unsigned long updates;
+};
+
+
+const FusionEngine_t* Fusion_find(const char *name);
+void Fusion_init(Fusion_t *f, const FusionEngine_t *engine, double deltat);
+void Fusion_update(Fusion_t *f, double ax, double ay, double az, double gx, double gy, double gz, double mx, double my, double mz, double dt);
+void Fusion_getAttitude(const Fusion_t *f, double *yaw, double *pitch, double *roll);
+void Fusion_getQuaternion(const Fusion_t *f, double q[4]);
+void Fusion_getLinearAcceleration(const Fusion_t *f, double ax, double ay, double az, double a[3]);
+double Fusion_cost(const Fusion_t *f);
+int Fusion_setAttitude(Fusion_t *f, double yaw, double pitch, double roll);
+void Fusion_setGain(Fusion_t *f, double gain);
+int Fusion_setEKFParams(Fusion_t *f, const EKFParams_t *par);
+void Fusion_quaternionToAttitude(const double q[4], double *yaw, double *pitch, double *roll);
+void Fusion_attitudeToQuaternion(double yaw, double pitch, double roll, double q[4]);
+
+
+#endif // FUSION_H
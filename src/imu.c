@@ -29,13 +29,26 @@ Magnetic field strength of Earth is about 0.5 gauss, 500 mGauss, 50 uTeslas or 5
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 #include <stdbool.h>
 #include <pigpio.h>
 #include <math.h>
 #include <stdatomic.h>
+#include <pthread.h>
 
 #include "imu.h"
 #include "ekf.h"
+#include "filter.h"
+#include "fusion.h"
+#include "collision.h"
+#include "rangedrop.h"
+#include "magcal.h"
+#include "recorder.h"
+#include "seqlock.h"
+#include "odometry.h"
+#include "vibration.h"
+#include <semaphore.h>
+#include "robot.h"
 #include "oled96.h"
 
 
@@ -53,22 +66,12 @@ Magnetic field strength of Earth is about 0.5 gauss, 500 mGauss, 50 uTeslas or 5
 
 extern _Atomic bool collision;  // Car has crashed when moving forwards or backwards
 
-typedef struct {
-    int *xvalues, *yvalues, *zvalues;
-    int num_elems;
-} SampleList_t;
-
-
-typedef struct {
-  double *history, *taps;
-  unsigned int last_index, taps_num;
-} Filter_t;
-
 
 static int i2c_accel_handle = -1;
 static int i2c_mag_handle = -1;
-static FILE *accel_fp;
 static unsigned timerNumber; // The timer used to periodically read the sensor
+static int fifoPin = -1;      // GPIO connected to INT2 pin of accel/gyro (FIFO threshold); if <0, the sensor is read with a timer
+static int collisionPin = -1; // GPIO connected to INT1 pin of accel/gyro (acceleration threshold); if <0, only software detection
 
 /* 
 Define ODR of accel/gyro and magnetometer. 
@@ -79,19 +82,113 @@ by the IMU in a FIFO (32 samples max), allowing a higher ODR in accel/gyro than
 In order for the algorithms to work, AG_ODR must be higher or equal than M_ODR. If it is much higher, the FIFO will overrun.
 So eg AG_ODR_952 is only possible if ODR_M = M_ODR_80, otherwise the FIFO overruns.
 In order for the upsampling of magnetometer data to work, ODR_AG must be an integer multiple of ODR_M (or very close).
+These are the default values, they can be changed with setODRLSM9DS1().
 */
-static const enum {AG_ODR_OFF,AG_ODR_14_9,AG_ODR_59_5,AG_ODR_119,AG_ODR_238,AG_ODR_476,AG_ODR_952} ODR_AG = AG_ODR_238; 
+static enum {AG_ODR_OFF,AG_ODR_14_9,AG_ODR_59_5,AG_ODR_119,AG_ODR_238,AG_ODR_476,AG_ODR_952} ODR_AG = AG_ODR_238; 
 static const double odr_ag_modes[] = {0,14.9,59.5,119,238,476,952};
 
-static const enum {M_ODR_0_625,M_ODR_1_25,M_ODR_2_5,M_ODR_5,M_ODR_10,M_ODR_20,M_ODR_40,M_ODR_80} ODR_M = M_ODR_40; 
+static enum {M_ODR_0_625,M_ODR_1_25,M_ODR_2_5,M_ODR_5,M_ODR_10,M_ODR_20,M_ODR_40,M_ODR_80} ODR_M = M_ODR_40; 
 static const double odr_m_modes[] = {0.625,1.25,2.5,5,10,20,40,80};
 
+/* 
+Cutoff frequency of the low pass filter of accelerometer data, in Hz. 
+The taps of the filters are calculated in setupLSM9DS1() for the selected ODRs. 
+The interpolating filter of magnetometer data has its cutoff at ODR_M/2.
+*/
+static const double accel_cutoff = 10.0;
+
+/*
+Collision detection by the interrupt generator of the accelerometer: INT1 goes high when the
+forward acceleration (high pass filtered) exceeds collision_threshold, in g. The callback stops the motors
+at once; the software detector (see detect_collision()) must then confirm the collision within
+confirm_time seconds, otherwise it is reported as a false alarm. confirm_time is set at setup, 
+longer than the latency of the detector and the period of the reads (see Collision_confirmTime()).
+*/
+static const double collision_threshold = 1.0;
+static double confirm_time;
+static _Atomic bool irq_pending;           // Set by collisionInterrupt(), cleared by imuRead() when checked
+static uint32_t irq_tick, irq_stop_tick;   // Tick of the interrupt and of the motor stop; valid while irq_pending
+static unsigned irq_confirmed, irq_unconfirmed;
+static _Atomic uint32_t impact_tick;       // Estimated tick of the sample where the last collision was detected
+static _Atomic int impact_direction;       // Direction where the last collision came from, in degrees (see Collision_update())
+
 
 static int upsampling_factor;  /* upsampling_factor is the ratio between both ODRs */
 
-static Filter_t filter_mx, filter_my, filter_mz; /* Interpolating filters for magnetometer */
-static Filter_t filter_ax, filter_ay, filter_az; /* Noise reduction low pass filters for accelerometer */
-static Filter_t filter_d1_ax;  /* High pass filter for 1st order derivation of forward acceleration */
+#define FIFO_LINES 32  /* Size of the accel/gyro FIFO; each line has 12 bytes (gyro and accel, 3 axis) */
+
+/* Accel/gyro samples of a FIFO burst, decoded in structure of arrays form, in counts of the lowest range */
+typedef struct {
+   int32_t gx[FIFO_LINES], gy[FIFO_LINES], gz[FIFO_LINES];
+   int32_t ax[FIFO_LINES], ay[FIFO_LINES], az[FIFO_LINES];
+} FIFOBlock_t;
+
+/*
+Full scale ranges of accelerometer and gyroscope. They are switched automatically (see check_range()) 
+when the samples get near the limits, or are small for a while. The samples are always converted 
+to counts of the lowest range, multiplying them by the ratio of the sensitivities (see the datasheet), 
+so aRes, gRes, err_AL, bias_GY and the deviations stay valid in any range.
+*/
+typedef struct {
+   double fs;      // Full scale, in g or dps
+   int mult;       // Sensitivity of the range / sensitivity of the lowest range
+   uint8_t bits;   // Value of the FS bits in the control register
+} Range_t;
+
+static const Range_t accel_ranges[] = {{2, 1, 0x0}, {4, 2, 0x2}, {8, 4, 0x3}, {16, 12, 0x1}};  // CTRL_REG6_XL
+static const Range_t gyro_ranges[] = {{245, 1, 0x0}, {500, 2, 0x1}, {2000, 8, 0x3}};          // CTRL_REG1_G
+#define NUM_RANGES(r) ((int)(sizeof(r)/sizeof(r[0])))
+static const enum {RANGE_AUTO, RANGE_FIXED} range_mode = RANGE_AUTO;
+static const double range_up = 0.9;     // Switch to the next range if a sample exceeds this fraction of the full scale
+static const double range_down = 0.4;  // Switch to the previous range if the samples are below this fraction of its full scale...
+static const double range_hold = 2.0;  // ...for this time, in seconds
+static int accel_range, gyro_range;    // Ranges programmed in the sensor
+static int fifo_accel_range, fifo_gyro_range;  // Ranges of the samples of the burst being processed
+static int next_accel_range, next_gyro_range;  // Ranges to program before the next burst
+static unsigned accel_quiet, gyro_quiet;       // Samples which would fit in the previous range
+static RangeDrop_t range_drop;                 // Sample taken while switching, to be dropped
+static unsigned long accel_switches, gyro_switches;
+
+/* State of the processing applied to the IMU samples: filters, fusion and collision detection */
+typedef struct {
+   Interpolator_t filter_mx, filter_my, filter_mz; /* Interpolating filters for magnetometer */
+   FIRf_t filter_ax, filter_ay, filter_az; /* Noise reduction low pass filters for accelerometer */
+   Fusion_t fusion;      /* Attitude fusion engine */
+   double v_m, e_m;      /* Integrated forward speed and displacement */
+   double rate[3];       /* Last gyroscope rates, in dps */
+   double yaw_delta;     /* Rotation around Z axis during the last burst, in radians */
+   Collision_t detector; /* Software collision detector */
+   unsigned int samples_count;
+} Pipeline_t;
+
+/*
+The samples read from the FIFO can be processed one at a time (PIPELINE_SAMPLE), 
+or the whole burst at once (PIPELINE_BLOCK): decode all samples, then run each filter 
+over the block, and then the fusion filter. Both must give the same output; PIPELINE_SAMPLE
+is kept as reference. PIPELINE_COMPARE runs both with separate states, and warns if they differ.
+*/
+static const enum {PIPELINE_SAMPLE, PIPELINE_BLOCK, PIPELINE_COMPARE} pipeline_mode = PIPELINE_BLOCK;
+static Pipeline_t pipeline;
+static Pipeline_t ref_pipeline;  /* Only used in PIPELINE_COMPARE mode */
+
+/* Attitude fusion engine used by the pipelines, selected with setFusionLSM9DS1(). Madgwick if NULL */
+static const FusionEngine_t *fusion_engine;
+
+/*
+Warm start of the attitude (see warm_start()): the fusion engines start with the attitude given by the 
+3D compass, from the accelerometer and magnetometer averaged during warm_start_time, instead of the 
+identity quaternion. Then their feedback gain starts at warm_start_gain, and decays exponentially 
+to the steady state value with time constant warm_start_tau, so the remaining error converges fast.
+*/
+static const double warm_start_time = 0.2;   // Seconds of samples averaged; the filters also settle meanwhile
+static const double warm_start_gain = 10.0;  // Initial multiplier of the feedback gain
+static const double warm_start_tau = 0.3;    // Time constant of the decay of the gain, in seconds
+static enum {WARM_AVERAGING, WARM_CONVERGING, WARM_DONE} warm_phase;
+static unsigned warm_bursts;
+static double warm_a[3], warm_m[3], warm_time;
+
+/* Spectrum analysis of the vibration (see vibration.c), enabled with setVibrationLSM9DS1() */
+static bool vibration_analysis;
 
 
 // gRes, aRes, and mRes store the current resolution for each sensor. 
@@ -103,7 +200,7 @@ static double gRes, aRes, mRes;
 static int16_t err_AL[3];  // ex,ey,ez values (error for each axis in accelerometer)
 static int16_t err_GY[3];  // ex,ey,ez values (error for each axis in gyroscope)
 static int16_t err_MA[3];  // ex,ey,ez values (error for each axis in magnetometer, hardiron effects)
-static double scale_MA[3] = {1.0, 1.0, 1.0}; // ex,ey,ez values (error for each axis in magnetometer, softiron effects)
+static double scale_MA[3][3] = {{1.0, 0, 0}, {0, 1.0, 0}, {0, 0, 1.0}}; // Inverse softiron matrix of magnetometer, symmetric
 
 static double deviation_AL[3];  // Measured standard deviation of x, y and z values of accelerometer
 static double deviation_GY[3];  // Measured standard deviation of x, y and z values of gyroscope
@@ -111,245 +208,107 @@ static double deviation_MA[3];  // Measured standard deviation of x, y and z val
 
 static const char *cal_file = "calibration.dat"; // File where calibration data is stored
 static const char *dev_file = "deviation.dat";   // File where standard deviation data is stored
+static const char *bias_file = "gyro_bias.dat";  // File where the last tracked gyroscope bias is stored
 static const double declination = +1.266;   // Local magnetic declination as given by http://www.magnetic-declination.com/
 static const double magneticField = 0.457;  // Magnitude of the local magnetic field in Gauss (does not need to be exact)
 
-/* Madgwick filter variables */
-static double q[4] = {1.0, 0.0, 0.0, 0.0};    // vector to hold quaternion
-
-/// Quote from kriswinner regarding beta parameter:
 /* 
-There is a tradeoff in the beta parameter between accuracy and response speed.
-In the original Madgwick study, beta of 0.041 (corresponding to GyroMeasError of 2.7 degrees/s) was found to give optimal accuracy.
-However, with this value, the LSM9SD0 response time is about 10 seconds to a stable initial quaternion.
-Subsequent changes also require a longish lag time to a stable output, not fast enough for a quadcopter or robot car!
-By increasing beta (GyroMeasError) by about a factor of fifteen, the response time constant is reduced to ~2 sec
-I haven't noticed any reduction in solution accuracy. This is essentially the I coefficient in a PID control sense; 
-the bigger the feedback coefficient, the faster the solution converges, usually at the expense of accuracy. 
-In any case, this is the free parameter in the Madgwick filtering and fusion scheme. 
+Gyroscope bias, in IMU units. It starts with the calibrated value (err_GY) or the one tracked 
+in the last session, and it is tracked while the car is stationary, see track_gyro_bias().
 */
+static double bias_GY[3];
+static double bias_GY_var[3]; // Variance of the estimation of bias_GY
+static bool bias_GY_updated;  // bias_GY was updated in this session, so it is saved when closing
+#define STATIONARY_HOLD 0.5   // Seconds the car must be stationary before the bias is updated
+static const double stationary_max_accel_var = 1E-5;  // Maximum variance of the accelerometer norm when stationary, g^2
+static const double stationary_max_rate = 2.0;        // Maximum rotation when stationary, dps
+static const double gyro_bias_drift = 0.5;            // Random walk of the bias, IMU units/sqrt(s)
+static const double gyro_bias_init_var = 25.0;        // Variance of the initial bias, IMU units^2
+static const double gyro_default_noise = 10.0;        // Std deviation of gyroscope, if not measured, IMU units
 
-// gyroscope measurement error in rads/s (start at 40 deg/s)
-#define GyroMeasError (M_PI * (40.0/180.0))
-static const double beta = 1.73205/2 * GyroMeasError;   // compute beta, sqrt(3/4)*GyroMeasError
-static const double deltat = 1.0/odr_ag_modes[ODR_AG];  // Inverse of gyro/accel ODR
-
-
-// Output variables of module
-double roll, pitch, yaw, tilt;
-
-
-/* Prototypes */
-static void imuRead(void);
-static void calibrate_accel_gyro(void);
-static void calibrate_magnetometer(void);
-static double ellipsoid_fit(const SampleList_t *sample_list);
-static double quad_error_function(double Vx, double Vy, double Vz, double A, double B, double C, 
-                            double Bm, const SampleList_t *sample_list);
-static void MadgwickQuaternionUpdate(double ax, double ay, double az, double gx, double gy, double gz, 
-                                     double mx, double my, double mz);
-                                     
-                                     
-                                     
-                                     
-/*****************************************************
-
-Digital FIR filter. A LPF is used for filterig magnetometer data.
-It is used to interpolate after upsampling from ODR_M to ODR_AG.
-It is designed to work with these combinations (upsampling x3 or x6):
-ODR_M=80, ODR_AG=476; ODR_M=80, ODR_AG=238;
-ODR_M=40, ODR_AG=238; ODR_M=40, ODR_AG=119; 
-ODR_M=20, ODR_AG=119; ODR_M=20, ODR_AG=59.5; 
-ODR_M=10, ODR_AG=59.5; 
-
-******************************************************/
-/*
-
-FIR filter designed with
- http://t-filter.appspot.com
-
-sampling frequency: 240 Hz
-
-* 0 Hz - 4 Hz
-  gain = 1
-  desired ripple = 2 dB
-  actual ripple = 1.0141307953166252 dB
-
-* 5 Hz - 19 Hz
-  gain = 1
-  desired ripple = 35 dB
-  actual ripple = 33.758521533154735 dB
-
-* 20 Hz - 120 Hz
-  gain = 0
-  desired attenuation = -40 dB
-  actual attenuation = -43.613766226277974 dB
-
+/* 
+Magnetometer calibration used by imuRead(). It is double buffered: the online calibration thread 
+writes the buffer which is not in use and then changes mag_cal_index. Fits are at least 
+MAGCAL_PERIOD seconds apart, so imuRead() has long finished with a buffer when it is written again.
 */
+static MagCal_t mag_cal[2];
+static _Atomic int mag_cal_index;
 
-static double LP_20_240_filter_taps[] = {
-  0.0017433948030936106,
-  0.009143190985861756,
-  0.012133516280499421,
-  0.01983655704542007,
-  0.02830242809740451,
-  0.03812682806131509,
-  0.048540195172121076,
-  0.05892094411702151,
-  0.06848428950018577,
-  0.07647321877548367,
-  0.08222112771837956,
-  0.08523022650867189,
-  0.08523022650867189,
-  0.08222112771837956,
-  0.07647321877548367,
-  0.06848428950018577,
-  0.05892094411702151,
-  0.048540195172121076,
-  0.03812682806131509,
-  0.02830242809740451,
-  0.01983655704542007,
-  0.012133516280499421,
-  0.009143190985861756,
-  0.0017433948030936106
-};
-
-
-/*
-
-FIR filter designed with
- http://t-filter.appspot.com
-
-sampling frequency: 240 Hz
-
-* 0 Hz - 2 Hz
-  gain = 1
-  desired ripple = 2 dB
-  actual ripple = 0.9673152635399324 dB
-
-* 3 Hz - 9 Hz
-  gain = 1
-  desired ripple = 35 dB
-  actual ripple = 26.642185422323546 dB
-
-* 10 Hz - 120 Hz
-  gain = 0
-  desired attenuation = -40 dB
-  actual attenuation = -41.61351226633883 dB
-
+/* 
+Online calibration of the magnetometer, from the samples read by imuRead() while the car moves.
+A car turning on the ground covers only a ring of directions, not enough for a full fit (magcal_min_coverage):
+then only the horizontal hardiron offset is fitted, if the car turned in most directions (magcal_min_horizontal).
+With MAG_CAL_MANUAL, the calibration is done at startup with the -c option, rotating the car by hand (60 s).
 */
-
-static double LP_10_240_filter_taps[] = {
-  0.005971139238851345,
-  0.004284876252226764,
-  0.005706608900364033,
-  0.007354427109791928,
-  0.0092055716099583,
-  0.01126528584840552,
-  0.013511905734478582,
-  0.015911620908019886,
-  0.018440918457958876,
-  0.021063915357805933,
-  0.023731627358926564,
-  0.026398828810262873,
-  0.029019156588604933,
-  0.03154122957077722,
-  0.033914554393050085,
-  0.036088808744910154,
-  0.03801579844329516,
-  0.039655081367493177,
-  0.04097170597229545,
-  0.041935178632098835,
-  0.04252308474795214,
-  0.042720929310042295,
-  0.04252308474795214,
-  0.041935178632098835,
-  0.04097170597229545,
-  0.039655081367493177,
-  0.03801579844329516,
-  0.036088808744910154,
-  0.033914554393050085,
-  0.03154122957077722,
-  0.029019156588604933,
-  0.026398828810262873,
-  0.023731627358926564,
-  0.021063915357805933,
-  0.018440918457958876,
-  0.015911620908019886,
-  0.013511905734478582,
-  0.01126528584840552,
-  0.0092055716099583,
-  0.007354427109791928,
-  0.005706608900364033,
-  0.004284876252226764,
-  0.005971139238851345
-};
-
+static const enum {MAG_CAL_ONLINE, MAG_CAL_MANUAL} mag_calibration = MAG_CAL_ONLINE;
+#define MAGCAL_PERIOD 10     // Seconds between online fits
+#define MAGCAL_MIN_NEW 100   // Minimum number of new samples for a new online fit
+static const double magcal_min_coverage = 0.5;  // Minimum fraction of the bins with samples, for a full fit
+static const double magcal_min_horizontal = 0.75;  // Minimum fraction of the headings with samples, for a horizontal fit
+static const double magcal_max_error = 0.005;   // Maximum mean cuadratic error of an online fit
+static MagCalOnline_t mag_online;   // Samples for online calibration, protected by mag_online_mutex
+static pthread_mutex_t mag_online_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mag_online_cond = PTHREAD_COND_INITIALIZER;  // Signals the thread to stop
+static pthread_t mag_online_thread;
+static bool mag_online_running, mag_online_stop;
+
+static double deltat;  // Inverse of gyro/accel ODR, set in setupLSM9DS1()
 
 /*
-1st order derivative, using backward finite difference with a second-order accuracy
+Sample clock of the accel/gyro. The samples of a burst are read together, at a jittery time after 
+the last one was taken, and the oscillator of the sensor differs from the nominal ODR by a few percent. 
+A PLL estimates the real sample period and the time of the last sample from the read ticks and the 
+number of samples of each burst (see update_sample_clock()). Its gains give a critically damped loop.
 */
-static double HP_1st_deriv_filter_taps[] = {
-  1.5,
-  -2.0,
-  0.5  
-};
-
-
-static int LPFilter_init(Filter_t *f, double *tap_array, unsigned tap_list_size) 
-{
-   if (f == NULL) ERR(-1, "Invalid filter descriptor");
-   if (tap_array == NULL || tap_list_size == 0) ERR(-1, "Invalid tap array for filter");
-   f->last_index = 0;
-   f->taps_num = tap_list_size;
-   f->taps = tap_array;
-   f->history = calloc(tap_list_size, sizeof(double));
-   if (f->history == NULL) ERR(-1, "Cannot allocate memory: %s", strerror(errno));
-   return 0;
-}
-
-
-static double LPFilter_close(Filter_t *f) 
-{
-   if (f->history) free(f->history);
-}
+typedef struct {
+   uint32_t tick;      // gpioTick() of the last FIFO read
+   double offset;      // Estimated time of the last sample read, relative to tick, in us
+   double period;      // Estimated period of the samples, in us
+   double jitter_var;  // Mean of the squared phase error, in us^2
+   bool started, resync;
+} SampleClock_t;
 
+static const double clock_kp = 0.2;    // Proportional gain of the PLL, on the phase
+static const double clock_ki = 0.01;   // Integral gain of the PLL, on the period
+static const double clock_jitter_alpha = 0.01;  // Weight of each burst in jitter_rms
+#define CLOCK_LOCK_BURSTS 100   // Bursts until the clock is considered locked
 
-static void LPFilter_setDCgain(Filter_t *f, double gain_value)
-{
-int i;
-double DC_gain = 0;  
-
-   if (f == NULL) ERR(, "Invalid filter descriptor");
-   // Calculate current DC gain
-   for (i = 0; i < f->taps_num; i++) DC_gain += f->taps[i];
-   if (DC_gain == 0) ERR(, "DC gain of filter is zero, cannot set gain");
-   // Now, change taps so that the new DC gain is 'gain_value'
-   for (i = 0; i < f->taps_num; i++) f->taps[i] *= gain_value/DC_gain;     
-}
+static SampleClock_t sample_clock;
+static SeqLock_t stats_lock;
+static IMUStats_t stats;   // Published with stats_lock, see getStatsLSM9DS1()
+static const char *i2c_names[IMU_I2C_OPS] = {"Magnetometer status", "Magnetometer data", "FIFO status", "FIFO data"};
 
+/* Thread which prints the statistics when requested with requestStatsLSM9DS1(), eg on SIGUSR1 */
+static sem_t stats_sem;
+static pthread_t stats_thread;
+static _Atomic bool stats_running;
 
 
-static void LPFilter_put(Filter_t *f, double input) 
-{
-  f->history[f->last_index++] = input;
-  if (f->last_index == f->taps_num) f->last_index = 0;
-}
+// Output variables of the 3D compass, updateOrientation()
+static double roll, pitch, yaw, tilt;
 
+/* Attitude published after each read of the IMU, see publish_attitude() and getAttitudeSnapshot() */
+static SeqLock_t attitude_lock;
+static Attitude_t attitude;   // Without the angles, they are computed from the quaternion when needed
 
-static double LPFilter_get(const Filter_t *f) 
-{
-  double acc = 0;
-  int index = f->last_index, i;
-  
-  for (i = 0; i < f->taps_num; i++) {
-    index = (index != 0) ? index-1 : f->taps_num-1;
-    acc += f->history[index] * f->taps[i];
-  }
-  return acc;
-}
+/* Euler angles of the last record read by each thread, see getAttitudeSnapshot() */
+static _Thread_local struct {
+   bool valid;
+   uint32_t sample;
+   double yaw, pitch, roll;
+} euler_cache;
 
 
+/* Prototypes */
+static void imuRead(void);
+static void imuInterrupt(int gpio, int level, uint32_t tick);
+static void calibrate_accel_gyro(void);
+static void calibrate_magnetometer(void);
+static void* stats_loop(void *arg);
+                                     
+                                     
+                                     
+                                     
 
 /*
 Function to calculate heading, using magnetometer readings.
@@ -433,8 +392,12 @@ int rc;
    if (rc==EOF || rc!=3) goto cal_error;
    rc = fscanf(fp, "MGH: %d, %d, %d\n", &err_MA[0], &err_MA[1], &err_MA[2]);
    if (rc==EOF || rc!=3) goto cal_error;   
-   rc = fscanf(fp, "MGS: %lf, %lf, %lf\n", &scale_MA[0], &scale_MA[1], &scale_MA[2]);   
+   rc = fscanf(fp, "MGS: %lf, %lf, %lf\n", &scale_MA[0][0], &scale_MA[1][1], &scale_MA[2][2]);   
    if (rc==EOF || rc!=3) goto cal_error;  
+   // Off-diagonal elements of softiron matrix (xy, xz, yz). Files from older versions do not have them
+   rc = fscanf(fp, "MGX: %lf, %lf, %lf\n", &scale_MA[0][1], &scale_MA[0][2], &scale_MA[1][2]);   
+   if (rc==EOF || rc!=3) scale_MA[0][1] = scale_MA[0][2] = scale_MA[1][2] = 0;
+   scale_MA[1][0] = scale_MA[0][1]; scale_MA[2][0] = scale_MA[0][2]; scale_MA[2][1] = scale_MA[1][2]; 
    fclose(fp);
    
    fp = fopen(dev_file, "r");
@@ -455,7 +418,8 @@ cal_error:
    err_AL[0] = err_AL[1] = err_AL[2] = 0;
    err_GY[0] = err_GY[1] = err_GY[2] = 0; 
    err_MA[0] = err_MA[1] = err_MA[2] = 0; 
-   scale_MA[0] = scale_MA[1] = scale_MA[2] = 1.0;       
+   memset(scale_MA, 0, sizeof(scale_MA));
+   scale_MA[0][0] = scale_MA[1][1] = scale_MA[2][2] = 1.0;       
    ERR(, "Cannot read data from calibration file %s", cal_file);
    
 dev_error:
@@ -467,6 +431,35 @@ dev_error:
 }
  
 
+/* Read the gyroscope bias tracked in the last session. Returns -1 if it is not available */
+static int read_gyro_bias(void)
+{
+FILE *fp;  
+int rc;
+double bias[3];
+   
+   fp = fopen(bias_file, "r");
+   if (!fp) return -1;  // Not an error, there is no tracked bias yet
+   rc = fscanf(fp, "GYB: %lf, %lf, %lf\n", &bias[0], &bias[1], &bias[2]);
+   fclose(fp);
+   if (rc==EOF || rc!=3) ERR(-1, "Cannot read data from gyroscope bias file %s", bias_file);
+   memcpy(bias_GY, bias, sizeof(bias_GY));
+   return 0;
+}
+
+
+/* Write the tracked gyroscope bias into a file, for the next session */ 
+static void write_gyro_bias(void)
+{
+FILE *fp;    
+
+   fp = fopen(bias_file, "w");
+   if (!fp) ERR(, "Cannot open gyroscope bias file %s: %s", bias_file, strerror(errno));
+   fprintf(fp, "GYB: %f, %f, %f\n", bias_GY[0], bias_GY[1], bias_GY[2]);
+   fclose(fp);
+}
+
+
 /* Write the calibration data for accelerometer, gyroscope and magnetometer into a file */ 
 static void write_calibration_data(void)
 {
@@ -478,7 +471,8 @@ FILE *fp;
    fprintf(fp, "AL: %d, %d, %d\n", err_AL[0], err_AL[1], err_AL[2]);
    fprintf(fp, "GY: %d, %d, %d\n", err_GY[0], err_GY[1], err_GY[2]);   
    fprintf(fp, "MGH: %d, %d, %d\n", err_MA[0], err_MA[1], err_MA[2]);    
-   fprintf(fp, "MGS: %f, %f, %f\n", scale_MA[0], scale_MA[1], scale_MA[2]);     
+   fprintf(fp, "MGS: %f, %f, %f\n", scale_MA[0][0], scale_MA[1][1], scale_MA[2][2]);     
+   fprintf(fp, "MGX: %f, %f, %f\n", scale_MA[0][1], scale_MA[0][2], scale_MA[1][2]);     
    fclose(fp);
 
    fp = fopen(dev_file, "w");
@@ -600,7 +594,8 @@ rw_error:
  /* 
  Calibrate magnetometer.
  It writes the measured error in global variables err_MA and scale_MA. 
- This corresponds to the hardiron and softiron effects respectively.
+ This corresponds to the hardiron and softiron effects respectively. The softiron matrix
+ is not assumed diagonal, so the ellipsoid of the samples can have any orientation.
  The car should be rotated in all 3 axis, and then rotated in all directions.
  In future, it would be good to make sure that roll and pitch angles are evenly distributed in the calibration samples.
  The samples can be graphically viewed from the file mag_data.csv. It should be an ellipsoid.
@@ -620,6 +615,7 @@ int64_t s2_mx=0, s2_my=0, s2_mz=0;
 int rad_x, rad_y, rad_z;
 bool do_first_part = true;
 double rad_mean, mean_cuad_error;
+MagCal_t cal;
 const int cal_seconds = 60; // Number of seconds to take samples
 const int error_meas_seconds = 2;  // Number of seconds for error measurement, must be less than 'seconds'
   
@@ -688,22 +684,34 @@ const int error_meas_seconds = 2;  // Number of seconds for error measurement, m
    
    /****** Now estimate hardiron and softiron effects ******/
    /* Hardiron error, initial estimation */
-   err_MA[0] = (min_x + max_x)/2; 
-   err_MA[1] = (min_y + max_y)/2;
-   err_MA[2] = (min_z + max_z)/2;
+   memset(&cal, 0, sizeof(cal));
+   cal.center[0] = (min_x + max_x)/2; 
+   cal.center[1] = (min_y + max_y)/2;
+   cal.center[2] = (min_z + max_z)/2;
        
-   /* Simplified softiron error estimate as starting point */
+   /* Simplified softiron error estimate as starting point (axis aligned ellipsoid) */
    rad_x = (max_x - min_x)/2;
    rad_y = (max_y - min_y)/2;   
    rad_z = (max_z - min_z)/2;     
    rad_mean = (rad_x + rad_y + rad_z)/3.0;
-   scale_MA[0] = rad_mean/rad_x;
-   scale_MA[1] = rad_mean/rad_y;  
-   scale_MA[2] = rad_mean/rad_z; 
+   cal.matrix[0][0] = rad_mean/rad_x;
+   cal.matrix[1][1] = rad_mean/rad_y;  
+   cal.matrix[2][2] = rad_mean/rad_z; 
    
-   /* Calculate a better approximation for err_MA and scale_MA, changing the global variables if succesful */
-   mean_cuad_error = ellipsoid_fit(&sample_list);
-   if (mean_cuad_error > 0.02)   // Limit found experimentally
+   /* Calculate a better approximation, fitting the samples into a rotated ellipsoid.
+      The correct magnitude of the magnetic field cannot be calculated from the samples, so magneticField is used */
+   mean_cuad_error = MagCal_fit(&sample_list, lround(magneticField/mRes), &cal);
+   if (mean_cuad_error >= 0) {
+      err_MA[0] = lrint(cal.center[0]); err_MA[1] = lrint(cal.center[1]); err_MA[2] = lrint(cal.center[2]);
+      memcpy(scale_MA, cal.matrix, sizeof(scale_MA));
+      printf("Vx:%.1f Vy:%.1f Vz:%.1f\n", cal.center[0], cal.center[1], cal.center[2]);
+      printf("Softiron matrix: %.3f %.3f %.3f / %.3f %.3f %.3f / %.3f %.3f %.3f\n", 
+             cal.matrix[0][0], cal.matrix[0][1], cal.matrix[0][2], cal.matrix[1][0], cal.matrix[1][1], 
+             cal.matrix[1][2], cal.matrix[2][0], cal.matrix[2][1], cal.matrix[2][2]);
+      printf("Residuals: rms=%.4f, max=%.4f (%d passes over %d samples)\n", 
+             cal.rms_residual, cal.max_residual, cal.passes, sample_list.num_elems);
+   }
+   if (mean_cuad_error < 0 || mean_cuad_error > 0.02)   // Limit found experimentally
       fprintf(stderr, "%s: Mean cuadratic error (%.3f) is too big, repeat calibration\n", __func__, mean_cuad_error);
    
    free(sample_list.xvalues); free(sample_list.yvalues); free(sample_list.zvalues);
@@ -716,275 +724,347 @@ rw_error:
    if (sample_list.yvalues) free(sample_list.yvalues); 
    if (sample_list.zvalues) free(sample_list.zvalues);
    err_MA[0] = err_MA[1] = err_MA[2] = 0; 
-   scale_MA[0] = scale_MA[1] = scale_MA[2] = 1.0;   
+   memset(scale_MA, 0, sizeof(scale_MA));
+   scale_MA[0][0] = scale_MA[1][1] = scale_MA[2][2] = 1.0;   
    ERR(, "Cannot calibrate magnetometer");   
 }
 
 
 
 
-/* 
-   Calculate a better approximation for err_MA and scale_MA. Do it by fitting the measured samples into an ellipsoid. 
-   It is based on ideas from https://www.nxp.com/docs/en/application-note/AN4246.pdf
-   This ellipsoid is assumed to have axis parallel to X, Y and Z (ie, it is not rotated). This assumption is normally true.
-   The assumption implies that the ellipsoid fit matrix A is diagonal, leaving only three unknowns, called A, B and C.
-   The inverse softiron matrix W^-1 is then also diagonal, with coefficients equal to the square root of A, B and C.
-   The function calculates the ellipsoid that fits best into the given samples, minimizing the sum of the square errors of all samples.
-   In order to do that, it travels its path, starting from the given initial values in err_MA and scale_MA, along
-   the opposite gradient of the error function until a minimum is found.
-   The correct magnitude of the magnetic field cannot be calculated from the samples, 
-   as all 3 axis can be subject to softiron deformation. So the approximation uses the global variable magneticField, 
-   which should contain the magnitude of the magnetic field in the location. A correct value is not needed for orientation
-   (ie, calculation of yaw, pitch and roll), so its accurate filling is optative.
-   Non constant global variables accessed: err_MA, scale_MA, mRes. They must have correct values prior to call.
-   The variables err_MA and scale_MA are modified to reflect the new fit.
+/*
+Thread for the online calibration of the magnetometer. Every MAGCAL_PERIOD seconds, if there are enough
+new samples, it fits them to an ellipsoid (see magcal.c), or only the horizontal hardiron offset
+if they do not cover enough directions.
+The new calibration is used by imuRead() if its error is small and it is better than the current one
+with the same samples. It is also written into the calibration file, for the next start.
 */
-static double ellipsoid_fit(const SampleList_t *const sample_list)
+static void *mag_calibration_loop(void *arg)
 {
-int iter, num_excess_err; 
-double Vx, Vy, Vz;
-double dVx, dVy, dVz;
-double A, B, C;
-double dA, dB, dC; 
-double err, init_err, min_err, step; 
-double min_found[7];  // err, Vx, Vy, Vx, A, B, C 
-const double delta = 0.001;
-   
-   const double Bm = lround(magneticField/mRes);  // Value of magnetic field in IMU units
-   /* Set initial point from global variables */
-   Vx = (double)err_MA[0]; Vy = (double)err_MA[1]; Vz = (double)err_MA[2];
-   A = scale_MA[0]; B = scale_MA[1]; C = scale_MA[2];  
-   
-   /* Iterate a maximum of 50 times to find a minimum in the error function */
-   for (iter=0; iter<50;iter++) {
-      /* Compute error of current point */
-      err = quad_error_function(Vx, Vy, Vz, A, B, C, Bm, sample_list);
-      if (iter==0) init_err = err;  // Store error of initial point
-      /* Check if we found a minimum */
-      if (iter==0 || err<min_err) {
-         min_err = min_found[0] = err; 
-         min_found[1] = Vx; min_found[2] = Vy; min_found[3] = Vz; 
-         min_found[4] = A; min_found[5] = B; min_found[6] = C; 
-         num_excess_err = 0;
-      }
-      /* If a minimum was not found, check that we do not exceed 8 iterations with no new minimum found */
-      if (err>min_err && ++num_excess_err==8) break;  
+int xvalues[MAGCAL_BINS*MAGCAL_BIN_SAMPLES], yvalues[MAGCAL_BINS*MAGCAL_BIN_SAMPLES], zvalues[MAGCAL_BINS*MAGCAL_BIN_SAMPLES];
+SampleList_t sample_list = {.xvalues=xvalues, .yvalues=yvalues, .zvalues=zvalues, .num_elems=0};
+struct timespec deadline;
+MagCal_t cal;
+double coverage, err, current_err;
+bool full_fit;
+const double Bm = lround(magneticField/mRes);  // Value of magnetic field in IMU units
+int i, index;
+
+   pthread_mutex_lock(&mag_online_mutex);
+   while (!mag_online_stop) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += MAGCAL_PERIOD;
+      pthread_cond_timedwait(&mag_online_cond, &mag_online_mutex, &deadline);
+      if (mag_online_stop || mag_online.new_samples < MAGCAL_MIN_NEW) continue;
+      coverage = MagCalOnline_coverage(&mag_online);
+      full_fit = coverage >= magcal_min_coverage;
+      MagCalOnline_samples(&mag_online, &sample_list);
+      pthread_mutex_unlock(&mag_online_mutex);
       
-      /* Calculate gradient of error function, using finite difference approximation */
-      dA = (quad_error_function(Vx, Vy, Vz, A+delta, B, C, Bm, sample_list)-quad_error_function(Vx, Vy, Vz, A-delta, B, C, Bm, sample_list))/(2*delta);
-      dB = (quad_error_function(Vx, Vy, Vz, A, B+delta, C, Bm, sample_list)-quad_error_function(Vx, Vy, Vz, A, B-delta, C, Bm, sample_list))/(2*delta);
-      dC = (quad_error_function(Vx, Vy, Vz, A, B, C+delta, Bm, sample_list)-quad_error_function(Vx, Vy, Vz, A, B, C-delta, Bm, sample_list))/(2*delta);
-      dVx = (quad_error_function(Vx+delta, Vy, Vz, A, B, C, Bm, sample_list)-quad_error_function(Vx-delta, Vy, Vz, A, B, C, Bm, sample_list))/(2*delta);
-      dVy = (quad_error_function(Vx, Vy+delta, Vz, A, B, C, Bm, sample_list)-quad_error_function(Vx, Vy-delta, Vz, A, B, C, Bm, sample_list))/(2*delta);
-      dVz = (quad_error_function(Vx, Vy, Vz+delta, A, B, C, Bm, sample_list)-quad_error_function(Vx, Vy, Vz-delta, A, B, C, Bm, sample_list))/(2*delta);
+      /* Fit, starting from the calibration in use. Only this thread changes it */
+      index = atomic_load_explicit(&mag_cal_index, memory_order_relaxed);
+      cal = mag_cal[index];
+      current_err = MagCal_cost(&sample_list, Bm, &cal);
+      if (full_fit) err = MagCal_fit(&sample_list, Bm, &cal);
+      else {
+         err = MagCal_fitHorizontal(&sample_list, Bm, &cal, &coverage);
+         if (coverage < magcal_min_horizontal) err = -1;
+      }
+      if (err >= 0 && err < magcal_max_error && err < current_err) {
+         mag_cal[1-index] = cal;
+         atomic_store_explicit(&mag_cal_index, 1-index, memory_order_release);
+         for (i=0; i<3; i++) err_MA[i] = lrint(cal.center[i]);
+         memcpy(scale_MA, cal.matrix, sizeof(scale_MA));
+         write_calibration_data();
+         printf("Magnetometer calibration updated (%s fit): coverage %.0f%%, error %.4f (was %.4f)\n", 
+                full_fit ? "full" : "horizontal", 100*coverage, err, current_err);
+      }
       
-      /* Calculate new point in direction of negative gradient, separately for each 3 dimension space */
-      step = 1.0/(2+iter);  // we use 1.0 instead of 2.0 (as is usual eg in FrankWolfe algorithm) to get smaller steps
-      A -= dA*step/sqrt(dA*dA+dB*dB+dC*dC);
-      B -= dB*step/sqrt(dA*dA+dB*dB+dC*dC);  
-      C -= dC*step/sqrt(dA*dA+dB*dB+dC*dC);  
-      // The step must be higher for the center coordinates, otherwise it hardly moves
-      Vx -= dVx*100*step/sqrt(dVx*dVx+dVy*dVy+dVz*dVz);
-      Vy -= dVy*100*step/sqrt(dVx*dVx+dVy*dVy+dVz*dVz);
-      Vz -= dVz*100*step/sqrt(dVx*dVx+dVy*dVy+dVz*dVz);     
+      pthread_mutex_lock(&mag_online_mutex);
+      memcpy(mag_online.center, mag_cal[atomic_load_explicit(&mag_cal_index, memory_order_relaxed)].center, 
+             sizeof(mag_online.center));  // Bin new samples around the center in use
    }
-   //printf("%d iterations\n", iter);
-    
-   /* A minimum was possibly found */
-   if (min_err < init_err) {  // if error of new point is less than initial error, eureka
-      err_MA[0] = lrint(min_found[1]); err_MA[1] = lrint(min_found[2]); err_MA[2] = lrint(min_found[3]);
-      scale_MA[0] = sqrt(min_found[4]); scale_MA[1] = sqrt(min_found[5]); scale_MA[2] = sqrt(min_found[6]); 
-      printf("Vx:%.1f Vy:%.1f Vz:%.1f\n", min_found[1],min_found[2], min_found[3]);
-      printf("A:%.2f B:%.2f C:%.2f\n", min_found[4],min_found[5], min_found[6]);
-      printf("Minimum found, initial error=%f, final error=%f\n", init_err, min_found[0]);
+   pthread_mutex_unlock(&mag_online_mutex);
+   return NULL;
+}
+
+
+
+/* Initialize the filters of a processing pipeline */
+static int pipeline_init(Pipeline_t *p)
+{
+int rc;
+double *taps, odr_ag = odr_ag_modes[ODR_AG], odr_m = odr_m_modes[ODR_M], fc;
+unsigned num_taps;
+
+   // Initialize polyphase interpolating filter for magnetometer data, at the accel/gyro ODR
+   // Its DC gain is set to upsampling_factor, to compensate for DC gain reduction due to interpolation
+   // Each filter makes its own copy of the taps
+   taps = LPFilter_design(odr_m/2, odr_m/2, odr_ag, &num_taps);
+   if (taps == NULL) return -1;
+   rc = Interpolator_init(&p->filter_mx, taps, num_taps, upsampling_factor);
+   if (rc == 0) rc = Interpolator_init(&p->filter_my, taps, num_taps, upsampling_factor);
+   if (rc == 0) rc = Interpolator_init(&p->filter_mz, taps, num_taps, upsampling_factor);
+   free(taps);
+   if (rc < 0) return -1; 
+   
+   // Initialize low pass filter for accelerometer data. The cutoff is limited at low ODR values
+   fc = accel_cutoff < odr_ag/4 ? accel_cutoff : odr_ag/4;
+   taps = LPFilter_design(fc, 1.5*fc, odr_ag, &num_taps);
+   if (taps == NULL) return -1;
+   rc = FIRf_init(&p->filter_ax, taps, num_taps);
+   if (rc == 0) rc = FIRf_init(&p->filter_ay, taps, num_taps);
+   if (rc == 0) rc = FIRf_init(&p->filter_az, taps, num_taps);
+   free(taps);
+   if (rc < 0) return -1; 
+
+   // Initialize the collision detector, with its own short filters
+   rc = Collision_init(&p->detector, odr_ag);
+   if (rc < 0) return -1;
+   
+   if (fusion_engine == NULL) fusion_engine = Fusion_find("madgwick");
+   Fusion_init(&p->fusion, fusion_engine, deltat);
+   return 0;
+}
+
+
+static void pipeline_close(Pipeline_t *p)
+{
+   Interpolator_close(&p->filter_mx); Interpolator_close(&p->filter_my); Interpolator_close(&p->filter_mz);
+   FIRf_close(&p->filter_ax); FIRf_close(&p->filter_ay); FIRf_close(&p->filter_az);
+   Collision_close(&p->detector);
+}
+
+
+
+/*
+Decode the raw accel/gyro samples read from the FIFO into structure of arrays form, in counts of the
+lowest range (see Range_t). The accelerometer error values and the gyroscope bias are substracted when 
+the values are scaled. X and Y axis are exchanged, so that reference system is right handed, 
+X axis points forwards, Y to the left, and filter algorithms work correctly.
+*/
+static void decode_fifo(const char *buf, int samples, FIFOBlock_t *b)
+{
+const char *p;
+int n, am = accel_ranges[fifo_accel_range].mult, gm = gyro_ranges[fifo_gyro_range].mult;
+
+   for (n=0; n<samples; n++) { 
+      p = buf + 12*n;
+      b->gy[n] = gm*(int16_t)(p[1]<<8 | p[0]); b->gx[n] = gm*(int16_t)(p[3]<<8 | p[2]); b->gz[n] = gm*(int16_t)(p[5]<<8 | p[4]);
+      b->ay[n] = am*(int16_t)(p[7]<<8 | p[6]); b->ax[n] = am*(int16_t)(p[9]<<8 | p[8]); b->az[n] = am*(int16_t)(p[11]<<8 | p[10]);    
    }
-   return min_err/sample_list->num_elems;  // Mean cuadratic error
 }
 
 
+
 /*
-Compute the total quadratic error of the ellipsoid fit given by the parameters Vx, Vy, Vz (the displacement, or hardiron)
-and A, B C (the axis coefficients, or softiron). It uses the given magnetometer samples in the sample_list.
-Bm is the local magnetic field strength (in IMU scale, between -32768 and 32767).
-The error is the sum of the cuadratic errors of each sample with the given fit.
-The ellipsoid equation is A(Bx-Vx)^2+B(By-Vy)^2+C(Bz-Vz)^2 - Bm^2 = 0, so the 
-error of each sample measures how far from zero is each sample, squared.
+Choose the ranges of accelerometer and gyroscope for the next bursts, from the raw samples of this one.
+A sample near the limits switches at once to the next range; the previous range is only selected when 
+all samples fitted in it with margin for range_hold seconds. The switch is done by set_range().
 */
-static double quad_error_function(double Vx, double Vy, double Vz, double A, double B, double C, 
-                            double Bm, const SampleList_t *const sample_list)
+static void check_range(const char *buf, int samples)
 {
-double cuad_err_total=0.0, err, ex, ey, ez;
-int i;   
-   
-   for (i=0; i<sample_list->num_elems; i++) {
-      ex = (sample_list->xvalues[i]-Vx)/Bm; 
-      ey = (sample_list->yvalues[i]-Vy)/Bm; 
-      ez = (sample_list->zvalues[i]-Vz)/Bm;
-      err = A*ex*ex + B*ey*ey + C*ez*ez - 1;
-      cuad_err_total += err * err;
-   }   
-   return cuad_err_total;
+const char *p;
+int n, i, amax = 0, gmax = 0, v;
+
+   if (range_mode == RANGE_FIXED) return;
+   for (n=0; n<samples; n++) {
+      p = buf + 12*n;
+      for (i=0; i<3; i++) {
+         v = abs((int16_t)(p[2*i+1]<<8 | p[2*i]));
+         if (v > gmax) gmax = v;
+         v = abs((int16_t)(p[2*i+7]<<8 | p[2*i+6]));
+         if (v > amax) amax = v;
+      }
+   }
+   
+   next_accel_range = accel_range;
+   if (amax > range_up*32768 && accel_range < NUM_RANGES(accel_ranges)-1) next_accel_range = accel_range + 1;
+   else if (accel_range > 0 && amax*accel_ranges[accel_range].mult < range_down*32768*accel_ranges[accel_range-1].mult) {
+      accel_quiet += samples;
+      if (accel_quiet > range_hold*odr_ag_modes[ODR_AG]) next_accel_range = accel_range - 1;
+   }
+   else accel_quiet = 0;
+   
+   next_gyro_range = gyro_range;
+   if (gmax > range_up*32768 && gyro_range < NUM_RANGES(gyro_ranges)-1) next_gyro_range = gyro_range + 1;
+   else if (gyro_range > 0 && gmax*gyro_ranges[gyro_range].mult < range_down*32768*gyro_ranges[gyro_range-1].mult) {
+      gyro_quiet += samples;
+      if (gyro_quiet > range_hold*odr_ag_modes[ODR_AG]) next_gyro_range = gyro_range - 1;
+   }
+   else gyro_quiet = 0;
 }
 
 
 
+/*
+Program the ranges selected by check_range(), if they changed. It is called after reading the number 
+of samples in the FIFO and before reading them, so the samples of this burst are in the old ranges 
+and those of the next burst in the new ones, except the first ones, taken before or during the switch: 
+they are dropped in the next reads (see rangedrop.h).
+The threshold of the collision interrupt generator depends on the range of the accelerometer.
+Returns 1 if a range was switched, 0 if not, or a negative value on error.
+*/
+static int set_range(void)
+{
+int rc, switched = 0;
+uint8_t byte;
+
+   if (next_accel_range != accel_range) {
+      // CTRL_REG6_XL: ODR power down (b000), FS, BW_SCAL: auto (b0), BW sel: 408 Hz (b00), as in setupLSM9DS1()
+      rc = i2cWriteByteData(i2c_accel_handle, 0x20, accel_ranges[next_accel_range].bits<<3);
+      if (rc < 0) return rc;
+      accel_range = next_accel_range;
+      accel_quiet = 0;
+      accel_switches++;
+      switched = 1;
+      if (collisionPin >= 0) {  // INT_GEN_THS_Y_XL, 1 LSB is 1/128 of the full scale
+         byte = lround(128*collision_threshold/accel_ranges[accel_range].fs) > 255 ? 255 : lround(128*collision_threshold/accel_ranges[accel_range].fs);
+         rc = i2cWriteByteData(i2c_accel_handle, 0x08, byte);
+         if (rc < 0) return rc;
+      }
+   }
+   if (next_gyro_range != gyro_range) {
+      // CTRL_REG1_G: ODR, FS, 0 (b0), BW LPF2: 31 Hz (b01), as in setupLSM9DS1()
+      rc = i2cWriteByteData(i2c_accel_handle, 0x10, (ODR_AG<<5) + (gyro_ranges[next_gyro_range].bits<<3) + 0x01);
+      if (rc < 0) return rc;
+      gyro_range = next_gyro_range;
+      gyro_quiet = 0;
+      gyro_switches++;
+      switched = 1;
+   }
+   return switched;
+}
 
-/* 
-This function is called periodically, with the rate of the magnetometer ODR.
-It reads the IMU data and feeds the Magdwick fusion filter and 3D tilt compensated compass algorithm. 
-Both do the same and have the same results, but the fusion filter needs much longer to converge.
-The magnetomer data is read. If data was available, the function goes on to read the FIFO
-of the accelerometer/gyroscope, which has a much higher ODR (this is why the FIFO is used, 
-to store data without having to poll so often).
-For each value of the accel/gyro, the fusion filter and the 3D compensated compass are called, using
-interpolated magnetometer data, so both sample rates are the same. 
 
-It takes about 5 ms to complete (mostly between 4.5 and 5.5 ms) for ODR_M=40 Hz, ODR_AGG=238 Hz.
+
+/*
+Collision detection, with the acceleration sample without the gravity of the current attitude
+(see collision.h). It is called for each sample, after the update of the fusion engine, with the raw 
+accelerometer sample (in g): the filter of the fusion engine would delay the detection too much.
+Collisions are not detected until the warm start has set the attitude, the gravity is not known before.
 */
-static void imuRead(void)
+static void detect_collision(Pipeline_t *p, double axr, double ayr, double azr, double dt)
 {
-int n, rc, samples;   
-char *p, str[17], buf[12*32+1], commands[] = {0x07, 0x01, 0x18, 0x01, 0x06, 0x00, 0x00, 0x00};
-uint32_t start_tick, mtick;
-static uint32_t old_mtick;
-static unsigned int samples_count, count, collision_sample;
-static bool in_collision;
-static double v_m, e_m;
+double a[3];
 
-/* These values are the RAW signed 16-bit readings from the sensors */
-int16_t gx, gy, gz; // x, y, and z axis raw readings of the gyroscope
-int16_t ax, ay, az; // x, y, and z axis raw readings of the accelerometer
-int16_t mx, my, mz; // x, y, and z axis raw readings of the magnetometer
+   Fusion_getLinearAcceleration(&p->fusion, axr, ayr, azr, a);
+   p->detector.armed = warm_phase != WARM_AVERAGING;
+   Collision_update(&p->detector, a, dt);
+}
 
-/* Real (scaled and compensated) readings of the sensors */
-double axr, ayr, azr;
-double gxr, gyr, gzr;
-double mxr, myr, mzr; 
-double axrf, ayrf, azrf; // values after LPF
-double mxrf, myrf, mzrf; // values after LPF
-double daxr;
 
-   start_tick = gpioTick(); 
 
-   // Read status register in magnetometer, to check if new data is available
-   rc = i2cReadByteData(i2c_mag_handle, 0x27);  // Read magnetometer STATUS_REG register, needs 0.1 ms   
-   if (rc < 0) goto rw_error;  
+/*
+Track the gyroscope bias while the car is stationary, with a scalar Kalman filter for each axis 
+(the bias is modelled as a random walk, as it drifts with temperature). The car is stationary if the 
+motors are stopped, the wheel encoders do not count, the gyroscope does not show a clear rotation 
+(eg the car is turned by hand) and the norm of the acceleration is steady. 
+The bias is only updated after the car has been stationary for STATIONARY_HOLD seconds, 
+so that it is not coasting after stopping.
+*/
+static void track_gyro_bias(const char *buf, int samples)
+{
+static uint32_t last_pulses;
+static int stationary_samples;
+FIFOBlock_t raw;
+double a, ax, ay, az, s1 = 0, s2 = 0, g[3] = {0, 0, 0}, var, R, K, noise;
+uint32_t pulses;
+bool stationary;
+int n, i;
+
+   if (samples < 2) return;
+   decode_fifo(buf, samples, &raw);
+   for (n=0; n<samples; n++) {
+      ax = raw.ax[n] - err_AL[0]; ay = raw.ay[n] - err_AL[1]; az = raw.az[n] - err_AL[2];
+      a = sqrt(ax*ax + ay*ay + az*az)*aRes;
+      s1 += a; s2 += a*a;
+      g[0] += raw.gx[n]; g[1] += raw.gy[n]; g[2] += raw.gz[n];
+   }
+   for (i=0; i<3; i++) g[i] /= samples;
+   var = (s2 - s1*s1/samples)/(samples-1);
    
-   if (rc&0x08 == 0) return;  // If no new data available, return
+   pulses = getEncoderPulses();
+   stationary = motorsStopped() && pulses == last_pulses && var < stationary_max_accel_var;
+   for (i=0; i<3; i++) 
+      if (fabs(g[i]-bias_GY[i])*gRes > stationary_max_rate) stationary = false;
+   last_pulses = pulses;
    
-   /* New magnetometer data in XYZ is available
-      Read magnetometer data. X and Y axis are exchanged, and then Y is negated, 
-      so align the axis with tha ones used in this module for car orientation */
-         
-   // Read 6 bytes (X,Y,Z axis), starting in OUT_X_L_M register
-   rc = i2cReadI2CBlockData(i2c_mag_handle, 0x28, buf, 6); // Needs 0.2 ms
-   if (rc < 0) goto rw_error;
-   my = buf[1]<<8 | buf[0]; mx = buf[3]<<8 | buf[2]; mz = buf[5]<<8 | buf[4];  
-   my *= -1;         
- 
-   /* Substract measured error values (hardiron effects) */
-   mx -= err_MA[0]; my -= err_MA[1]; mz -= err_MA[2];      
-   /* Compensate for softiron and scale result */
-   mxr = mx*scale_MA[0]*mRes; myr = my*scale_MA[1]*mRes; mzr = mz*scale_MA[2]*mRes; 
-           
-   /*
-   mtick = gpioTick();
-   if (old_mtick) printf("Time between MAG samples: %.1f ms, ODR AG=%.1f\n", (mtick-old_mtick)/1000.0, (mtick-old_mtick)/1000000.0);
-   old_mtick = mtick;
-   */
-      
-   //snprintf(str, sizeof(str), "M:%-6.1f mG", 1000*sqrt(mxr*mxr+myr*myr+mzr*mzr));  
-   //oledWriteString(0, 6, str, false);  
+   for (i=0; i<3; i++) bias_GY_var[i] += gyro_bias_drift*gyro_bias_drift * samples*deltat;  // The bias drifts, moving or not
+   if (!stationary) {
+      stationary_samples = 0;
+      return;
+   }
+   stationary_samples += samples;
+   if (stationary_samples < STATIONARY_HOLD*odr_ag_modes[ODR_AG]) return;
    
-   /*
-   snprintf(str, sizeof(str), "MX:%-6.1f mG", mxr*1000);  
-   oledWriteString(0, 4, str, false);
-   snprintf(str, sizeof(str), "MY:%-6.1f mG", myr*1000);  
-   oledWriteString(0, 5, str, false);        
-   snprintf(str, sizeof(str), "MZ:%-6.1f mG", mzr*1000);  
-   oledWriteString(0, 6, str, false); 
-   */
-       
-   /* 
-   Now, read accel/gyro data. Read data from FIFO, as ODR of accel/gyro is probably higher
-   than that of magnetometer. The accel/gyro stores samples in the FIFO until it is read.
-   */
-
-   rc = i2cReadByteData(i2c_accel_handle, 0x2F);  // Read FIFO_SRC register, needs 0.1 ms
-   if (rc < 0) goto rw_error;
-   if (rc&0x40) fprintf(stderr, "%s in %s: FIFO overrun!\n", __func__, __FILE__);  // Should not happen
-   // samples in FIFO are between 3 and 4, average 3: AG ODR = 119 Hz, M ODR = 40 Hz, 119/40=3
-   // if AG ODR = 238, samples is between 6 and 8
-   samples = rc&0x3F;   // samples in FIFO could be zero  
-   //printf("Samples: %d\n", samples);
-   if (samples < upsampling_factor) {  // Should not happen. Emit a warning message.
-      fprintf(stderr, "%s: Timing problem: number of samples of accelerometer (%d) is less than upsampling factor (%d)", 
-            __func__, samples, upsampling_factor);    
-   }   
-      
-   if (samples) {  // if FIFO has sth, read it
-      /* Burst read. Accelerometer and gyroscope sensors are activated at the same ODR.
-         So read all FIFO lines (12 bytes each) in a single I2C transaction 
-         using a special function in pigpio library */
-      commands[5] = (12*samples)&0xFF;  // LSb value of number of bytes to read
-      commands[6] = (12*samples)>>8;    // MSb value of number of bytes to read
-      rc = i2cZip(i2c_accel_handle, commands, sizeof(commands), buf, sizeof(buf));   // Needs 1.2 ms for 4 samples
-      if (rc < 0) goto rw_error;         
+   /* The mean of the block is the measurement of the bias, its variance is the noise variance over the samples */
+   for (i=0; i<3; i++) {
+      noise = deviation_GY[i] > 0 ? deviation_GY[i] : gyro_default_noise;
+      R = noise*noise/samples;
+      K = bias_GY_var[i]/(bias_GY_var[i] + R);
+      bias_GY[i] += K*(g[i] - bias_GY[i]);
+      bias_GY_var[i] *= 1 - K;
    }
+   bias_GY_updated = true;
+}
+
+
+
+/*
+Process the accel/gyro samples read from the FIFO, one sample at a time. 
+The magnetometer values mxr, myr and mzr are upsampled to the accel/gyro ODR.
+This is the reference implementation for process_block().
+*/
+static void process_samples(Pipeline_t *pp, const char *buf, int samples, const double *dt, double mxr, double myr, double mzr)
+{
+int n;   
+const char *p;
+
+/* These values are the RAW signed 16-bit readings from the sensors */
+int32_t gx, gy, gz; // x, y, and z axis readings of the gyroscope, in counts of the lowest range
+int32_t ax, ay, az; // x, y, and z axis readings of the accelerometer, in counts of the lowest range
+int am = accel_ranges[fifo_accel_range].mult, gm = gyro_ranges[fifo_gyro_range].mult;
+
+/* Real (scaled and compensated) readings of the sensors */
+double axr, ayr, azr;
+double gxr, gyr, gzr;
+double axrf, ayrf, azrf; // values after LPF
+double mxrf, myrf, mzrf; // values after LPF
 
+   pp->yaw_delta = 0;
    for (n=0; n<samples; n++) { 
       p = buf + 12*n;
       
       /* Store accel and gyro data. X and Y axis are exchanged, so that reference system is
       right handed, X axis points forwards, Y to the left, and filter algorithms work correctly */
-      gy = p[1]<<8 | p[0]; gx = p[3]<<8 | p[2]; gz = p[5]<<8 | p[4];
-      ay = p[7]<<8 | p[6]; ax = p[9]<<8 | p[8]; az = p[11]<<8 | p[10];         
-
-      /* Substract the measured error values obtained during calibration */
-      ax -= err_AL[0]; ay -= err_AL[1]; az -= err_AL[2]; 
-      gx -= err_GY[0]; gy -= err_GY[1]; gz -= err_GY[2]; 
-
-      /* Store real values in float variables */
-      axr = ax*aRes; ayr = ay*aRes; azr = az*aRes;      
-      gxr = gx*gRes; gyr = gy*gRes; gzr = gz*gRes;              
+      gy = gm*(int16_t)(p[1]<<8 | p[0]); gx = gm*(int16_t)(p[3]<<8 | p[2]); gz = gm*(int16_t)(p[5]<<8 | p[4]);
+      ay = am*(int16_t)(p[7]<<8 | p[6]); ax = am*(int16_t)(p[9]<<8 | p[8]); az = am*(int16_t)(p[11]<<8 | p[10]);         
+
+      /* Substract the measured error values obtained during calibration, and the tracked gyroscope bias. 
+         Store real values in float variables */
+      axr = (ax-err_AL[0])*aRes; ayr = (ay-err_AL[1])*aRes; azr = (az-err_AL[2])*aRes;      
+      gxr = (gx-bias_GY[0])*gRes; gyr = (gy-bias_GY[1])*gRes; gzr = (gz-bias_GY[2])*gRes;              
+      pp->rate[0] = gxr; pp->rate[1] = gyr; pp->rate[2] = gzr;
+      pp->yaw_delta += gzr*M_PI/180 * dt[n];
          
       /* Pass accelerometer data through a low pass filter to eliminate noise */
-      LPFilter_put(&filter_ax, axr); LPFilter_put(&filter_ay, ayr); LPFilter_put(&filter_az, azr); 
-      axrf = LPFilter_get(&filter_ax); ayrf = LPFilter_get(&filter_ay); azrf = LPFilter_get(&filter_az);      
-       
-      if (accel_fp) fprintf(accel_fp, "%3.5f;%3.5f;%3.5f\n", axr, ayr, azr);
- 
+      FIRf_put(&pp->filter_ax, axr); FIRf_put(&pp->filter_ay, ayr); FIRf_put(&pp->filter_az, azr); 
+      axrf = FIRf_get(&pp->filter_ax); ayrf = FIRf_get(&pp->filter_ay); azrf = FIRf_get(&pp->filter_az);      
+
       /* 
       Perform upsampling of magnetometer data to the ODR of the accelerometer/gyro by a factor of N. 
-      First, introduce N-1 0-valued samples to align both ODR. Then, filter with a low pass filter to
-      eliminate the spectral replica of the original signal. This interpolates the values.
+      This is equivalent to introducing N-1 0-valued samples to align both ODR, and then filtering with a 
+      low pass filter to eliminate the spectral replica of the original signal. The polyphase interpolator
+      only computes the taps which fall on real samples; the magnetometer value is taken every N samples.
       */
-      if (samples_count++%upsampling_factor == 0) {  // After the 0-valued samples, feed the real magnetometer value 
-         LPFilter_put(&filter_mx, mxr); LPFilter_put(&filter_my, myr); LPFilter_put(&filter_mz, mzr);  
-      }
-      else {  // Introduce 0-valued samples to align both ODR
-         LPFilter_put(&filter_mx, 0); LPFilter_put(&filter_my, 0); LPFilter_put(&filter_mz, 0);         
-      }
-      // Take output of the filter
-      mxrf = LPFilter_get(&filter_mx); myrf = LPFilter_get(&filter_my); mzrf = LPFilter_get(&filter_mz);
+      pp->samples_count++;
+      mxrf = Interpolator_get(&pp->filter_mx, mxr); myrf = Interpolator_get(&pp->filter_my, myr); mzrf = Interpolator_get(&pp->filter_mz, mzr);
       
       /***************** sensor values are calculated. Now do whatever with them ********/
-      v_m += 9.81*axrf * deltat;
-      e_m += v_m*deltat;
+      pp->v_m += 9.81*axrf * dt[n];
+      pp->e_m += pp->v_m*dt[n];
       //printf("a=%f, v=%f, e=%f\n", 9.81*axr, v_m, e_m);
-      LPFilter_put(&filter_d1_ax, axr);
-      daxr = odr_ag_modes[ODR_AG] * LPFilter_get(&filter_d1_ax);  // Calculate 1st derivative of axr, in g/s
-
-      if (!in_collision && fabs(daxr) > 100) {
-         collision_sample = samples_count;
-         in_collision = true;   
-         atomic_store_explicit(&collision, true, memory_order_release);
-      }
-      
-      if (in_collision && (samples_count - collision_sample)/odr_ag_modes[ODR_AG] > 0.1) {
-         in_collision = false;
-         atomic_store_explicit(&collision, false, memory_order_release);
-      }
       
       /*
       snprintf(str, sizeof(str), "AX:% 7.1f mg", axr*1000);  
@@ -1007,38 +1087,605 @@ double daxr;
       //updateOrientation(axrf, ayrf, azrf, mxrf, myrf, mzrf);   
       
       // Update sensor fusion filter with the data gathered
-      MadgwickQuaternionUpdate(axrf, ayrf, azrf, gxr*M_PI/180, gyr*M_PI/180, gzr*M_PI/180, mxrf, myrf, mzrf);
-      getAttitude(&yaw, &pitch, &roll);
-         
-      // Kalman extended filter
-      //EKFUpdateStatus(gxr*M_PI/180, gyr*M_PI/180, gzr*M_PI/180, axrf, ayrf, azrf, deltat);
-      //EKFUpdateStatus(0.01, 0.01, 0.01, 0.01, 0.01, 1.01, deltat);
+      Fusion_update(&pp->fusion, axrf, ayrf, azrf, gxr*M_PI/180, gyr*M_PI/180, gzr*M_PI/180, mxrf, myrf, mzrf, dt[n]);
+      detect_collision(pp, axr, ayr, azr, dt[n]);
    }
+}
+
+
+
+/*
+Process the accel/gyro samples read from the FIFO as a block, with the same results as process_samples().
+The burst is decoded into arrays, each filter runs over the whole block, and then the fusion filter 
+and the collision detection run sample by sample over the block. 
+This avoids the per sample function calls and keeps each filter state in cache while it is used.
+*/
+static void process_block(Pipeline_t *pp, const char *buf, int samples, const double *dt, double mxr, double myr, double mzr)
+{
+int n;
+FIFOBlock_t raw;
+float axr[FIFO_LINES], ayr[FIFO_LINES], azr[FIFO_LINES];     // Scaled accelerometer values
+float axrf[FIFO_LINES], ayrf[FIFO_LINES], azrf[FIFO_LINES];  // values after LPF
+double gxr[FIFO_LINES], gyr[FIFO_LINES], gzr[FIFO_LINES];    // Scaled gyroscope values
+double mxrf[FIFO_LINES], myrf[FIFO_LINES], mzrf[FIFO_LINES]; // Upsampled magnetometer values
+
+   decode_fifo(buf, samples, &raw);
+   
+   /* Store real values */
+   for (n=0; n<samples; n++) axr[n] = (raw.ax[n]-err_AL[0])*aRes;
+   for (n=0; n<samples; n++) ayr[n] = (raw.ay[n]-err_AL[1])*aRes;
+   for (n=0; n<samples; n++) azr[n] = (raw.az[n]-err_AL[2])*aRes;
+   for (n=0; n<samples; n++) gxr[n] = (raw.gx[n]-bias_GY[0])*gRes;
+   for (n=0; n<samples; n++) gyr[n] = (raw.gy[n]-bias_GY[1])*gRes;
+   for (n=0; n<samples; n++) gzr[n] = (raw.gz[n]-bias_GY[2])*gRes;
+   if (samples) {
+      pp->rate[0] = gxr[samples-1]; pp->rate[1] = gyr[samples-1]; pp->rate[2] = gzr[samples-1];
+   }
+   for (n=0, pp->yaw_delta=0; n<samples; n++) pp->yaw_delta += gzr[n]*M_PI/180 * dt[n];
+
+   /* Filters, each one over the whole block */
+   FIRf_block(&pp->filter_ax, axr, axrf, samples); 
+   FIRf_block(&pp->filter_ay, ayr, ayrf, samples); 
+   FIRf_block(&pp->filter_az, azr, azrf, samples); 
+   Interpolator_block(&pp->filter_mx, mxr, mxrf, samples);
+   Interpolator_block(&pp->filter_my, myr, myrf, samples);
+   Interpolator_block(&pp->filter_mz, mzr, mzrf, samples);
+   
+   /* Integration, fusion and collision detection, over the whole block.
+      The detector gets the accelerometer samples in double precision, as in process_samples() */
+   for (n=0; n<samples; n++) {
+      pp->v_m += 9.81*axrf[n] * dt[n];
+      pp->e_m += pp->v_m*dt[n];
+   }
+   for (n=0; n<samples; n++) {
+      pp->samples_count++;
+      Fusion_update(&pp->fusion, axrf[n], ayrf[n], azrf[n], gxr[n]*M_PI/180, gyr[n]*M_PI/180, gzr[n]*M_PI/180, mxrf[n], myrf[n], mzrf[n], dt[n]);
+      detect_collision(pp, (raw.ax[n]-err_AL[0])*aRes, (raw.ay[n]-err_AL[1])*aRes, (raw.az[n]-err_AL[2])*aRes, dt[n]);
+   }
+}
+
+
+
+/*
+Update the sample clock with a FIFO read at 'tick' of 'samples' samples, and fill dt with the time 
+from the previous sample to each one, in seconds. The phase error is the time from the predicted 
+time of the last sample to the read; the loop drives its mean to zero, so the timestamps have a 
+constant latency (the mean delay of the reads), which does not affect dt.
+If the FIFO overran, the samples lost are estimated from the phase error, and added to the first dt.
+Returns the time of the last sample, as a gpioTick() value.
+*/
+static uint32_t update_sample_clock(SampleClock_t *c, uint32_t tick, int samples, bool overrun, double *dt)
+{
+double e, jitter;
+long lost = 0;
+int n;
+
+   if (!c->started) {  // First read: nominal period, last sample at the read
+      c->period = 1E6/odr_ag_modes[ODR_AG];
+      c->offset = 0;
+      c->started = true;
+      e = 0;
+   }
+   else {
+      e = (uint32_t)(tick - c->tick) - c->offset - samples*c->period;
+      if (overrun && e > c->period/2) {
+         lost = lround(e/c->period);
+         e -= lost*c->period;
+      }
+      if (fabs(e) > FIFO_LINES*c->period) {  // Reads stopped for a long time: set the phase again
+         c->resync = true;
+         e = 0;
+      }
+      c->period += clock_ki*e/(samples+lost > 0 ? samples+lost : 1);
+      c->offset = -(1-clock_kp)*e;
+   }
+   c->tick = tick;
+   for (n=0; n<samples; n++) dt[n] = c->period*1E-6;
+   if (samples) dt[0] *= 1 + lost;
+   
+   /* Statistics, published for telemetry */
+   jitter = fabs(e);
+   c->jitter_var += clock_jitter_alpha*(e*e - c->jitter_var);
+   SeqLock_writeBegin(&stats_lock);
+   stats.timing.bursts++;
+   if (overrun) stats.timing.overruns++;
+   if (samples < upsampling_factor) stats.timing.short_bursts++;
+   if (c->resync) stats.timing.resyncs++;
+   stats.timing.lost_samples += lost;
+   stats.timing.odr = 1E6/c->period;
+   stats.timing.odr_nominal = odr_ag_modes[ODR_AG];
+   stats.timing.jitter_rms = sqrt(c->jitter_var);
+   stats.timing.locked = stats.timing.bursts > CLOCK_LOCK_BURSTS;
+   if (stats.timing.locked && jitter > stats.timing.jitter_max) stats.timing.jitter_max = jitter;
+   SeqLock_writeEnd(&stats_lock);
+   c->resync = false;
+   
+   return tick + lround(c->offset);
+}
+
+
+
+/*
+Publish the attitude of the pipeline after its last sample, taken at 'tick', under the seqlock.
+Readers get a consistent snapshot with getAttitudeSnapshot(), without blocking this thread.
+Only the quaternion is published; the Euler angles are computed by the readers which need them.
+*/
+static void publish_attitude(const Pipeline_t *p, uint32_t tick)
+{
+   SeqLock_writeBegin(&attitude_lock);
+   attitude.sample = p->samples_count;
+   attitude.tick = tick;
+   Fusion_getQuaternion(&p->fusion, attitude.q);
+   memcpy(attitude.rate, p->rate, sizeof(attitude.rate));
+   SeqLock_writeEnd(&attitude_lock);
+}
+
+
+
+/*
+Check a collision signalled by the interrupt generator (see collisionInterrupt()) with the software detector.
+Called while irq_pending is set; returns true while the collision must still be signalled.
+The latency from the impact to the motor stop is measured with the sample where the software detected it.
+*/
+static bool confirm_collision(const Pipeline_t *p, uint32_t tick)
+{
+int32_t impact_to_irq;
+
+   if (p->detector.active) {
+      irq_confirmed++;
+      impact_to_irq = irq_tick - atomic_load_explicit(&impact_tick, memory_order_relaxed);
+      printf("Collision: motors stopped %.1f ms after impact (interrupt %.1f ms after impact, stop %.2f ms after interrupt)\n", 
+             (impact_to_irq + (int32_t)(irq_stop_tick - irq_tick))/1000.0, impact_to_irq/1000.0, (irq_stop_tick - irq_tick)/1000.0);
+      atomic_store_explicit(&irq_pending, false, memory_order_release);
+      return true;
+   }
+   if ((tick - irq_tick)/1E6 < confirm_time) return true;
+   irq_unconfirmed++;
+   fprintf(stderr, "%s: Collision interrupt not confirmed (%u confirmed, %u not confirmed)\n", __func__, irq_confirmed, irq_unconfirmed);
+   atomic_store_explicit(&irq_pending, false, memory_order_release);
+   return false;
+}
+
+
+
+/*
+Push the raw samples of this read to the recorder (see save_accel_data()): the magnetometer sample,
+with the tick when the read started, and the accel/gyro samples of the FIFO burst, with the tick when it was read.
+*/
+static void record_frames(uint32_t mtick, int16_t mx, int16_t my, int16_t mz, uint32_t fifo_tick, const char *buf, int samples)
+{
+FIFOBlock_t raw;
+RecFrame_t frame = {.tick = mtick, .type = REC_FRAME_M, .v = {mx, my, mz}};
+int n, am, gm;
+
+   Recorder_push(&frame);
+   decode_fifo(buf, samples, &raw);
+   frame.tick = fifo_tick;
+   frame.type = REC_FRAME_AG;
+   frame.count = samples;
+   frame.range = fifo_accel_range | fifo_gyro_range<<2;
+   am = accel_ranges[fifo_accel_range].mult; gm = gyro_ranges[fifo_gyro_range].mult;
+   for (n=0; n<samples; n++) {
+      frame.index = n;
+      frame.v[0] = raw.gx[n]/gm; frame.v[1] = raw.gy[n]/gm; frame.v[2] = raw.gz[n]/gm;
+      frame.v[3] = raw.ax[n]/am; frame.v[4] = raw.ay[n]/am; frame.v[5] = raw.az[n]/am;
+      Recorder_push(&frame);
+   }
+}
+
+
+
+/* Push the accelerometer samples of the FIFO burst, in g, to the vibration analysis thread */
+static void push_vibration(const char *buf, int samples)
+{
+FIFOBlock_t raw;
+int n;
+
+   decode_fifo(buf, samples, &raw);
+   for (n=0; n<samples; n++) 
+      Vibration_push((raw.ax[n]-err_AL[0])*aRes, (raw.ay[n]-err_AL[1])*aRes, (raw.az[n]-err_AL[2])*aRes);
+}
+
+
+
+/*
+Warm start of the attitude of the pipelines, called after each burst has been processed.
+First, the acceleration and the magnetic field are averaged, and the attitude of the 3D compass 
+(updateOrientation()) is set in the fusion engines. Then the feedback gain is scheduled. 
+Engines which cannot be set (the EKF) only get the gain schedule, which they ignore.
+*/
+static void warm_start(const char *buf, int samples, const double *dt, double mxr, double myr, double mzr)
+{
+FIFOBlock_t raw;
+double gain;
+int n;
+
+   switch (warm_phase) {
+      case WARM_AVERAGING:
+         if (samples == 0) return;
+         decode_fifo(buf, samples, &raw);
+         for (n=0; n<samples; n++) {
+            warm_a[0] += (raw.ax[n]-err_AL[0])*aRes/samples;
+            warm_a[1] += (raw.ay[n]-err_AL[1])*aRes/samples;
+            warm_a[2] += (raw.az[n]-err_AL[2])*aRes/samples;
+         }
+         warm_m[0] += mxr; warm_m[1] += myr; warm_m[2] += mzr;
+         if (++warm_bursts < warm_start_time*odr_m_modes[ODR_M]) return;
+         
+         for (n=0; n<3; n++) {
+            warm_a[n] /= warm_bursts;
+            warm_m[n] /= warm_bursts;
+         }
+         updateOrientation(warm_a[0], warm_a[1], warm_a[2], warm_m[0], warm_m[1], warm_m[2]);
+         // The angles of the compass are in degrees, and the yaw is corrected with the declination
+         Fusion_setAttitude(&pipeline.fusion, (yaw+declination)*M_PI/180, pitch*M_PI/180, roll*M_PI/180);
+         if (pipeline_mode == PIPELINE_COMPARE) 
+            Fusion_setAttitude(&ref_pipeline.fusion, (yaw+declination)*M_PI/180, pitch*M_PI/180, roll*M_PI/180);
+         warm_time = 0;
+         warm_phase = WARM_CONVERGING;
+         // Fall through, to set the initial gain
+         
+      case WARM_CONVERGING:
+         for (n=0; n<samples; n++) warm_time += dt[n];
+         if (warm_time > 5*warm_start_tau) {
+            gain = 1.0;
+            warm_phase = WARM_DONE;
+         }
+         else gain = 1 + (warm_start_gain-1)*exp(-warm_time/warm_start_tau);
+         Fusion_setGain(&pipeline.fusion, gain);
+         if (pipeline_mode == PIPELINE_COMPARE) Fusion_setGain(&ref_pipeline.fusion, gain);
+         break;
+         
+      case WARM_DONE:
+         break;
+   }
+}
+
+
+
+/* Add a duration to a histogram. Only from the IMU thread, inside a write section of stats_lock */
+static void hist_add(IMUHist_t *h, uint32_t us)
+{
+int bin = 0;
+
+   while (bin < IMU_HIST_BINS-1 && us >> (bin+1)) bin++;
+   h->bins[bin]++;
+   h->count++;
+   h->sum += us;
+   if (us > h->max) h->max = us;
+}
+
+
+
+/* Update the statistics of a read of the IMU. i2c_us is UINT32_MAX for the transactions not done */
+static void update_stats(uint32_t callback_us, const uint32_t *i2c_us, int fifo_depth, int samples)
+{
+int i;
+
+   SeqLock_writeBegin(&stats_lock);
+   hist_add(&stats.callback, callback_us);
+   for (i=0; i<IMU_I2C_OPS; i++) 
+      if (i2c_us[i] != UINT32_MAX) hist_add(&stats.i2c[i], i2c_us[i]);
+   if (fifo_depth >= 0 && fifo_depth <= FIFO_LINES) stats.fifo_depth[fifo_depth]++;
+   stats.samples += samples;
+   SeqLock_writeEnd(&stats_lock);
+}
+
+
+
+/* 
+This function is called periodically, with the rate of the magnetometer ODR.
+It reads the IMU data and feeds the attitude fusion engine (see fusion.c) and 3D tilt compensated compass algorithm. 
+Both do the same and have the same results, but the fusion filter needs much longer to converge.
+The magnetomer data is read. If data was available, the function goes on to read the FIFO
+of the accelerometer/gyroscope, which has a much higher ODR (this is why the FIFO is used, 
+to store data without having to poll so often).
+For each value of the accel/gyro, the fusion filter and the 3D compensated compass are called, using
+interpolated magnetometer data, so both sample rates are the same. 
+The samples are processed according to pipeline_mode.
+
+It takes about 5 ms to complete (mostly between 4.5 and 5.5 ms) for ODR_M=40 Hz, ODR_AGG=238 Hz.
+*/
+static void imuRead(void)
+{
+int rc, samples, i;   
+char str[17], buf[12*FIFO_LINES+1], commands[] = {0x07, 0x01, 0x18, 0x01, 0x06, 0x00, 0x00, 0x00};
+uint32_t start_tick, fifo_tick, mtick;
+static uint32_t old_mtick;
+static unsigned long impact_sample;
+bool collided;
+static unsigned int count;
+double diff, att[3], ref_att[3];
+double dt[FIFO_LINES];  // Time from the previous sample to each one of the burst, in seconds
+double burst_dt;
+uint32_t t0, i2c_us[IMU_I2C_OPS] = {UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX};  // Duration of the I2C transactions
+int fifo_depth = -1;
+uint32_t sample_tick;   // Estimated time of the last sample of the burst
+bool overrun;
+static double yaw_, pitch_, roll_;  // Attitude shown in the display
+
+int16_t mx, my, mz; // x, y, and z axis raw readings of the magnetometer
+double dx, dy, dz;    // Readings of the magnetometer without hardiron effects
+double mxr, myr, mzr; // Real (scaled and compensated) readings of the magnetometer
+const MagCal_t *mc;
+
+   start_tick = gpioTick(); 
+
+   /* Read status register in magnetometer, to check if new data is available.
+      Not needed when called from the FIFO threshold interrupt: it triggers every upsampling_factor 
+      accel/gyro samples, which is the magnetometer ODR */
+   if (fifoPin < 0) {
+      t0 = gpioTick();
+      rc = i2cReadByteData(i2c_mag_handle, 0x27);  // Read magnetometer STATUS_REG register, needs 0.1 ms   
+      i2c_us[IMU_I2C_MAG_STATUS] = gpioTick() - t0;
+      if (rc < 0) goto rw_error;  
+   
+      if (!(rc&0x08)) return;  // If no new data available, return
+   }
+   
+   /* New magnetometer data in XYZ is available
+      Read magnetometer data. X and Y axis are exchanged, and then Y is negated, 
+      so align the axis with tha ones used in this module for car orientation */
+         
+   // Read 6 bytes (X,Y,Z axis), starting in OUT_X_L_M register
+   t0 = gpioTick();
+   rc = i2cReadI2CBlockData(i2c_mag_handle, 0x28, buf, 6); // Needs 0.2 ms
+   i2c_us[IMU_I2C_MAG_DATA] = gpioTick() - t0;
+   if (rc < 0) goto rw_error;
+   my = buf[1]<<8 | buf[0]; mx = buf[3]<<8 | buf[2]; mz = buf[5]<<8 | buf[4];  
+   my *= -1;         
+ 
+   /* Store the raw sample for online calibration. Never wait for the calibration thread, skip the sample instead */
+   if (mag_online_running && pthread_mutex_trylock(&mag_online_mutex) == 0) {
+      MagCalOnline_add(&mag_online, mx, my, mz);
+      pthread_mutex_unlock(&mag_online_mutex);
+   }
+ 
+   /* Substract measured error values (hardiron effects) */
+   mc = &mag_cal[atomic_load_explicit(&mag_cal_index, memory_order_acquire)];
+   dx = mx - mc->center[0]; dy = my - mc->center[1]; dz = mz - mc->center[2];      
+   /* Compensate for softiron and scale result */
+   mxr = (mc->matrix[0][0]*dx + mc->matrix[0][1]*dy + mc->matrix[0][2]*dz)*mRes; 
+   myr = (mc->matrix[1][0]*dx + mc->matrix[1][1]*dy + mc->matrix[1][2]*dz)*mRes; 
+   mzr = (mc->matrix[2][0]*dx + mc->matrix[2][1]*dy + mc->matrix[2][2]*dz)*mRes; 
+           
+   /*
+   mtick = gpioTick();
+   if (old_mtick) printf("Time between MAG samples: %.1f ms, ODR AG=%.1f\n", (mtick-old_mtick)/1000.0, (mtick-old_mtick)/1000000.0);
+   old_mtick = mtick;
+   */
+      
+   //snprintf(str, sizeof(str), "M:%-6.1f mG", 1000*sqrt(mxr*mxr+myr*myr+mzr*mzr));  
+   //oledWriteString(0, 6, str, false);  
+   
+   /*
+   snprintf(str, sizeof(str), "MX:%-6.1f mG", mxr*1000);  
+   oledWriteString(0, 4, str, false);
+   snprintf(str, sizeof(str), "MY:%-6.1f mG", myr*1000);  
+   oledWriteString(0, 5, str, false);        
+   snprintf(str, sizeof(str), "MZ:%-6.1f mG", mzr*1000);  
+   oledWriteString(0, 6, str, false); 
+   */
+       
+   /* 
+   Now, read accel/gyro data. Read data from FIFO, as ODR of accel/gyro is probably higher
+   than that of magnetometer. The accel/gyro stores samples in the FIFO until it is read.
+   */
+
+   t0 = gpioTick();
+   rc = i2cReadByteData(i2c_accel_handle, 0x2F);  // Read FIFO_SRC register, needs 0.1 ms
+   i2c_us[IMU_I2C_FIFO_STATUS] = gpioTick() - t0;
+   if (rc < 0) goto rw_error;
+   overrun = rc&0x40;  // Should not happen. Counted in the timing statistics, see update_sample_clock()
+   // samples in FIFO are between 3 and 4, average 3: AG ODR = 119 Hz, M ODR = 40 Hz, 119/40=3
+   // if AG ODR = 238, samples is between 6 and 8
+   samples = fifo_depth = rc&0x3F;   // samples in FIFO could be zero  
+   //printf("Samples: %d\n", samples);
+   // Less samples than upsampling_factor should not happen; it is counted in the timing statistics
+   
+   /* The samples counted are in the current ranges; switch them now, if needed, before reading */
+   fifo_accel_range = accel_range; fifo_gyro_range = gyro_range;
+   rc = set_range();
+   if (rc < 0) goto rw_error;
+   if (rc) {  // Samples which arrived since counting them are in the old ranges, drop them and the next one
+      rc = i2cReadByteData(i2c_accel_handle, 0x2F);
+      if (rc < 0) goto rw_error;
+      RangeDrop_switched(&range_drop, (rc&0x3F) - samples + 1);
+   }
+      
+   if (samples) {  // if FIFO has sth, read it
+      /* Burst read. Accelerometer and gyroscope sensors are activated at the same ODR.
+         So read all FIFO lines (12 bytes each) in a single I2C transaction 
+         using a special function in pigpio library */
+      commands[5] = (12*samples)&0xFF;  // LSb value of number of bytes to read
+      commands[6] = (12*samples)>>8;    // MSb value of number of bytes to read
+      t0 = gpioTick();
+      rc = i2cZip(i2c_accel_handle, commands, sizeof(commands), buf, sizeof(buf));   // Needs 1.2 ms for 4 samples
+      i2c_us[IMU_I2C_FIFO_DATA] = gpioTick() - t0;
+      if (rc < 0) goto rw_error;         
+   }
+   fifo_tick = gpioTick();  // The last sample of the burst is about this old
+   sample_tick = update_sample_clock(&sample_clock, fifo_tick, samples, overrun, dt);
+   samples = RangeDrop_apply(&range_drop, buf, samples, dt);
+   check_range(buf, samples);
+
+   if (Recorder_active()) record_frames(start_tick, mx, my, mz, fifo_tick, buf, samples);
+   if (Vibration_active()) push_vibration(buf, samples);
+   track_gyro_bias(buf, samples);  // Before processing, so all pipelines use the same bias
+   
+   switch (pipeline_mode) {
+      case PIPELINE_SAMPLE:
+         process_samples(&pipeline, buf, samples, dt, mxr, myr, mzr);
+         break;
+      case PIPELINE_BLOCK:
+         process_block(&pipeline, buf, samples, dt, mxr, myr, mzr);
+         break;
+      case PIPELINE_COMPARE:
+         process_block(&pipeline, buf, samples, dt, mxr, myr, mzr);
+         process_samples(&ref_pipeline, buf, samples, dt, mxr, myr, mzr);
+         Fusion_getAttitude(&pipeline.fusion, &att[0], &att[1], &att[2]);
+         Fusion_getAttitude(&ref_pipeline.fusion, &ref_att[0], &ref_att[1], &ref_att[2]);
+         for (i=0, diff=0; i<3; i++) diff += fabs(att[i] - ref_att[i]);
+         if (diff != 0 || pipeline.v_m != ref_pipeline.v_m || pipeline.detector.active != ref_pipeline.detector.active || 
+             pipeline.detector.direction != ref_pipeline.detector.direction) 
+            fprintf(stderr, "%s: Block and sample processing differ (attitude difference %g rad)\n", __func__, diff);
+         break;
+   }
+   /* A new collision: estimate the tick of the sample of the impact (the detector corrects the delay of its filters) */
+   if (pipeline.detector.active && pipeline.detector.impact_sample != impact_sample) {
+      impact_sample = pipeline.detector.impact_sample;
+      atomic_store_explicit(&impact_tick, sample_tick - lround((pipeline.detector.samples - impact_sample)*sample_clock.period), 
+                            memory_order_relaxed);
+   }
+   if (pipeline.detector.active) 
+      atomic_store_explicit(&impact_direction, lround(pipeline.detector.direction), memory_order_relaxed);
+   collided = pipeline.detector.active;
+   if (atomic_load_explicit(&irq_pending, memory_order_acquire)) collided |= confirm_collision(&pipeline, fifo_tick);
+   atomic_store_explicit(&collision, collided, memory_order_release);
+   warm_start(buf, samples, dt, mxr, myr, mzr);
+   publish_attitude(&pipeline, sample_tick);
+   for (i=0, burst_dt=0; i<samples; i++) burst_dt += dt[i];
+   Odometry_update(sample_tick, pipeline.yaw_delta, burst_dt);
    
-   snprintf(str, sizeof(str), "Yaw:  %- 6.1f", yaw);  
-   if (count%3==0) oledWriteString(0, 4, str, false);
-   snprintf(str, sizeof(str), "Pitch:%- 4.0f", pitch);  
-   if (count%3==1) oledWriteString(0, 5, str, false);        
-   snprintf(str, sizeof(str), "Roll: %- 4.0f", roll);  
-   if (count%3==2) oledWriteString(0, 6, str, false);  
+   /* One line of the display each time, so the angles are computed once every 3 reads */
+   if (count%3==0) {
+      getAttitude(&yaw_, &pitch_, &roll_);
+      snprintf(str, sizeof(str), "Yaw:  %- 6.1f", yaw_);  
+      oledWriteString(0, 4, str, false);
+   }
+   if (count%3==1) {
+      snprintf(str, sizeof(str), "Pitch:%- 4.0f", pitch_);  
+      oledWriteString(0, 5, str, false);        
+   }
+   if (count%3==2) {
+      snprintf(str, sizeof(str), "Roll: %- 4.0f", roll_);  
+      oledWriteString(0, 6, str, false);  
+   }
    count++;
    
+   update_stats(gpioTick()-start_tick, i2c_us, fifo_depth, samples);
    //printf("Elapsed time in %s: %.1f ms\n", __func__, (gpioTick()-start_tick)/1000.0);
    return;
    
 rw_error:
+   SeqLock_writeBegin(&stats_lock);
+   stats.i2c_errors++;
+   SeqLock_writeEnd(&stats_lock);
    ERR(, "Cannot read/write data from IMU");
 }
 
 
+
+/* 
+Callback called when the INT2 pin of the accel/gyro changes its level, or when its watchdog expires.
+INT2 goes high when the FIFO reaches the threshold (upsampling_factor samples), and goes low 
+again when imuRead() empties the FIFO. 
+If a rising edge is lost (eg the FIFO reaches the threshold again before the level is seen low),
+INT2 stays high and no more edges would come; the watchdog then reads the FIFO and restarts the cycle.
+*/
+static void imuInterrupt(int gpio, int level, uint32_t tick)
+{
+   if (level == PI_LOW) return;
+   if (level == PI_TIMEOUT && gpioRead(gpio) == PI_LOW) return;  // Sensor is not delivering data
+   imuRead();
+}
+
+
+
+/*
+Callback called when the INT1 pin of the accel/gyro changes its level. INT1 is high while the 
+forward acceleration exceeds collision_threshold. If the car is moving, the motors are stopped 
+without waiting for the next imuRead(), which confirms the collision (see confirm_collision()).
+*/
+static void collisionInterrupt(int gpio, int level, uint32_t tick)
+{
+   if (level != PI_HIGH || atomic_load_explicit(&irq_pending, memory_order_acquire)) return;
+   if (motorsStopped()) return;  // A bump while stopped is not a collision
+   stopMotors();
+   irq_stop_tick = gpioTick();
+   irq_tick = tick;
+   atomic_store_explicit(&collision, true, memory_order_release);
+   atomic_store_explicit(&irq_pending, true, memory_order_release);
+}
+
+
+
+/* Estimated tick of the sample where the last collision was detected by software */
+uint32_t getImpactTick(void)
+{
+   return atomic_load_explicit(&impact_tick, memory_order_relaxed);
+}
+
+
+/* Direction where the last collision detected by software came from, in degrees: 0 is the front, 90 the left side */
+int getImpactDirection(void)
+{
+   return atomic_load_explicit(&impact_direction, memory_order_relaxed);
+}
+
+
    
 /************************************************************
-Function called from motor.c when initializing, setup() function
+Enable the spectrum analysis of the vibration measured by the accelerometer (see vibration.c).
+Call it before setupLSM9DS1(). The band energies are read with Vibration_get().
+************************************************************/
+void setVibrationLSM9DS1(bool enable)
+{
+   vibration_analysis = enable;
+}
+
+
+   
+/************************************************************
+Select the attitude fusion engine by its name (see fusion.c): "madgwick" (default), "mahony", "ekf", "ekf32", "ekf-mag" or "ekf32-mag".
+Call it before setupLSM9DS1().
+************************************************************/
+int setFusionLSM9DS1(const char *name)
+{
+   fusion_engine = Fusion_find(name);
+   if (fusion_engine == NULL) return -1;
+   return 0;
+}
 
+
+
+/************************************************************
+Select the ODR of accel/gyro and of magnetometer, in Hz. Call it before setupLSM9DS1().
+The values must be supported by the sensor (see odr_ag_modes and odr_m_modes), 
+a value of 0 keeps the default one. Their ratio is checked in setupLSM9DS1().
 ************************************************************/
-int setupLSM9DS1(int accel_addr, int mag_addr, bool calibrate, unsigned timer)
+int setODRLSM9DS1(double odr_ag, double odr_m)
 {
-int rc;
+int i;
+
+   if (odr_ag) {
+      for (i = 1; i < sizeof(odr_ag_modes)/sizeof(double); i++) 
+         if (fabs(odr_ag - odr_ag_modes[i]) < 0.01) break;
+      if (i == sizeof(odr_ag_modes)/sizeof(double)) ERR(-1, "Invalid ODR for accel/gyro: %g Hz", odr_ag);
+      ODR_AG = i;
+   }
+   if (odr_m) {
+      for (i = 0; i < sizeof(odr_m_modes)/sizeof(double); i++) 
+         if (fabs(odr_m - odr_m_modes[i]) < 0.01) break;
+      if (i == sizeof(odr_m_modes)/sizeof(double)) ERR(-1, "Invalid ODR for magnetometer: %g Hz", odr_m);
+      ODR_M = i;
+   }
+   return 0;
+}
+
+
+
+/************************************************************
+Function called from motor.c when initializing, setup() function
+The IMU is read each time the accel/gyro FIFO reaches upsampling_factor samples, signalled
+in its INT2 pin, connected to GPIO fifo_pin. If fifo_pin is negative, the IMU is read 
+periodically with pigpio timer 'timer' instead.
+If collision_pin is not negative, the INT1 pin of the accel/gyro is connected to it, and signals
+a collision without waiting for the software detection (see collisionInterrupt()).
+************************************************************/
+int setupLSM9DS1(int accel_addr, int mag_addr, bool calibrate, unsigned timer, int fifo_pin, int collision_pin)
+{
+int rc, i;
 int dl, dh;
 int16_t temp;
 uint8_t byte;
@@ -1046,6 +1693,11 @@ uint8_t byte;
    /***** Initial checks *****/
    if (odr_ag_modes[ODR_AG] < odr_m_modes[ODR_M]) ERR(-1, "Invalid ODR values for IMU");
    upsampling_factor = lround(odr_ag_modes[ODR_AG] / odr_m_modes[ODR_M]);
+   if (fabs(odr_ag_modes[ODR_AG]/(odr_m_modes[ODR_M]*upsampling_factor) - 1) > 0.01)  // The ODRs are not exact multiples 
+      ERR(-1, "ODR of accel/gyro (%g Hz) must be a multiple of ODR of magnetometer (%g Hz)", 
+          odr_ag_modes[ODR_AG], odr_m_modes[ODR_M]);
+   if (upsampling_factor >= FIFO_LINES) ERR(-1, "ODR of accel/gyro too high for ODR of magnetometer, FIFO would overrun");
+   deltat = 1.0/odr_ag_modes[ODR_AG];
 
    /************************* Open connection and check state ***********************/
    i2c_accel_handle = i2cOpen(I2C_BUS, accel_addr, 0);
@@ -1127,12 +1779,14 @@ uint8_t byte;
    byte = (0x00<<5) + (0x0<<3) + 0x0; 
    rc = i2cWriteByteData(i2c_accel_handle, 0x20, byte);
    if (rc < 0) goto rw_error; 
-   aRes = 2.0/32768;   // g/LSB
+   aRes = 2.0/32768;   // g/LSB, of the lowest range; the samples are converted to it (see Range_t)
+   accel_range = next_accel_range = fifo_accel_range = 0;
 
    // Set accelerometer, CTRL_REG7_XL
-   // HR: enabled (b1), DCF: ODR/9 (b10), FDS: internal filter bypassed (b0), HPIS1:  filter bypassed (b0)
-   // both LPF enabled, HPF disabled
-   byte = (0x01<<7) + (0x02<<5) + 0x0; 
+   // HR: enabled (b1), DCF: ODR/9 (b10), FDS: internal filter bypassed (b0), 
+   // HPIS1: HPF applied to interrupt generator if collision interrupt is used, so that tilt does not count (b1)
+   // both LPF enabled, HPF only for the interrupt generator
+   byte = (0x01<<7) + (0x02<<5) + (collision_pin>=0 ? 0x01 : 0x0); 
    rc = i2cWriteByteData(i2c_accel_handle, 0x21, byte);
    if (rc < 0) goto rw_error; 
    
@@ -1154,7 +1808,11 @@ uint8_t byte;
    byte = (ODR_AG<<5) + (0x0<<3) + 0x01; 
    rc = i2cWriteByteData(i2c_accel_handle, 0x10, byte);
    if (rc < 0) goto rw_error; 
-   gRes = 245.0/32768;   // dps/LSB
+   gRes = 245.0/32768;   // dps/LSB, of the lowest range
+   gyro_range = next_gyro_range = fifo_gyro_range = 0;
+   accel_quiet = gyro_quiet = 0;
+   accel_switches = gyro_switches = 0;
+   RangeDrop_init(&range_drop);
    
    // Set gyro, CTRL_REG2_G
    // INT_SEL: 0 (b00), OUT_SEL: 0 (b10) (output after LPF2)
@@ -1178,20 +1836,66 @@ uint8_t byte;
    
    /************************** Handle calibration ********************/
    if (calibrate) {
+      // With online calibration, keep the stored magnetometer calibration as starting point
+      if (mag_calibration == MAG_CAL_ONLINE) read_calibration_data();
       calibrate_accel_gyro();
-      calibrate_magnetometer();
+      if (mag_calibration == MAG_CAL_MANUAL) calibrate_magnetometer();
       write_calibration_data();
       gpioSleep(PI_TIME_RELATIVE, 1, 0);  // Sleep 1 second, so the user can continue the start process
    }
    else read_calibration_data();   
    
+   /* Gyroscope bias: the one tracked in the last session is more recent than the calibrated one, unless calibrating now */
+   for (i=0; i<3; i++) bias_GY[i] = err_GY[i];
+   if (!calibrate) read_gyro_bias();
+   for (i=0; i<3; i++) bias_GY_var[i] = gyro_bias_init_var;
+   bias_GY_updated = false;
+   
+   /* Magnetometer calibration used by imuRead() */
+   for (i=0; i<3; i++) mag_cal[0].center[i] = err_MA[i];
+   memcpy(mag_cal[0].matrix, scale_MA, sizeof(scale_MA));
+   atomic_store(&mag_cal_index, 0);
+   
    /************** Continue with accelerometer setting, activate FIFO ****************/
    // Set FIFO, FIFO_CTRL
-   // FMODE: continuous mode (b110), threshold: 0 (b00000)
-   byte = (0x06<<5) + 0x0; 
+   // FMODE: continuous mode (b110), threshold: upsampling_factor if read by interrupt, otherwise 0
+   byte = (0x06<<5) + (fifo_pin>=0 ? upsampling_factor : 0x0); 
    rc = i2cWriteByteData(i2c_accel_handle, 0x2E, byte);
    if (rc < 0) goto rw_error; 
 
+   // Set INT2 pin, INT2_CTRL
+   // INT2_INACT: no (b0), 0 (b0), INT2_FSS5, INT2_OVR: no (b00), INT2_FTH: yes if read by interrupt (b1),
+   // INT2_DRDY_TEMP, INT2_DRDY_G, INT2_DRDY_XL: no (b000)
+   byte = fifo_pin>=0 ? 0x08 : 0x00; 
+   rc = i2cWriteByteData(i2c_accel_handle, 0x0D, byte);
+   if (rc < 0) goto rw_error; 
+
+   // Set accelerometer interrupt generator, INT_GEN_CFG_XL
+   // AOI_XL: OR (b0), 6D: no (b0), ZHIE_XL, ZLIE_XL: no (b00), YHIE_XL: yes if collision interrupt is used (b1), 
+   // YLIE_XL, XHIE_XL, XLIE_XL: no (b000). The Y axis of the sensor is the X axis (forwards) of the car.
+   byte = collision_pin>=0 ? 0x08 : 0x00; 
+   rc = i2cWriteByteData(i2c_accel_handle, 0x06, byte);
+   if (rc < 0) goto rw_error; 
+   
+   // Set threshold of Y axis, INT_GEN_THS_Y_XL. It is compared with the absolute value of the 
+   // acceleration; 1 LSB is 1/128 of the full scale, ie 256 LSB of the output
+   byte = lround(collision_threshold/aRes/256) > 255 ? 255 : lround(collision_threshold/aRes/256); 
+   rc = i2cWriteByteData(i2c_accel_handle, 0x08, byte);
+   if (rc < 0) goto rw_error; 
+   
+   // Set duration of interrupt, INT_GEN_DUR_XL
+   // WAIT_XL: no (b0), DUR_XL: 0 samples, the interrupt is signalled at once (b0000000)
+   byte = 0x00; 
+   rc = i2cWriteByteData(i2c_accel_handle, 0x0A, byte);
+   if (rc < 0) goto rw_error; 
+
+   // Set INT1 pin, INT1_CTRL
+   // INT1_IG_G: no (b0), INT_IG_XL: yes if collision interrupt is used (b1), INT_FSS5, INT_OVR, INT_FTH: no (b000),
+   // INT_Boot, INT_DRDY_G, INT_DRDY_XL: no (b000)
+   byte = collision_pin>=0 ? 0x40 : 0x00; 
+   rc = i2cWriteByteData(i2c_accel_handle, 0x0C, byte);
+   if (rc < 0) goto rw_error; 
+
    // Activate FIFO, CTRL_REG9
    // SLEEP_G: disabled (b0), FIFO_TEMP_EN: no (b0), 
    // DRDY_mask_bit: disabled (b0), I2C_DISABLE: both (b0), FIFO_EN: yes (b1), STOP_ON_FTH: no (b0)
@@ -1214,36 +1918,69 @@ uint8_t byte;
    
    
    /************************* Final actions ***********************/   
-   // Initialize low pass filter for interpolating magnetometer data
-   rc = LPFilter_init(&filter_mx, LP_20_240_filter_taps, sizeof(LP_20_240_filter_taps)/sizeof(double));
-   if (rc < 0) goto init_error;  
-   LPFilter_init(&filter_my, LP_20_240_filter_taps, sizeof(LP_20_240_filter_taps)/sizeof(double));
-   if (rc < 0) goto init_error;    
-   LPFilter_init(&filter_mz, LP_20_240_filter_taps, sizeof(LP_20_240_filter_taps)/sizeof(double));
-   if (rc < 0) goto init_error; 
-   // Set gain to upsampling_factor, to compensate for DC gain reduction due to interpolation
-   LPFilter_setDCgain(&filter_mx, upsampling_factor);  // No need for filter_my and filter_mz, as they share the LP_20_240_filter_taps
-   
-   // Initialize low pass filter for accelerometer data
-   rc = LPFilter_init(&filter_ax, LP_10_240_filter_taps, sizeof(LP_10_240_filter_taps)/sizeof(double));
+   // Initialize the filters used to process the samples
+   rc = pipeline_init(&pipeline);
    if (rc < 0) goto init_error;  
-   LPFilter_init(&filter_ay, LP_10_240_filter_taps, sizeof(LP_10_240_filter_taps)/sizeof(double));
-   if (rc < 0) goto init_error;    
-   LPFilter_init(&filter_az, LP_10_240_filter_taps, sizeof(LP_10_240_filter_taps)/sizeof(double));
-   if (rc < 0) goto init_error; 
-   LPFilter_setDCgain(&filter_ax, 1.0);  // No need for filter_ay and filter_az, as they share the LP_10_240_filter_taps  
-
-   // Initialize high pass filter for 1st order derivation
-   rc = LPFilter_init(&filter_d1_ax, HP_1st_deriv_filter_taps, sizeof(HP_1st_deriv_filter_taps)/sizeof(double));
-   if (rc < 0) goto init_error;    
+   if (pipeline_mode == PIPELINE_COMPARE) {
+      rc = pipeline_init(&ref_pipeline);
+      if (rc < 0) goto init_error; 
+   }
+   confirm_time = Collision_confirmTime(&pipeline.detector, 1/odr_m_modes[ODR_M]);  // The FIFO is read at the magnetometer ODR
+   memset(&sample_clock, 0, sizeof(sample_clock));  // The clock starts with the first FIFO read
+   memset(&stats, 0, sizeof(stats));
+   warm_phase = WARM_AVERAGING;
+   warm_bursts = 0;
+   memset(warm_a, 0, sizeof(warm_a)); memset(warm_m, 0, sizeof(warm_m));
+   
+   // Start the thread which prints the statistics on request. The IMU works without it
+   if (sem_init(&stats_sem, 0, 0) == 0) {
+      atomic_store(&stats_running, true);
+      if (pthread_create(&stats_thread, NULL, stats_loop, NULL)) atomic_store(&stats_running, false);
+   }
+   
+   // Start the vibration analysis thread. The IMU works without it
+   if (vibration_analysis && Vibration_start(odr_ag_modes[ODR_AG]) < 0) 
+      fprintf(stderr, "%s: Cannot start vibration analysis\n", __func__);
    
+   // Start the online calibration thread of the magnetometer. The IMU works without it
+   if (mag_calibration == MAG_CAL_ONLINE) {
+      MagCalOnline_init(&mag_online, mag_cal[0].center);
+      mag_online_stop = false;
+      if (pthread_create(&mag_online_thread, NULL, mag_calibration_loop, NULL) == 0) mag_online_running = true;
+      else fprintf(stderr, "%s: Cannot start online calibration of magnetometer\n", __func__);
+   }
    
    // Start the IMU reading thread
    timerNumber = timer;
-   rc = gpioSetTimerFunc(timerNumber, 1+lround(1000.0/odr_m_modes[ODR_M]), imuRead);  // Read IMU with magnetometer ODR, timer#3
-   if (rc<0) {
-      closeLSM9DS1();
-      ERR(-1, "Cannot set timer for IMU");  
+   if (fifo_pin >= 0) {  // Read IMU when FIFO reaches threshold, ie with magnetometer ODR
+      fifoPin = fifo_pin;
+      gpioSetMode(fifoPin, PI_INPUT);
+      gpioSetPullUpDown(fifoPin, PI_PUD_DOWN);
+      rc = gpioSetAlertFunc(fifoPin, imuInterrupt);
+      // Watchdog set to 3 FIFO thresholds. Also reads the FIFO if INT2 was already high at this point
+      if (rc == 0) rc = gpioSetWatchdog(fifoPin, 3*lround(1000.0/odr_m_modes[ODR_M]));
+      if (rc<0) {
+         closeLSM9DS1();
+         ERR(-1, "Cannot set interrupt for IMU");  
+      }
+   }
+   else {
+      rc = gpioSetTimerFunc(timerNumber, 1+lround(1000.0/odr_m_modes[ODR_M]), imuRead);  // Read IMU with magnetometer ODR, timer#3
+      if (rc<0) {
+         closeLSM9DS1();
+         ERR(-1, "Cannot set timer for IMU");  
+      }
+   }
+   
+   // Collision interrupt
+   if (collision_pin >= 0) {
+      collisionPin = collision_pin;
+      gpioSetMode(collisionPin, PI_INPUT);
+      gpioSetPullUpDown(collisionPin, PI_PUD_DOWN);
+      if (gpioSetAlertFunc(collisionPin, collisionInterrupt) < 0) {
+         closeLSM9DS1();
+         ERR(-1, "Cannot set collision interrupt for IMU");  
+      }
    }
    
    return 0;
@@ -1264,47 +2001,100 @@ init_error:
 void closeLSM9DS1(void)
 {
    printf("Closing IMU...\n");
-   gpioSetTimerFunc(timerNumber, 20, NULL);
+   Recorder_stop();
+   Vibration_stop();
+   if (atomic_load(&stats_running)) {
+      atomic_store(&stats_running, false);
+      sem_post(&stats_sem);
+      pthread_join(stats_thread, NULL);
+      sem_destroy(&stats_sem);
+   }
+   if (collisionPin >= 0) {
+      gpioSetAlertFunc(collisionPin, NULL);
+      collisionPin = -1;
+   }
+   if (fifoPin >= 0) {
+      gpioSetWatchdog(fifoPin, 0);
+      gpioSetAlertFunc(fifoPin, NULL);
+      fifoPin = -1;
+   }
+   else gpioSetTimerFunc(timerNumber, 20, NULL);
+   if (mag_online_running) {
+      pthread_mutex_lock(&mag_online_mutex);
+      mag_online_stop = true;
+      pthread_cond_signal(&mag_online_cond);
+      pthread_mutex_unlock(&mag_online_mutex);
+      pthread_join(mag_online_thread, NULL);
+      mag_online_running = false;
+   }
    if (i2c_mag_handle>=0) {
       i2cWriteByteData(i2c_mag_handle, 0x22, 0x03);   // Power down magnetometer
       i2cClose(i2c_mag_handle); 
    }
    if (i2c_accel_handle>=0) {
+      i2cWriteByteData(i2c_accel_handle, 0x0C, 0x00); // Disable INT1 interrupts
+      i2cWriteByteData(i2c_accel_handle, 0x0D, 0x00); // Disable INT2 interrupts
+      i2cWriteByteData(i2c_accel_handle, 0x06, 0x00); // Disable accelerometer interrupt generator
       i2cWriteByteData(i2c_accel_handle, 0x23, 0x00); // Disable FIFO
       i2cWriteByteData(i2c_accel_handle, 0x10, 0x00); // Power down accel/gyro
       i2cClose(i2c_accel_handle);
    }
-   LPFilter_close(&filter_mx); LPFilter_close(&filter_my); LPFilter_close(&filter_mz);
-   LPFilter_close(&filter_ax); LPFilter_close(&filter_ay); LPFilter_close(&filter_az);
-   LPFilter_close(&filter_d1_ax);
+   if (bias_GY_updated) write_gyro_bias();  // Last good bias, for a warm start
+   bias_GY_updated = false;
+   if (pipeline.fusion.engine) 
+      printf("Fusion engine %s: %.1f us per update\n", pipeline.fusion.engine->name, Fusion_cost(&pipeline.fusion));
+   if (accel_switches || gyro_switches)
+      printf("IMU ranges: %lu switches of accelerometer (%.0f g now), %lu of gyroscope (%.0f dps now)\n", 
+             accel_switches, accel_ranges[accel_range].fs, gyro_switches, gyro_ranges[gyro_range].fs);
+   if (stats.timing.bursts) {
+      printf("IMU timing: ODR %.2f Hz (nominal %.1f Hz), jitter %.0f us rms, %.0f us max\n", 
+             stats.timing.odr, stats.timing.odr_nominal, stats.timing.jitter_rms, stats.timing.jitter_max);
+      if (stats.timing.short_bursts || stats.timing.overruns || stats.timing.resyncs)
+         printf("IMU timing: %lu short bursts, %lu overruns (%lu samples lost), %lu resyncs in %lu reads\n", 
+                stats.timing.short_bursts, stats.timing.overruns, stats.timing.lost_samples, stats.timing.resyncs, stats.timing.bursts);
+   }
+   pipeline_close(&pipeline);
+   pipeline_close(&ref_pipeline);
    i2c_accel_handle = -1;
    i2c_mag_handle = -1;
 }
 
 
 
+/*
+Start or stop recording the raw IMU samples (accel/gyro and magnetometer) in a binary file imu_XXXXXX.rec,
+with the ODRs, scales and calibration in its header. Convert it to CSV with tools/imu2csv.
+*/
 void save_accel_data(void)
 {
-static char *template="accel_XXXXXX.csv";
+static char *template="imu_XXXXXX.rec";
 char filename[30];
-int fd;
+RecHeader_t h;
+const MagCal_t *mc;
+int fd, i, j;
 
-   if (accel_fp) {
-      fclose(accel_fp);
-      accel_fp = NULL;
-      printf("Close accelerometer data file\n");
+   if (Recorder_active()) {
+      Recorder_stop();
       return;
    }
 
    strcpy(filename, template);
-   fd = mkstemps(filename, 4);  // Generate unique file. Suffix length is 4: ".csv"
+   fd = mkstemps(filename, 4);  // Generate unique file. Suffix length is 4: ".rec"
    if (fd == -1) ERR(, "Cannot create file: %s", strerror(errno))
+   close(fd);  // The recorder opens it
    
-   accel_fp = fdopen(fd, "w");
-   if (accel_fp == NULL) ERR(, "Cannot open file %s: %s", filename, strerror(errno));
-   
-   printf("Saving accelerometer data in file %s\n", filename); 
-   fprintf(accel_fp, "X; Y; Z\n");
+   memset(&h, 0, sizeof(h));
+   h.odr_ag = odr_ag_modes[ODR_AG]; h.odr_m = odr_m_modes[ODR_M];
+   h.aRes = aRes; h.gRes = gRes; h.mRes = mRes;
+   mc = &mag_cal[atomic_load_explicit(&mag_cal_index, memory_order_acquire)];
+   for (i=0; i<3; i++) {
+      h.err_AL[i] = err_AL[i];
+      h.bias_GY[i] = bias_GY[i];
+      h.mag_center[i] = mc->center[i];
+      for (j=0; j<3; j++) h.mag_matrix[i][j] = mc->matrix[i][j];
+   }
+   if (Recorder_start(filename, &h) < 0) return;
+   printf("Saving IMU data in file %s\n", filename); 
 }
 
 
@@ -1323,105 +2113,148 @@ int fd;
 // Yaw, pitch and roll are the Tait-Bryan angles in a z-y-x'' intrinsic rotation
 int getAttitude(double *yaw, double *pitch, double *roll)
 {
-   *yaw   = atan2(2.0 * (q[1]*q[2] + q[0]*q[3]), q[0]*q[0] + q[1]*q[1] - q[2]*q[2] - q[3]*q[3]);  
-   *pitch = -asin(2.0 * (q[1]*q[3] - q[0]*q[2]));
-   *roll  = atan2(2.0 * (q[0]*q[1] + q[2]*q[3]), q[0]*q[0] - q[1]*q[1] - q[2]*q[2] + q[3]*q[3]);
-   
-   *yaw   *= 180/M_PI;  // heading
-   *pitch *= 180/M_PI;  // elevation
-   *roll  *= 180/M_PI;  // bank
-   *yaw -= declination;
+Attitude_t att;
+int rc;
+
+   rc = getAttitudeSnapshot(&att);
+   *yaw = att.yaw;
+   *pitch = att.pitch;
+   *roll = att.roll;
    
    //printf("Magd Yaw, Pitch, Roll: %3.0f %3.0f %3.0f\n", *yaw, *pitch, *roll);
+   return rc;
+}
+
+
+
+/*
+Consistent copy of the attitude published by the last read of the IMU, from any thread. 
+It never blocks the thread which reads the IMU; it only copies the record again if it was 
+being updated. The Euler angles are computed from the quaternion here, and cached by sample number.
+Returns -1 if the IMU is not active; att->sample is 0 before the first read.
+*/
+int getAttitudeSnapshot(Attitude_t *att)
+{
+uint32_t seq;
+
+   do {
+      seq = SeqLock_readBegin(&attitude_lock);
+      *att = attitude;
+   } while (SeqLock_readRetry(&attitude_lock, seq));
+   
+   /* The angles are only computed once per published record in each thread */
+   if (!euler_cache.valid || euler_cache.sample != att->sample) {
+      Fusion_quaternionToAttitude(att->q, &euler_cache.yaw, &euler_cache.pitch, &euler_cache.roll);
+      euler_cache.yaw   *= 180/M_PI;  // heading
+      euler_cache.pitch *= 180/M_PI;  // elevation
+      euler_cache.roll  *= 180/M_PI;  // bank
+      euler_cache.yaw -= declination;
+      euler_cache.sample = att->sample;
+      euler_cache.valid = true;
+   }
+   att->yaw = euler_cache.yaw;
+   att->pitch = euler_cache.pitch;
+   att->roll = euler_cache.roll;
+   
+   if (i2c_accel_handle>=0 && i2c_mag_handle>=0) return 0;
+   else return -1;
+}
+
+
+
+/*
+Consistent copy of the timing statistics of the accel/gyro samples (see update_sample_clock()), from any thread. 
+Returns -1 if the IMU is not active.
+*/
+int getTimingLSM9DS1(IMUTiming_t *t)
+{
+uint32_t seq;
+
+   do {
+      seq = SeqLock_readBegin(&stats_lock);
+      *t = stats.timing;
+   } while (SeqLock_readRetry(&stats_lock, seq));
+   
+   if (i2c_accel_handle>=0 && i2c_mag_handle>=0) return 0;
+   else return -1;
+}
+
+
+
+/* Consistent copy of the statistics of the IMU pipeline, from any thread. Returns -1 if the IMU is not active */
+int getStatsLSM9DS1(IMUStats_t *st)
+{
+uint32_t seq;
+
+   do {
+      seq = SeqLock_readBegin(&stats_lock);
+      *st = stats;
+   } while (SeqLock_readRetry(&stats_lock, seq));
+   
    if (i2c_accel_handle>=0 && i2c_mag_handle>=0) return 0;
    else return -1;
 }
 
 
 
-// Implementation of Sebastian Madgwick's "...efficient orientation filter for... inertial/magnetic sensor arrays"
-// (see https://x-io.co.uk/open-source-imu-and-ahrs-algorithms for examples and more details)
-// which fuses acceleration, rotation rate, and magnetic moments to produce a quaternion-based estimate of absolute
-// device orientation -- which can be converted to yaw, pitch, and roll. Useful for stabilizing quadcopters, etc.
-// The performance of the orientation filter is at least as good as conventional Kalman-based filtering algorithms
-// but is much less computationally intensive---it can be performed on a 3.3 V Pro Mini operating at 8 MHz!
-// Original code and explanation: https://github.com/kriswiner/LSM9DS1
-void MadgwickQuaternionUpdate(double ax, double ay, double az, double gx, double gy, double gz, double mx, double my, double mz)
+static void print_hist(const char *name, const IMUHist_t *h)
+{
+int i;
+
+   if (h->count == 0) return;
+   printf("%-20s %8lu calls, mean %6.0f us, max %6u us |", name, h->count, (double)h->sum/h->count, h->max);
+   for (i=0; i<IMU_HIST_BINS; i++) {
+      if (h->bins[i] == 0) continue;
+      if (i < IMU_HIST_BINS-1) printf(" <%u:%lu", 1u<<(i+1), h->bins[i]);
+      else printf(" >=%u:%lu", 1u<<i, h->bins[i]);
+   }
+   printf("\n");
+}
+
+
+static void print_stats(void)
+{
+IMUStats_t st;
+int i;
+
+   if (getStatsLSM9DS1(&st) < 0) return;
+   printf("IMU statistics:\n");
+   print_hist("imuRead", &st.callback);
+   for (i=0; i<IMU_I2C_OPS; i++) print_hist(i2c_names[i], &st.i2c[i]);
+   printf("FIFO depth at read |");
+   for (i=0; i<=FIFO_LINES; i++) 
+      if (st.fifo_depth[i]) printf(" %d:%lu", i, st.fifo_depth[i]);
+   printf("\n");
+   printf("ODR %.2f Hz (nominal %.1f Hz)%s, jitter %.0f us rms, %.0f us max\n", st.timing.odr, st.timing.odr_nominal, 
+          st.timing.locked ? "" : " not locked", st.timing.jitter_rms, st.timing.jitter_max);
+   printf("%lu samples, %lu short bursts, %lu overruns (%lu samples lost), %lu resyncs, %lu I2C errors\n", 
+          st.samples, st.timing.short_bursts, st.timing.overruns, st.timing.lost_samples, st.timing.resyncs, st.i2c_errors);
+   fflush(stdout);
+}
+
+
+static void* stats_loop(void *arg)
+{
+   while (sem_wait(&stats_sem) == 0 || errno == EINTR) {
+      if (!atomic_load(&stats_running)) break;
+      print_stats();
+   }
+   return NULL;
+}
+
+
+
+/*
+Ask the statistics thread to print the statistics of the IMU pipeline. 
+It only posts a semaphore, so it can be called from a signal handler (eg for SIGUSR1).
+*/
+void requestStatsLSM9DS1(void)
 {
-double q1 = q[0], q2 = q[1], q3 = q[2], q4 = q[3];   // short name local variable for readability
-double norm;
-double hx, hy, _2bx, _2bz;
-double s1, s2, s3, s4;
-double qDot1, qDot2, qDot3, qDot4;
-
-// Auxiliary variables to avoid repeated arithmetic
-double _2q1mx, _2q1my, _2q1mz, _2q2mx;
-double _4bx, _4bz;
-double _2q1 = 2.0 * q1, _2q2 = 2.0 * q2, _2q3 = 2.0 * q3, _2q4 = 2.0 * q4;
-double _2q1q3 = 2.0 * q1 * q3, _2q3q4 = 2.0 * q3 * q4;
-double q1q1 = q1 * q1, q1q2 = q1 * q2, q1q3 = q1 * q3, q1q4 = q1 * q4;
-double q2q2 = q2 * q2, q2q3 = q2 * q3, q2q4 = q2 * q4;
-double q3q3 = q3 * q3, q3q4 = q3 * q4;
-double q4q4 = q4 * q4;
-
-   // Normalise accelerometer measurement
-   norm = sqrt(ax * ax + ay * ay + az * az);
-   if (norm == 0.0) return; // handle NaN
-   norm = 1.0/norm;
-   ax *= norm;
-   ay *= norm;
-   az *= norm;
-
-   // Normalise magnetometer measurement
-   norm = sqrt(mx * mx + my * my + mz * mz);
-   if (norm == 0.0) return; // handle NaN
-   norm = 1.0/norm;
-   mx *= norm;
-   my *= norm;
-   mz *= norm;
-
-   // Reference direction of Earth's magnetic field
-   _2q1mx = 2.0 * q1 * mx;
-   _2q1my = 2.0 * q1 * my;
-   _2q1mz = 2.0 * q1 * mz;
-   _2q2mx = 2.0 * q2 * mx;
-   hx = mx * q1q1 - _2q1my * q4 + _2q1mz * q3 + mx * q2q2 + _2q2 * my * q3 + _2q2 * mz * q4 - mx * q3q3 - mx * q4q4;
-   hy = _2q1mx * q4 + my * q1q1 - _2q1mz * q2 + _2q2mx * q3 - my * q2q2 + my * q3q3 + _2q3 * mz * q4 - my * q4q4;
-   _2bx = sqrt(hx * hx + hy * hy);
-   _2bz = -_2q1mx * q3 + _2q1my * q2 + mz * q1q1 + _2q2mx * q4 - mz * q2q2 + _2q3 * my * q4 - mz * q3q3 + mz * q4q4;
-   _4bx = 2.0 * _2bx;
-   _4bz = 2.0 * _2bz;
-
-   // Gradient descent algorithm corrective step
-   s1 = -_2q3 * (2.0 * q2q4 - _2q1q3 - ax) + _2q2 * (2.0 * q1q2 + _2q3q4 - ay) - _2bz * q3 * (_2bx * (0.5 - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (-_2bx * q4 + _2bz * q2) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + _2bx * q3 * (_2bx * (q1q3 + q2q4) + _2bz * (0.5 - q2q2 - q3q3) - mz);
-   s2 = _2q4 * (2.0 * q2q4 - _2q1q3 - ax) + _2q1 * (2.0 * q1q2 + _2q3q4 - ay) - 4.0 * q2 * (1.0 - 2.0 * q2q2 - 2.0 * q3q3 - az) + _2bz * q4 * (_2bx * (0.5 - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (_2bx * q3 + _2bz * q1) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + (_2bx * q4 - _4bz * q2) * (_2bx * (q1q3 + q2q4) + _2bz * (0.5 - q2q2 - q3q3) - mz);
-   s3 = -_2q1 * (2.0 * q2q4 - _2q1q3 - ax) + _2q4 * (2.0 * q1q2 + _2q3q4 - ay) - 4.0 * q3 * (1.0 - 2.0 * q2q2 - 2.0 * q3q3 - az) + (-_4bx * q3 - _2bz * q1) * (_2bx * (0.5 - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (_2bx * q2 + _2bz * q4) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + (_2bx * q1 - _4bz * q3) * (_2bx * (q1q3 + q2q4) + _2bz * (0.5 - q2q2 - q3q3) - mz);
-   s4 = _2q2 * (2.0 * q2q4 - _2q1q3 - ax) + _2q3 * (2.0 * q1q2 + _2q3q4 - ay) + (-_4bx * q4 + _2bz * q2) * (_2bx * (0.5 - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (-_2bx * q1 + _2bz * q3) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + _2bx * q2 * (_2bx * (q1q3 + q2q4) + _2bz * (0.5 - q2q2 - q3q3) - mz);
-   norm = sqrt(s1 * s1 + s2 * s2 + s3 * s3 + s4 * s4);    // normalise step magnitude
-   norm = 1.0/norm;
-   s1 *= norm;
-   s2 *= norm;
-   s3 *= norm;
-   s4 *= norm;
-
-   // Compute rate of change of quaternion
-   qDot1 = 0.5 * (-q2 * gx - q3 * gy - q4 * gz) - beta * s1;
-   qDot2 = 0.5 * (q1 * gx + q3 * gz - q4 * gy) - beta * s2;
-   qDot3 = 0.5 * (q1 * gy - q2 * gz + q4 * gx) - beta * s3;
-   qDot4 = 0.5 * (q1 * gz + q2 * gy - q3 * gx) - beta * s4;
-
-   // Integrate to yield quaternion
-   q1 += qDot1 * deltat;
-   q2 += qDot2 * deltat;
-   q3 += qDot3 * deltat;
-   q4 += qDot4 * deltat;
-   norm = sqrt(q1 * q1 + q2 * q2 + q3 * q3 + q4 * q4);    // normalise quaternion
-   norm = 1.0/norm;
-   q[0] = q1 * norm;
-   q[1] = q2 * norm;
-   q[2] = q3 * norm;
-   q[3] = q4 * norm;
+   if (atomic_load(&stats_running)) sem_post(&stats_sem);
 }
+
+
+
   
 
 
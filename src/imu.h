@@ -6,8 +6,67 @@ Control of the LSM9DS1 3D accelerometer, 3D gyroscope, 3D magnetometer
 
 *****************************************************************************/
 
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/* Attitude of the car, published after each read of the IMU */
+typedef struct {
+   uint32_t sample;          // Number of the last accel/gyro sample used, it increases with each sample
+   uint32_t tick;            // gpioTick() of the last sample, reconstructed from the FIFO reads
+   double q[4];              // Attitude quaternion
+   double yaw, pitch, roll;  // Tait-Bryan angles, in degrees (see getAttitude()), computed from q
+   double rate[3];           // Rotation rate around X, Y and Z axis, in dps
+} Attitude_t;
+
+/* Timing of the accel/gyro samples, estimated from the FIFO reads */
+typedef struct {
+   double odr;                   // Estimated ODR of the accel/gyro, in Hz
+   double odr_nominal;           // ODR of the datasheet, in Hz
+   double jitter_rms;            // Jitter of the FIFO reads against the sample clock, in us
+   double jitter_max;            // Maximum jitter since the clock was locked, in us
+   bool locked;                  // The estimation has converged
+   unsigned long bursts;         // FIFO reads
+   unsigned long short_bursts;   // FIFO reads with less samples than a magnetometer period
+   unsigned long overruns;       // FIFO reads with samples lost by an overrun
+   unsigned long lost_samples;   // Estimated samples lost by overruns
+   unsigned long resyncs;        // Times the sample clock was set again after a long gap
+} IMUTiming_t;
+
+/* Histogram of durations, in us. Bin i counts the durations from 2^i to 2^(i+1)-1 us (bin 0 also 0 us) */
+#define IMU_HIST_BINS 16
+typedef struct {
+   unsigned long count;
+   uint64_t sum;                         // Sum of the durations, in us
+   uint32_t max;                         // Longest duration, in us
+   unsigned long bins[IMU_HIST_BINS];    // The last bin counts all the longer durations
+} IMUHist_t;
+
+/* I2C transactions of imuRead(), see IMUStats_t */
+enum {IMU_I2C_MAG_STATUS, IMU_I2C_MAG_DATA, IMU_I2C_FIFO_STATUS, IMU_I2C_FIFO_DATA, IMU_I2C_OPS};
+
+/* Health of the IMU pipeline */
+typedef struct {
+   IMUTiming_t timing;                   // Timing of the samples
+   IMUHist_t callback;                   // Execution time of imuRead()
+   IMUHist_t i2c[IMU_I2C_OPS];           // Duration of each I2C transaction
+   unsigned long fifo_depth[33];         // Number of reads with each number of samples in the FIFO (0 to 32)
+   unsigned long i2c_errors;             // Failed reads, the data of the read is lost
+   unsigned long samples;                // Accel/gyro samples processed
+} IMUStats_t;
+
+
+// Select ODR of accel/gyro and magnetometer, before calling setupLSM9DS1
+int setODRLSM9DS1(double odr_ag, double odr_m);
+
+// Select the attitude fusion engine ("madgwick", "mahony", "ekf", "ekf32", "ekf-mag" or "ekf32-mag"), before calling setupLSM9DS1
+int setFusionLSM9DS1(const char *name);
+
+// Enable the spectrum analysis of the vibration (see vibration.h), before calling setupLSM9DS1
+void setVibrationLSM9DS1(bool enable);
+
 // Inicializa el sistema
-int setupLSM9DS1(int acel_addr, int mag_addr, bool calibrate);
+int setupLSM9DS1(int acel_addr, int mag_addr, bool calibrate, unsigned timer, int fifo_pin, int collision_pin);
 
 // Cierra ordenadamente el sistema
 void closeLSM9DS1(void);
@@ -15,6 +74,24 @@ void closeLSM9DS1(void);
 // Function to read orientation of robot car
 int getAttitude(double *yaw, double *pitch, double *roll);
 
+// Consistent snapshot of the attitude, from any thread
+int getAttitudeSnapshot(Attitude_t *att);
+
+// Consistent snapshot of the timing statistics of the samples, from any thread
+int getTimingLSM9DS1(IMUTiming_t *t);
+
+// Consistent snapshot of the statistics of the IMU pipeline, from any thread
+int getStatsLSM9DS1(IMUStats_t *s);
+
+// Print the statistics of the IMU pipeline. It can be called from a signal handler
+void requestStatsLSM9DS1(void);
+
 void save_accel_data(void);
 
+// Estimated time (gpioTick) of the last collision detected
+uint32_t getImpactTick(void);
+
+// Direction where the last collision detected came from, in degrees: 0 is the front, 90 the left side, 180 the back
+int getImpactDirection(void);
+
 #endif // IMU_H
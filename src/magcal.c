@@ -0,0 +1,641 @@
+/*************************************************************************
+
+Magnetometer calibration. The raw samples taken while rotating the car in all
+directions lie on an ellipsoid, whose center is the hardiron offset and whose
+shape and orientation are given by the softiron effects.
+The samples are fitted to the ellipsoid with the Levenberg-Marquardt method,
+using analytic derivatives. Each iteration needs only one pass over the samples.
+The pass is done in single precision, 4 samples at a time (with NEON if the compiler targets it, 
+eg Raspberry Pi 2/3 with -mfpu=neon), and split among several threads. The samples are processed in fixed blocks 
+which are added in order, so the result does not depend on the number of threads.
+It is based on ideas from https://www.nxp.com/docs/en/application-note/AN4246.pdf
+The samples for online calibration are kept in bins (MagCalOnline_t), see MagCalOnline_add().
+
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "magcal.h"
+
+
+#define ERR(ret, format, arg...)                                       \
+   {                                                                   \
+         fprintf(stderr, "%s: " format "\n" , __func__ , ## arg);      \
+         return ret;                                                   \
+   }
+
+#define NPARAMS 9     // Center (3) and symmetric matrix (6)
+#define MAX_ITER 50   // Maximum number of iterations of the fit
+#define LANES 4       // Samples processed at a time by the single precision kernel
+#define BLOCK_SAMPLES 256  // Samples in each block, a multiple of LANES
+#define MAX_THREADS 4
+#define HORIZ_SECTORS 12  // Sectors of 30 degrees, for the coverage of MagCal_fitHorizontal()
+
+/* Samples normalized to the magnetic field, in single precision. Padded to a multiple of LANES, w is 0 for padding */
+typedef struct {
+  float *x, *y, *z, *w;
+  int num_elems, num_blocks;
+} FloatSamples_t;
+
+/* Sums of one block of samples */
+typedef struct {
+  double JtJ[NPARAMS][NPARAMS], Jtr[NPARAMS];
+  double cost, max_res;
+} Partial_t;
+
+/* Work of one thread: blocks first_block to last_block-1 */
+typedef struct {
+  const FloatSamples_t *fs;
+  const float *p;
+  Partial_t *partials;
+  int first_block, last_block;
+} Work_t;
+
+static double fit(const SampleList_t *sample_list, double field, MagCal_t *cal, int max_iter);
+
+static int num_threads = -1;  // 0 selects the double precision reference; -1 means not set yet, use all CPUs
+
+
+
+/*
+Compute the sum of the squared residuals of all samples, for the fit given in p.
+It also accumulates J^T*J and J^T*r, being J the jacobian of the residuals r.
+The parameters p are normalized to the magnetic field: the center (Vx, Vy, Vz)
+and the matrix coefficients Mxx, Myy, Mzz, Mxy, Mxz, Myz.
+The residual of each sample is |M*(B-V)|^2 - 1, with B normalized to the magnetic field.
+It also returns the largest residual in max_res.
+This is the double precision reference, see accumulate_block() for the one normally used.
+*/
+static double accumulate_double(const SampleList_t *const sample_list, double field, const double p[NPARAMS],
+                         double JtJ[NPARAMS][NPARAMS], double Jtr[NPARAMS], double *max_res)
+{
+double d[3], u[3], J[NPARAMS], r, cost = 0;
+int n, i, j;
+
+   memset(JtJ, 0, NPARAMS*NPARAMS*sizeof(double));
+   memset(Jtr, 0, NPARAMS*sizeof(double));
+   *max_res = 0;
+   for (n=0; n<sample_list->num_elems; n++) {
+      d[0] = sample_list->xvalues[n]/field - p[0];
+      d[1] = sample_list->yvalues[n]/field - p[1];
+      d[2] = sample_list->zvalues[n]/field - p[2];
+      u[0] = p[3]*d[0] + p[6]*d[1] + p[7]*d[2];
+      u[1] = p[6]*d[0] + p[4]*d[1] + p[8]*d[2];
+      u[2] = p[7]*d[0] + p[8]*d[1] + p[5]*d[2];
+      r = u[0]*u[0] + u[1]*u[1] + u[2]*u[2] - 1;
+
+      /* Derivatives of r. With respect to the center: -2*M*u (M is symmetric) */
+      J[0] = -2*(p[3]*u[0] + p[6]*u[1] + p[7]*u[2]);
+      J[1] = -2*(p[6]*u[0] + p[4]*u[1] + p[8]*u[2]);
+      J[2] = -2*(p[7]*u[0] + p[8]*u[1] + p[5]*u[2]);
+      /* With respect to the matrix. The off-diagonal coefficients appear twice */
+      J[3] = 2*u[0]*d[0];
+      J[4] = 2*u[1]*d[1];
+      J[5] = 2*u[2]*d[2];
+      J[6] = 2*(u[0]*d[1] + u[1]*d[0]);
+      J[7] = 2*(u[0]*d[2] + u[2]*d[0]);
+      J[8] = 2*(u[1]*d[2] + u[2]*d[1]);
+
+      for (i=0; i<NPARAMS; i++) {
+         for (j=i; j<NPARAMS; j++) JtJ[i][j] += J[i]*J[j];
+         Jtr[i] += J[i]*r;
+      }
+      cost += r*r;
+      if (fabs(r) > *max_res) *max_res = fabs(r);
+   }
+   for (i=0; i<NPARAMS; i++)
+      for (j=0; j<i; j++) JtJ[i][j] = JtJ[j][i];
+   return cost;
+}
+
+
+/* Add the sums of the LANES lanes of a block, always in the same order */
+static void add_lanes(float sJtJ[NPARAMS][NPARAMS][LANES], float sJtr[NPARAMS][LANES], 
+                      const float scost[LANES], const float smax[LANES], Partial_t *out)
+{
+int i, j, l;
+
+   memset(out, 0, sizeof(Partial_t));
+   for (l=0; l<LANES; l++) {
+      for (i=0; i<NPARAMS; i++) {
+         for (j=i; j<NPARAMS; j++) out->JtJ[i][j] += sJtJ[i][j][l];
+         out->Jtr[i] += sJtr[i][l];
+      }
+      out->cost += scost[l];
+      if (smax[l] > out->max_res) out->max_res = smax[l];
+   }
+}
+
+
+/*
+Same as accumulate_double(), in single precision, for the samples of block b.
+The samples are processed LANES at a time, each lane with its own sums, which are added at the end.
+GCC does not vectorize the portable version for 32 bit ARM (NEON does not follow IEEE 754,
+it would need -funsafe-math-optimizations), so there is a NEON version with intrinsics.
+Both do the same operations in the same order.
+*/
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static void accumulate_block(const FloatSamples_t *fs, int b, const float p[NPARAMS], Partial_t *out)
+{
+float32x4_t d0, d1, d2, u0, u1, u2, w2, r, J[NPARAMS];
+float32x4_t vJtJ[NPARAMS][NPARAMS], vJtr[NPARAMS], vcost, vmax;
+float sJtJ[NPARAMS][NPARAMS][LANES], sJtr[NPARAMS][LANES], scost[LANES], smax[LANES];
+int n, end, i, j;
+
+   for (i=0; i<NPARAMS; i++) {
+      for (j=i; j<NPARAMS; j++) vJtJ[i][j] = vdupq_n_f32(0.0f);
+      vJtr[i] = vdupq_n_f32(0.0f);
+   }
+   vcost = vmax = vdupq_n_f32(0.0f);
+   end = (b+1)*BLOCK_SAMPLES < fs->num_elems ? (b+1)*BLOCK_SAMPLES : fs->num_elems;
+   for (n=b*BLOCK_SAMPLES; n<end; n+=LANES) {
+      d0 = vsubq_f32(vld1q_f32(fs->x + n), vdupq_n_f32(p[0]));
+      d1 = vsubq_f32(vld1q_f32(fs->y + n), vdupq_n_f32(p[1]));
+      d2 = vsubq_f32(vld1q_f32(fs->z + n), vdupq_n_f32(p[2]));
+      u0 = vmlaq_n_f32(vmlaq_n_f32(vmulq_n_f32(d0, p[3]), d1, p[6]), d2, p[7]);
+      u1 = vmlaq_n_f32(vmlaq_n_f32(vmulq_n_f32(d0, p[6]), d1, p[4]), d2, p[8]);
+      u2 = vmlaq_n_f32(vmlaq_n_f32(vmulq_n_f32(d0, p[7]), d1, p[8]), d2, p[5]);
+      r = vmlaq_f32(vmlaq_f32(vmulq_f32(u0, u0), u1, u1), u2, u2);
+      r = vmulq_f32(vld1q_f32(fs->w + n), vsubq_f32(r, vdupq_n_f32(1.0f)));
+      w2 = vmulq_n_f32(vld1q_f32(fs->w + n), 2.0f);
+      J[0] = vnegq_f32(vmulq_f32(w2, vmlaq_n_f32(vmlaq_n_f32(vmulq_n_f32(u0, p[3]), u1, p[6]), u2, p[7])));
+      J[1] = vnegq_f32(vmulq_f32(w2, vmlaq_n_f32(vmlaq_n_f32(vmulq_n_f32(u0, p[6]), u1, p[4]), u2, p[8])));
+      J[2] = vnegq_f32(vmulq_f32(w2, vmlaq_n_f32(vmlaq_n_f32(vmulq_n_f32(u0, p[7]), u1, p[8]), u2, p[5])));
+      J[3] = vmulq_f32(vmulq_f32(w2, u0), d0);
+      J[4] = vmulq_f32(vmulq_f32(w2, u1), d1);
+      J[5] = vmulq_f32(vmulq_f32(w2, u2), d2);
+      J[6] = vmulq_f32(w2, vmlaq_f32(vmulq_f32(u0, d1), u1, d0));
+      J[7] = vmulq_f32(w2, vmlaq_f32(vmulq_f32(u0, d2), u2, d0));
+      J[8] = vmulq_f32(w2, vmlaq_f32(vmulq_f32(u1, d2), u2, d1));
+      for (i=0; i<NPARAMS; i++) {
+         for (j=i; j<NPARAMS; j++) vJtJ[i][j] = vmlaq_f32(vJtJ[i][j], J[i], J[j]);
+         vJtr[i] = vmlaq_f32(vJtr[i], J[i], r);
+      }
+      vcost = vmlaq_f32(vcost, r, r);
+      vmax = vmaxq_f32(vmax, vabsq_f32(r));
+   }
+
+   for (i=0; i<NPARAMS; i++) {
+      for (j=i; j<NPARAMS; j++) vst1q_f32(sJtJ[i][j], vJtJ[i][j]);
+      vst1q_f32(sJtr[i], vJtr[i]);
+   }
+   vst1q_f32(scost, vcost);
+   vst1q_f32(smax, vmax);
+   add_lanes(sJtJ, sJtr, scost, smax, out);
+}
+#else
+static void accumulate_block(const FloatSamples_t *fs, int b, const float p[NPARAMS], Partial_t *out)
+{
+float d[3][LANES], u[3][LANES], J[NPARAMS][LANES], r[LANES];
+float sJtJ[NPARAMS][NPARAMS][LANES], sJtr[NPARAMS][LANES], scost[LANES], smax[LANES];
+int n, end, i, j, l;
+
+   memset(sJtJ, 0, sizeof(sJtJ)); memset(sJtr, 0, sizeof(sJtr));
+   memset(scost, 0, sizeof(scost)); memset(smax, 0, sizeof(smax));
+   end = (b+1)*BLOCK_SAMPLES < fs->num_elems ? (b+1)*BLOCK_SAMPLES : fs->num_elems;
+   for (n=b*BLOCK_SAMPLES; n<end; n+=LANES) {
+      for (l=0; l<LANES; l++) {
+         d[0][l] = fs->x[n+l] - p[0];
+         d[1][l] = fs->y[n+l] - p[1];
+         d[2][l] = fs->z[n+l] - p[2];
+         u[0][l] = p[3]*d[0][l] + p[6]*d[1][l] + p[7]*d[2][l];
+         u[1][l] = p[6]*d[0][l] + p[4]*d[1][l] + p[8]*d[2][l];
+         u[2][l] = p[7]*d[0][l] + p[8]*d[1][l] + p[5]*d[2][l];
+         r[l] = fs->w[n+l]*(u[0][l]*u[0][l] + u[1][l]*u[1][l] + u[2][l]*u[2][l] - 1);
+         J[0][l] = -2*fs->w[n+l]*(p[3]*u[0][l] + p[6]*u[1][l] + p[7]*u[2][l]);
+         J[1][l] = -2*fs->w[n+l]*(p[6]*u[0][l] + p[4]*u[1][l] + p[8]*u[2][l]);
+         J[2][l] = -2*fs->w[n+l]*(p[7]*u[0][l] + p[8]*u[1][l] + p[5]*u[2][l]);
+         J[3][l] = 2*fs->w[n+l]*u[0][l]*d[0][l];
+         J[4][l] = 2*fs->w[n+l]*u[1][l]*d[1][l];
+         J[5][l] = 2*fs->w[n+l]*u[2][l]*d[2][l];
+         J[6][l] = 2*fs->w[n+l]*(u[0][l]*d[1][l] + u[1][l]*d[0][l]);
+         J[7][l] = 2*fs->w[n+l]*(u[0][l]*d[2][l] + u[2][l]*d[0][l]);
+         J[8][l] = 2*fs->w[n+l]*(u[1][l]*d[2][l] + u[2][l]*d[1][l]);
+      }
+      for (i=0; i<NPARAMS; i++) {
+         for (j=i; j<NPARAMS; j++)
+            for (l=0; l<LANES; l++) sJtJ[i][j][l] += J[i][l]*J[j][l];
+         for (l=0; l<LANES; l++) sJtr[i][l] += J[i][l]*r[l];
+      }
+      for (l=0; l<LANES; l++) {
+         scost[l] += r[l]*r[l];
+         smax[l] = fabsf(r[l]) > smax[l] ? fabsf(r[l]) : smax[l];
+      }
+   }
+   add_lanes(sJtJ, sJtr, scost, smax, out);
+}
+#endif
+
+
+static void *accumulate_thread(void *arg)
+{
+Work_t *work = arg;
+int b;
+
+   for (b=work->first_block; b<work->last_block; b++) 
+      accumulate_block(work->fs, b, work->p, &work->partials[b]);
+   return NULL;
+}
+
+
+/*
+Same as accumulate_double(), with the samples in single precision (fs), split among num_threads threads.
+The calling thread processes the first share of blocks. Returns -1 on error.
+*/
+static double accumulate(const SampleList_t *const sample_list, const FloatSamples_t *fs, Partial_t *partials, 
+                         double field, const double p[NPARAMS], 
+                         double JtJ[NPARAMS][NPARAMS], double Jtr[NPARAMS], double *max_res)
+{
+float pf[NPARAMS];
+pthread_t threads[MAX_THREADS];
+Work_t work[MAX_THREADS];
+double cost = 0;
+int i, j, b, t, started;
+
+   if (num_threads == 0) return accumulate_double(sample_list, field, p, JtJ, Jtr, max_res);
+
+   for (i=0; i<NPARAMS; i++) pf[i] = p[i];
+   for (t=0; t<num_threads; t++) {
+      work[t].fs = fs; work[t].p = pf; work[t].partials = partials;
+      work[t].first_block = t*fs->num_blocks/num_threads;
+      work[t].last_block = (t+1)*fs->num_blocks/num_threads;
+   }
+   for (started=1; started<num_threads; started++)
+      if (pthread_create(&threads[started], NULL, accumulate_thread, &work[started])) break;
+   accumulate_thread(&work[0]);
+   for (t=1; t<started; t++) pthread_join(threads[t], NULL);
+   if (started < num_threads) ERR(-1, "Cannot create thread");
+
+   /* Add the blocks in order, so the result is the same for any number of threads */
+   memset(JtJ, 0, NPARAMS*NPARAMS*sizeof(double));
+   memset(Jtr, 0, NPARAMS*sizeof(double));
+   *max_res = 0;
+   for (b=0; b<fs->num_blocks; b++) {
+      for (i=0; i<NPARAMS; i++) {
+         for (j=i; j<NPARAMS; j++) JtJ[i][j] += partials[b].JtJ[i][j];
+         Jtr[i] += partials[b].Jtr[i];
+      }
+      cost += partials[b].cost;
+      if (partials[b].max_res > *max_res) *max_res = partials[b].max_res;
+   }
+   for (i=0; i<NPARAMS; i++)
+      for (j=0; j<i; j++) JtJ[i][j] = JtJ[j][i];
+   return cost;
+}
+
+
+/*
+Solve A*x = b with the Cholesky decomposition, A being symmetric.
+A is overwritten. Returns -1 if A is not positive definite.
+*/
+static int cholesky_solve(double A[NPARAMS][NPARAMS], const double b[NPARAMS], double x[NPARAMS])
+{
+int i, j, k;
+double sum;
+
+   /* A = L*L^T, L is stored in the lower triangle of A */
+   for (j=0; j<NPARAMS; j++) {
+      sum = A[j][j];
+      for (k=0; k<j; k++) sum -= A[j][k]*A[j][k];
+      if (sum <= 0) return -1;
+      A[j][j] = sqrt(sum);
+      for (i=j+1; i<NPARAMS; i++) {
+         sum = A[i][j];
+         for (k=0; k<j; k++) sum -= A[i][k]*A[j][k];
+         A[i][j] = sum/A[j][j];
+      }
+   }
+   /* Solve L*y = b, and then L^T*x = y */
+   for (i=0; i<NPARAMS; i++) {
+      sum = b[i];
+      for (k=0; k<i; k++) sum -= A[i][k]*x[k];
+      x[i] = sum/A[i][i];
+   }
+   for (i=NPARAMS-1; i>=0; i--) {
+      sum = x[i];
+      for (k=i+1; k<NPARAMS; k++) sum -= A[k][i]*x[k];
+      x[i] = sum/A[i][i];
+   }
+   return 0;
+}
+
+
+/*
+Set the number of threads used by MagCal_fit(), between 1 and MAX_THREADS.
+0 selects the double precision reference, in the calling thread.
+By default, one thread per CPU is used.
+*/
+void MagCal_setThreads(int threads)
+{
+   if (threads < 0) threads = 0;
+   num_threads = threads > MAX_THREADS ? MAX_THREADS : threads;
+}
+
+
+/*
+Fit the samples to an ellipsoid with any orientation, with 9 parameters: the center (hardiron)
+and the inverse softiron matrix, which is symmetric.
+'field' is the magnitude of the magnetic field, in IMU units. It cannot be calculated from the samples,
+as all 3 axis can be subject to softiron deformation, but a correct value is not needed for
+orientation (ie, calculation of yaw, pitch and roll).
+On input, cal must contain the initial estimation (eg from the maximum and minimum values).
+On output, it contains the fit, the residuals and the number of passes over the samples.
+cal is only modified if the fit is better than the initial estimation.
+Returns the mean cuadratic error (sum of squared residuals divided by number of samples), or -1 on error.
+*/
+double MagCal_fit(const SampleList_t *const sample_list, double field, MagCal_t *cal)
+{
+   return fit(sample_list, field, cal, MAX_ITER);
+}
+
+
+/* Levenberg-Marquardt fit, see MagCal_fit(). It does max_iter iterations at most */
+static double fit(const SampleList_t *const sample_list, double field, MagCal_t *cal, int max_iter)
+{
+double p[NPARAMS], p_new[NPARAMS], delta[NPARAMS];
+double JtJ[NPARAMS][NPARAMS], Jtr[NPARAMS], JtJ_new[NPARAMS][NPARAMS], Jtr_new[NPARAMS], A[NPARAMS][NPARAMS];
+double cost, init_cost, new_cost, max_res, new_max_res, lambda = 1E-3;
+int iter, passes, i, j;
+FloatSamples_t fs = {NULL};
+Partial_t *partials = NULL;
+
+   if (sample_list == NULL || cal == NULL) ERR(-1, "Invalid parameters");
+   if (sample_list->num_elems < NPARAMS || field <= 0) ERR(-1, "Not enough samples or invalid field value");
+   if (num_threads < 0) MagCal_setThreads(sysconf(_SC_NPROCESSORS_ONLN));
+
+   /* Copy the samples in single precision, normalized to the magnetic field */
+   if (num_threads > 0) {
+      fs.num_elems = (sample_list->num_elems + LANES-1)/LANES*LANES;
+      fs.num_blocks = (fs.num_elems + BLOCK_SAMPLES-1)/BLOCK_SAMPLES;
+      fs.x = calloc(4*fs.num_elems, sizeof(float));
+      partials = malloc(fs.num_blocks*sizeof(Partial_t));
+      if (fs.x == NULL || partials == NULL) {
+         free(fs.x); free(partials);
+         ERR(-1, "Cannot allocate memory");
+      }
+      fs.y = fs.x + fs.num_elems; fs.z = fs.y + fs.num_elems; fs.w = fs.z + fs.num_elems;
+      for (i=0; i<sample_list->num_elems; i++) {
+         fs.x[i] = sample_list->xvalues[i]/field;
+         fs.y[i] = sample_list->yvalues[i]/field;
+         fs.z[i] = sample_list->zvalues[i]/field;
+         fs.w[i] = 1;
+      }
+   }
+
+   /* Set initial point, normalized to the magnetic field */
+   for (i=0; i<3; i++) p[i] = cal->center[i]/field;
+   p[3] = cal->matrix[0][0]; p[4] = cal->matrix[1][1]; p[5] = cal->matrix[2][2];
+   p[6] = cal->matrix[0][1]; p[7] = cal->matrix[0][2]; p[8] = cal->matrix[1][2];
+
+   init_cost = cost = accumulate(sample_list, &fs, partials, field, p, JtJ, Jtr, &max_res);
+   if (cost < 0) goto fit_error;
+   passes = 1;
+   for (iter=0; iter<max_iter; iter++) {
+      /* Solve (J^T*J + lambda*diag(J^T*J))*delta = -J^T*r */
+      for (i=0; i<NPARAMS; i++) {
+         for (j=0; j<NPARAMS; j++) A[i][j] = JtJ[i][j];
+         A[i][i] *= 1 + lambda;
+      }
+      for (i=0; i<NPARAMS; i++) Jtr_new[i] = -Jtr[i];
+      if (cholesky_solve(A, Jtr_new, delta) < 0) {
+         lambda *= 10;
+         if (lambda > 1E10) break;
+         continue;
+      }
+
+      for (i=0; i<NPARAMS; i++) p_new[i] = p[i] + delta[i];
+      new_cost = accumulate(sample_list, &fs, partials, field, p_new, JtJ_new, Jtr_new, &new_max_res);
+      if (new_cost < 0) goto fit_error;
+      passes++;
+      if (new_cost < cost) {  // Step accepted, move towards Gauss-Newton
+         memcpy(p, p_new, sizeof(p));
+         memcpy(JtJ, JtJ_new, sizeof(JtJ));
+         memcpy(Jtr, Jtr_new, sizeof(Jtr));
+         max_res = new_max_res;
+         lambda /= 10;
+         if (cost - new_cost < 1E-6*cost) {  // No significant improvement, converged
+            cost = new_cost;
+            break;
+         }
+         cost = new_cost;
+      }
+      else {  // Step rejected, move towards gradient descent
+         // If the cost did not change beyond rounding errors (single precision), the minimum was reached
+         if (new_cost - cost < 1E-5*cost) break;
+         lambda *= 10;
+         if (lambda > 1E10) break;
+      }
+   }
+
+   if (cost < init_cost) {
+      for (i=0; i<3; i++) cal->center[i] = p[i]*field;
+      cal->matrix[0][0] = p[3]; cal->matrix[1][1] = p[4]; cal->matrix[2][2] = p[5];
+      cal->matrix[0][1] = cal->matrix[1][0] = p[6];
+      cal->matrix[0][2] = cal->matrix[2][0] = p[7];
+      cal->matrix[1][2] = cal->matrix[2][1] = p[8];
+   }
+   cal->rms_residual = sqrt(cost/sample_list->num_elems);
+   cal->max_residual = max_res;
+   cal->passes = passes;
+   free(fs.x); free(partials);
+   return cost/sample_list->num_elems;  // Mean cuadratic error
+
+fit_error:
+   free(fs.x); free(partials);
+   return -1;
+}
+
+
+/*
+Mean cuadratic error of the samples with the calibration in cal, computed in one pass.
+cal is not modified. Returns -1 on error.
+*/
+double MagCal_cost(const SampleList_t *const sample_list, double field, const MagCal_t *cal)
+{
+MagCal_t c = *cal;
+
+   return fit(sample_list, field, &c, 0);  // A fit with no iterations: one pass with the same code
+}
+
+
+/* Solve A*x = b for a 3x3 matrix, with Cramer's rule. Returns -1 if A is singular */
+static int solve3(const double A[3][3], const double b[3], double x[3])
+{
+double det;
+int i;
+
+   det = A[0][0]*(A[1][1]*A[2][2] - A[1][2]*A[2][1]) - A[0][1]*(A[1][0]*A[2][2] - A[1][2]*A[2][0]) + 
+         A[0][2]*(A[1][0]*A[2][1] - A[1][1]*A[2][0]);
+   if (fabs(det) < 1E-12) return -1;
+   for (i=0; i<3; i++) {
+      x[i] = (b[0]*(A[(i+1)%3][1]*A[(i+2)%3][2] - A[(i+1)%3][2]*A[(i+2)%3][1]) - 
+              b[1]*(A[(i+1)%3][0]*A[(i+2)%3][2] - A[(i+1)%3][2]*A[(i+2)%3][0]) + 
+              b[2]*(A[(i+1)%3][0]*A[(i+2)%3][1] - A[(i+1)%3][1]*A[(i+2)%3][0]))/det;
+   }
+   return 0;
+}
+
+
+/*
+Fit of the hardiron offset in the horizontal plane, for a car which only turns around the vertical 
+axis: the samples cover a ring of the ellipsoid, not enough for MagCal_fit(). The samples corrected 
+with cal, u = matrix*(b-center), then lie on a circle in the XY plane of the sensor (the car is 
+assumed to be on level ground). The circle is fitted with linear least squares and the center of cal 
+is moved to the center of the circle. The vertical offset and the softiron matrix cannot be 
+observed with these rotations, they are kept.
+'coverage' returns the fraction of the sectors of 30 degrees around the new center which have samples.
+cal is only modified if the fit is better than the initial calibration.
+Returns the mean cuadratic error as MagCal_fit(), or -1 on error.
+*/
+double MagCal_fitHorizontal(const SampleList_t *const sample_list, double field, MagCal_t *cal, double *coverage)
+{
+double A[3][3] = {{0}}, b[3] = {0}, c[3], d[3], u[3], shift[3], cost, init_cost;
+bool sector[HORIZ_SECTORS] = {false};
+int n, i, j, covered;
+MagCal_t new_cal;
+
+   if (sample_list == NULL || cal == NULL || coverage == NULL) ERR(-1, "Invalid parameters");
+   if (sample_list->num_elems < 3 || field <= 0) ERR(-1, "Not enough samples or invalid field value");
+
+   /* Circle ux^2+uy^2 = 2*c0*ux + 2*c1*uy + c2, normalized to the magnetic field */
+   for (n=0; n<sample_list->num_elems; n++) {
+      d[0] = (sample_list->xvalues[n] - cal->center[0])/field;
+      d[1] = (sample_list->yvalues[n] - cal->center[1])/field;
+      d[2] = (sample_list->zvalues[n] - cal->center[2])/field;
+      for (i=0; i<3; i++) u[i] = cal->matrix[i][0]*d[0] + cal->matrix[i][1]*d[1] + cal->matrix[i][2]*d[2];
+      u[2] = 1;  // Regressor of c2
+      for (i=0; i<3; i++) {
+         for (j=0; j<3; j++) A[i][j] += u[i]*u[j];
+         b[i] += u[i]*(u[0]*u[0] + u[1]*u[1]);
+      }
+   }
+   if (solve3(A, b, c) < 0) ERR(-1, "Samples do not define a circle");
+   c[0] /= 2; c[1] /= 2; c[2] = 0;
+
+   /* The center moves by matrix^-1*c, in IMU units */
+   if (solve3((const double (*)[3])cal->matrix, c, shift) < 0) ERR(-1, "Invalid softiron matrix");
+   new_cal = *cal;
+   for (i=0; i<3; i++) new_cal.center[i] += shift[i]*field;
+
+   for (n=0; n<sample_list->num_elems; n++) {
+      d[0] = sample_list->xvalues[n] - new_cal.center[0];
+      d[1] = sample_list->yvalues[n] - new_cal.center[1];
+      d[2] = sample_list->zvalues[n] - new_cal.center[2];
+      for (i=0; i<2; i++) u[i] = new_cal.matrix[i][0]*d[0] + new_cal.matrix[i][1]*d[1] + new_cal.matrix[i][2]*d[2];
+      i = (int)floor((atan2(u[1], u[0]) + M_PI)/(2*M_PI)*HORIZ_SECTORS);
+      sector[i < HORIZ_SECTORS ? i : 0] = true;
+   }
+   for (i=0, covered=0; i<HORIZ_SECTORS; i++) if (sector[i]) covered++;
+   *coverage = (double)covered/HORIZ_SECTORS;
+
+   init_cost = MagCal_cost(sample_list, field, cal);
+   cost = MagCal_cost(sample_list, field, &new_cal);
+   if (init_cost < 0 || cost < 0) return -1;
+   if (cost < init_cost) *cal = new_cal;
+   else cost = init_cost;
+   return cost;
+}
+
+
+
+/*
+Initialize the bins for online calibration. The bin directions are the 12 vertices
+of an icosahedron and the midpoints of its 30 edges, projected onto the unit sphere.
+'center' is the current estimation of the hardiron offset, it is used to bin the samples.
+*/
+void MagCalOnline_init(MagCalOnline_t *o, const double center[3])
+{
+const double phi = (1 + sqrt(5))/2;  // Golden ratio
+double v[12][3], m[3], norm;
+int i, j, k, n;
+
+   memset(o, 0, sizeof(*o));
+   memcpy(o->center, center, sizeof(o->center));
+
+   /* Vertices of the icosahedron: cyclic permutations of (0, +-1, +-phi) */
+   for (n=0; n<12; n++) {
+      k = n/4;  // Permutation
+      v[n][k] = 0;
+      v[n][(k+1)%3] = n&1 ? -1 : 1;
+      v[n][(k+2)%3] = n&2 ? -phi : phi;
+   }
+   norm = sqrt(1 + phi*phi);
+   for (n=0; n<12; n++)
+      for (k=0; k<3; k++) o->dir[n][k] = v[n][k]/norm;
+
+   /* Midpoints of the edges, the vertices at distance 2 */
+   for (i=0; i<12; i++)
+      for (j=i+1; j<12; j++) {
+         for (k=0, norm=0; k<3; k++) norm += (v[i][k]-v[j][k])*(v[i][k]-v[j][k]);
+         if (fabs(norm - 4) > 1E-6) continue;
+         for (k=0, norm=0; k<3; k++) {
+            m[k] = v[i][k] + v[j][k];
+            norm += m[k]*m[k];
+         }
+         for (k=0; k<3; k++) o->dir[n][k] = m[k]/sqrt(norm);
+         n++;
+      }
+}
+
+
+/* Add a raw sample to the bin closest to its direction. The oldest sample of the bin is replaced */
+void MagCalOnline_add(MagCalOnline_t *o, int x, int y, int z)
+{
+float d[3], dot, max_dot = -2;
+int b, bin = 0, slot;
+
+   d[0] = x - o->center[0]; d[1] = y - o->center[1]; d[2] = z - o->center[2];
+   for (b=0; b<MAGCAL_BINS; b++) {
+      dot = d[0]*o->dir[b][0] + d[1]*o->dir[b][1] + d[2]*o->dir[b][2];
+      if (dot > max_dot) {
+         max_dot = dot;
+         bin = b;
+      }
+   }
+   slot = o->count[bin]++ % MAGCAL_BIN_SAMPLES;
+   o->x[bin][slot] = x; o->y[bin][slot] = y; o->z[bin][slot] = z;
+   o->new_samples++;
+}
+
+
+/* Fraction of the bins which have samples, between 0 and 1 */
+double MagCalOnline_coverage(const MagCalOnline_t *o)
+{
+int b, covered = 0;
+
+   for (b=0; b<MAGCAL_BINS; b++) if (o->count[b]) covered++;
+   return (double)covered/MAGCAL_BINS;
+}
+
+
+/*
+Copy the samples of all bins into sample_list, whose arrays must have room for 
+MAGCAL_BINS*MAGCAL_BIN_SAMPLES elements. It resets the count of new samples.
+Returns the number of samples copied.
+*/
+int MagCalOnline_samples(MagCalOnline_t *o, SampleList_t *sample_list)
+{
+int b, i, n;
+
+   sample_list->num_elems = 0;
+   for (b=0; b<MAGCAL_BINS; b++) {
+      n = o->count[b] < MAGCAL_BIN_SAMPLES ? o->count[b] : MAGCAL_BIN_SAMPLES;
+      for (i=0; i<n; i++) {
+         sample_list->xvalues[sample_list->num_elems] = o->x[b][i];
+         sample_list->yvalues[sample_list->num_elems] = o->y[b][i];
+         sample_list->zvalues[sample_list->num_elems] = o->z[b][i];
+         sample_list->num_elems++;
+      }
+   }
+   o->new_samples = 0;
+   return sample_list->num_elems;
+}
@@ -0,0 +1,58 @@
+#ifndef MAGCAL_H
+#define MAGCAL_H
+
+/*************************************************************************
+Magnetometer calibration: fit of the measured samples to a rotated ellipsoid
+
+*****************************************************************************/
+
+
+// Raw magnetometer samples, in IMU units
+typedef struct {
+    int *xvalues, *yvalues, *zvalues;
+    int num_elems;
+} SampleList_t;
+
+
+/*
+Hardiron and softiron calibration. A raw sample b is corrected with matrix*(b-center),
+which lies on a sphere of radius equal to the magnetic field.
+*/
+typedef struct {
+  double center[3];     // Hardiron offset, in IMU units
+  double matrix[3][3];  // Inverse softiron matrix, symmetric
+  double rms_residual;  // Root mean square of the residuals of the fit
+  double max_residual;  // Largest residual (absolute value) of the fit
+  int passes;           // Number of passes over the samples
+} MagCal_t;
+
+
+#define MAGCAL_BINS 42        // Directions of an icosphere: icosahedron with its edges subdivided once
+#define MAGCAL_BIN_SAMPLES 8  // Samples kept in each bin, the oldest one is replaced
+
+/*
+Bounded set of samples for online calibration. Each sample is stored in the bin whose
+direction is closest to the direction of the sample from 'center', so the samples are 
+spread over the ellipsoid and the memory used is constant, however long the car runs.
+*/
+typedef struct {
+  float dir[MAGCAL_BINS][3];   // Unit vector of each bin
+  int x[MAGCAL_BINS][MAGCAL_BIN_SAMPLES], y[MAGCAL_BINS][MAGCAL_BIN_SAMPLES], z[MAGCAL_BINS][MAGCAL_BIN_SAMPLES];
+  unsigned count[MAGCAL_BINS];  // Samples added to each bin
+  double center[3];             // Center used to bin the samples, in IMU units
+  unsigned new_samples;         // Samples added since the last call to MagCalOnline_samples()
+} MagCalOnline_t;
+
+
+double MagCal_fit(const SampleList_t *sample_list, double field, MagCal_t *cal);
+
+void MagCalOnline_init(MagCalOnline_t *o, const double center[3]);
+void MagCalOnline_add(MagCalOnline_t *o, int x, int y, int z);
+double MagCalOnline_coverage(const MagCalOnline_t *o);
+int MagCalOnline_samples(MagCalOnline_t *o, SampleList_t *sample_list);
+double MagCal_cost(const SampleList_t *sample_list, double field, const MagCal_t *cal);
+double MagCal_fitHorizontal(const SampleList_t *sample_list, double field, MagCal_t *cal, double *coverage);
+void MagCal_setThreads(int threads);
+
+
+#endif // MAGCAL_H
@@ -31,6 +31,7 @@ El control lo realizan varios threads que se comunican mediante variables at
 #include "pcf8591.h"
 #include "bmp280.h"
 #include "robot.h"
+#include "odometry.h"
 
 extern char *optarg;
 extern int optind, opterr, optopt;
@@ -55,6 +56,8 @@ extern int optind, opterr, optopt;
 #define LSENSOR_PIN 6
 #define RSENSOR_PIN 5
 #define KARR_PIN    4
+#define IMU_INT1_PIN 13   /* INT1 pin of LSM9DS1 accel/gyro, signals collision */
+#define IMU_INT2_PIN 19   /* INT2 pin of LSM9DS1 accel/gyro, signals FIFO threshold */
 
 
 
@@ -132,7 +135,9 @@ _Atomic bool playing_audio, cancel_audio;   // Variables compartidas con fichero
 /* Generic global variables */
 int soundVolume = 96;  // 0 - 100%
 sem_t semaphore;  // Used to synchronize the main loop with the sonar measurement thread
-bool remoteOnly, useEncoder, checkBattery, softTurn, calibrateIMU; // program line options
+bool remoteOnly, useEncoder, checkBattery, softTurn, calibrateIMU, imuInterrupt, imuCollisionInt, imuVibration; // program line options
+double imuODR_AG, imuODR_M;  // program line options, 0 means default value
+char *imuFusion;             // program line option, NULL means default engine
 char *alarmFile = "sounds/police.wav";  // File to play when user presses "UP" in wiimote
 
 
@@ -213,6 +218,51 @@ void fastStopMotor(Motor_t *motor)
 
 
 
+/* Total number of pulses counted by both wheel encoders. It only changes if encoders are used */
+uint32_t getEncoderPulses(void)
+{
+    return atomic_load_explicit(&m_izdo.counter, memory_order_relaxed) + 
+           atomic_load_explicit(&m_dcho.counter, memory_order_relaxed);
+}
+
+
+/* Pulses counted by the encoder of each wheel, and the direction each motor is driven: 1 forwards, -1 backwards */
+void getWheelEncoders(uint32_t *left, uint32_t *right, int *left_dir, int *right_dir)
+{
+    *left = atomic_load_explicit(&m_izdo.counter, memory_order_relaxed);
+    *right = atomic_load_explicit(&m_dcho.counter, memory_order_relaxed);
+    pthread_mutex_lock(&m_izdo.mutex);
+    *left_dir = m_izdo.sentido == ADELANTE ? 1 : -1;
+    pthread_mutex_unlock(&m_izdo.mutex);
+    pthread_mutex_lock(&m_dcho.mutex);
+    *right_dir = m_dcho.sentido == ADELANTE ? 1 : -1;
+    pthread_mutex_unlock(&m_dcho.mutex);
+}
+
+
+/* True if no motor has a speed set, ie the car is not being driven */
+bool motorsStopped(void)
+{
+bool stopped;
+
+    pthread_mutex_lock(&m_izdo.mutex);
+    stopped = m_izdo.velocidad == 0;
+    pthread_mutex_unlock(&m_izdo.mutex);
+    pthread_mutex_lock(&m_dcho.mutex);
+    stopped = stopped && m_dcho.velocidad == 0;
+    pthread_mutex_unlock(&m_dcho.mutex);
+    return stopped;
+}
+
+
+/* Stop both motors at once, eg when the IMU signals a collision */
+void stopMotors(void)
+{
+    fastStopMotor(&m_izdo); fastStopMotor(&m_dcho);
+}
+
+
+
 /* v va de 0 a 100 */
 void ajustaMotor(Motor_t *motor, int v, Sentido_t sentido)
 {    
@@ -502,7 +552,7 @@ static int LEDs[4] = { CWIID_LED1_ON,  CWIID_LED1_ON | CWIID_LED2_ON,
         case CWIID_MESG_BTN:  // Change in buttons
             WRITE_ATOMIC(mando.buttons, mesg[i].btn_mesg.buttons);
 
-            // Save data from accelerometer in a file. Start and end saving when '2' is pressed
+            // Save raw data from IMU in a file. Start and end saving when '2' is pressed
             if (previous_buttons&CWIID_BTN_2 && ~mando.buttons&CWIID_BTN_2) save_accel_data();
 
             /*** Botones + y - ***/           
@@ -863,19 +913,32 @@ Motor_t *pivot, *non_pivot;
 
 
 /**
-The car has found an obstacle in front, move backwards and turn slightly 
+The car has found an obstacle in front, move backwards and turn slightly.
+After a collision detected by the IMU, it moves away from the side where it was hit 
+(forwards if it was hit from behind), and turns away from it
 **/
 static int retreatBackwards(void)
 {
-int rc;
+int rc, dir = 0;
+Sentido_t marcha = ATRAS;
+Rotation_t rotation = CW;
+bool hit = READ_ATOMIC(collision);
 
    //printf("Car seems stalled or collisioned, move a bit backwards...\n");
    fastStopMotor(&m_izdo); fastStopMotor(&m_dcho);
+   if (hit && !imuCollisionInt)  // Otherwise, the motors were stopped by the IMU interrupt
+      printf("Collision: motors stopped %.1f ms after impact\n", (int32_t)(gpioTick() - getImpactTick())/1000.0);
    gpioSleep(PI_TIME_RELATIVE, 0, 200000);
-   ajustaMotor(&m_izdo, 50, ATRAS);
-   ajustaMotor(&m_dcho, 50, ATRAS);
-   rc = interruptibleWait(softTurn?400000:800000);  // Move a little backwards first
-   if (rc >= 0) rc = rota(CW, ATRAS, velocidadCoche>70?300000:600000);  // If all went well, rotate backwards
+   if (hit && (int32_t)(gpioTick() - getImpactTick()) < 1000000) {  // The IMU has detected it by now
+      dir = getImpactDirection();
+      if (abs(dir) > 90) marcha = ADELANTE;
+      if (dir < 0) rotation = CCW;
+      printf("Collision: impact from %d degrees\n", dir);
+   }
+   ajustaMotor(&m_izdo, 50, marcha);
+   ajustaMotor(&m_dcho, 50, marcha);
+   rc = interruptibleWait(softTurn?400000:800000);  // Move a little away first
+   if (rc >= 0) rc = rota(rotation, marcha, velocidadCoche>70?300000:600000);  // If all went well, rotate
 
    fastStopMotor(&m_izdo); fastStopMotor(&m_dcho); 
    return rc;
@@ -959,6 +1022,14 @@ void closedown(void)
 
 
 
+/* Called on SIGUSR1. The IMU prints its statistics in its own thread, nothing is done here in signal context */
+void dumpStats(int signum)
+{
+   requestStatsLSM9DS1();
+}
+
+
+
 /* Para el coche, cierra todo y termina el programa */
 void terminate(int signum)
 {
@@ -981,6 +1052,7 @@ int rc = 0;
    gpioCfgInterfaces(PI_DISABLE_FIFO_IF | PI_DISABLE_SOCK_IF);
    if (gpioInitialise()<0) return 1;
    if (gpioSetSignalFunc(SIGINT, terminate)<0) return 1;  // Call terminate when Ctrl-C is pressed
+   if (gpioSetSignalFunc(SIGUSR1, dumpStats)<0) return 1;  // Print the statistics of the IMU with kill -USR1
    
    // Restore signal actions to default, so program dumps core if they happen
    signal(SIGSEGV, SIG_DFL);  
@@ -1013,7 +1085,9 @@ int rc = 0;
    rc |= sem_init(&semaphore, 0, 0);
    
    setupBMP280(BMP280_I2C, TIMER4);  // Setup temperature/pressure sensor
-   setupLSM9DS1(LSM9DS1_GYR_ACEL_I2C, LSM9DS1_MAG_I2C, calibrateIMU, TIMER3);   // Setup IMU
+   Odometry_init(WHEELD, NUMPULSES);  // Updated by the IMU; the distance needs the encoders (option -e)
+   setupLSM9DS1(LSM9DS1_GYR_ACEL_I2C, LSM9DS1_MAG_I2C, calibrateIMU, TIMER3, 
+                imuInterrupt ? IMU_INT2_PIN : -1, imuCollisionInt ? IMU_INT1_PIN : -1);   // Setup IMU
    
    setupWiimote(); 
    gpioSetAlertFunc(WMSCAN_PIN, wmScan);  // Call wmScan when button changes. Debe llamarse despus de setupWiimote
@@ -1035,7 +1109,7 @@ double volts;
 uint16_t buttons;
 
    opterr = 0;  // Prevent getopt from outputting error messages
-   while ((rc = getopt(argc, argv, "crbesf:")) != -1)
+   while ((rc = getopt(argc, argv, "crbesikvf:a:m:F:")) != -1)
        switch (rc) {
            case 'r':  /* Remote only mode: only reacts to remote control */
                remoteOnly = true;
@@ -1055,11 +1129,33 @@ uint16_t buttons;
            case 'c': /* Calibrate IMU sensor */
                calibrateIMU = true;
                break;
+           case 'i': /* Read IMU when its FIFO reaches the threshold (INT2 pin), instead of with a timer */
+               imuInterrupt = true;
+               break;
+           case 'k': /* Detect collisions with the interrupt generator of the IMU (INT1 pin) */
+               imuCollisionInt = true;
+               break;
+           case 'v': /* Spectrum analysis of the vibration measured by the IMU */
+               imuVibration = true;
+               break;
+           case 'a': /* ODR of IMU accelerometer/gyroscope, in Hz */
+               imuODR_AG = atof(optarg);
+               break;
+           case 'm': /* ODR of IMU magnetometer, in Hz */
+               imuODR_M = atof(optarg);
+               break;
+           case 'F': /* Attitude fusion engine of IMU: madgwick, mahony, ekf, ekf32, ekf-mag or ekf32-mag */
+               imuFusion = optarg;
+               break;
            default:
-               fprintf(stderr, "Uso: %s [-r] [-b] [-e] [-s] [-c] [-f <fichero de alarma>]\n", argv[0]);
+               fprintf(stderr, "Uso: %s [-r] [-b] [-e] [-s] [-c] [-i] [-k] [-v] [-a <ODR acel/giro>] [-m <ODR magnet.>] [-F <madgwick|mahony|ekf|ekf32|ekf-mag|ekf32-mag>] [-f <fichero de alarma>]\n", argv[0]);
                exit(1);
    }
    
+   if (setODRLSM9DS1(imuODR_AG, imuODR_M) < 0) exit(1);
+   if (imuFusion && setFusionLSM9DS1(imuFusion) < 0) exit(1);
+   setVibrationLSM9DS1(imuVibration);
+   
    rc = setup();
    if (rc) {
        fprintf(stderr, "Error al inicializar. Coche no arranca!\n");
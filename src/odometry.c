@@ -0,0 +1,120 @@
+/*************************************************************************
+
+Dead reckoning odometry. At each read of the IMU (a FIFO burst), Odometry_update() takes 
+the pulses counted by each wheel encoder since the previous update, and the rotation 
+integrated from the gyroscope over the burst. The encoders count pulses in both directions, 
+so the sign is taken from the direction the motor is driven (see getWheelEncoders()).
+The heading is integrated from the gyroscope only: the wheels of the car slip when it turns, 
+so the difference of the encoders is a poor measure of the rotation. The distance is the mean of
+both wheels, applied at the mean heading of the update (midpoint integration).
+
+The 32 bit encoder counters and gpioTick() wrap around; their differences are accumulated in 
+64 bit counters, so the pose does not wrap. The pose is published under a seqlock: readers 
+never block the IMU thread.
+
+*****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "odometry.h"
+#include "seqlock.h"
+#include "robot.h"
+
+
+#define ERR(ret, format, arg...)                                       \
+   {                                                                   \
+         fprintf(stderr, "%s: " format "\n" , __func__ , ## arg);      \
+         return ret;                                                   \
+   }
+
+static const double speed_alpha = 0.3;  // Weight of each update in the low pass filter of the speed
+
+static double meters_per_pulse;   // 0 if not initialized
+static uint32_t last_tick, last_left, last_right;  // Values of the previous update
+static bool started;
+static Pose_t state;              // Written only by the IMU thread
+static SeqLock_t pose_lock;
+static Pose_t pose;               // Published copy of state
+
+
+/* Geometry of the wheels: diameter in mm, and encoder pulses per turn of the wheel */
+void Odometry_init(double wheel_diameter, unsigned pulses_per_turn)
+{
+   meters_per_pulse = M_PI*wheel_diameter/1000/pulses_per_turn;
+   Odometry_reset();
+}
+
+
+/* Set the pose to the origin. Only from the IMU thread, or before it starts */
+void Odometry_reset(void)
+{
+   memset(&state, 0, sizeof(state));
+   started = false;
+   SeqLock_writeBegin(&pose_lock);
+   pose = state;
+   SeqLock_writeEnd(&pose_lock);
+}
+
+
+/*
+Update the pose with the encoder pulses counted since the previous update, and the rotation
+around the Z axis measured by the gyroscope since then (dyaw, in radians). 
+'tick' is the gpioTick() of the last sample, and dt the time since the previous update, in seconds.
+*/
+void Odometry_update(uint32_t tick, double dyaw, double dt)
+{
+uint32_t left, right;
+int left_dir, right_dir;
+int64_t dl, dr;
+double d, heading;
+
+   if (meters_per_pulse == 0) return;
+   getWheelEncoders(&left, &right, &left_dir, &right_dir);
+   if (!started) {  // The counters may not start at 0: the first update is the reference
+      last_tick = tick; last_left = left; last_right = right;
+      started = true;
+      return;
+   }
+   
+   dl = (int64_t)left_dir * (uint32_t)(left - last_left);
+   dr = (int64_t)right_dir * (uint32_t)(right - last_right);
+   last_left = left; last_right = right;
+   state.time += (uint32_t)(tick - last_tick);
+   last_tick = tick;
+   
+   state.left += dl;
+   state.right += dr;
+   d = (dl + dr)/2.0 * meters_per_pulse;
+   heading = state.heading*M_PI/180 + dyaw/2;  // Mean heading during the update
+   state.x += d*cos(heading);
+   state.y += d*sin(heading);
+   state.heading += dyaw*180/M_PI;
+   state.distance += fabs(d);
+   if (dt > 0) {
+      state.v += speed_alpha*(d/dt - state.v);
+      state.w = dyaw/dt*180/M_PI;
+   }
+   state.updates++;
+   
+   SeqLock_writeBegin(&pose_lock);
+   pose = state;
+   SeqLock_writeEnd(&pose_lock);
+}
+
+
+/* Consistent copy of the pose, from any thread. Returns -1 if the odometry was not initialized */
+int Odometry_get(Pose_t *p)
+{
+uint32_t seq;
+
+   do {
+      seq = SeqLock_readBegin(&pose_lock);
+      *p = pose;
+   } while (SeqLock_readRetry(&pose_lock, seq));
+   
+   if (meters_per_pulse == 0) ERR(-1, "Odometry not initialized");
+   return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef ODOMETRY_H
+#define ODOMETRY_H
+
+/*************************************************************************
+Dead reckoning odometry of the car: the distance comes from the wheel encoders,
+and the heading from the gyroscope. It is updated by the thread which reads the IMU,
+and read by any other thread with Odometry_get().
+The pose is relative to the position of the car when it was reset: X axis forwards,
+Y axis to the left, heading counterclockwise from the X axis (see imu.c).
+
+*****************************************************************************/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+typedef struct {
+  uint64_t time;           // Time of the pose since the reset, in us
+  double x, y;             // Position, in m
+  double heading;          // Heading, in degrees, counterclockwise; it is not wrapped to +-180
+  double v;                // Forward speed, in m/s, from the encoders
+  double w;                // Rotation rate, in dps, from the gyroscope
+  double distance;         // Distance travelled, in m, forwards or backwards
+  int64_t left, right;     // Signed encoder pulses of each wheel since the reset
+  uint32_t updates;        // Number of updates since the reset
+} Pose_t;
+
+
+void Odometry_init(double wheel_diameter, unsigned pulses_per_turn);
+void Odometry_reset(void);
+void Odometry_update(uint32_t tick, double dyaw, double dt);
+int Odometry_get(Pose_t *pose);
+
+
+#endif // ODOMETRY_H
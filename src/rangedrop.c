@@ -0,0 +1,56 @@
+/*************************************************************************
+
+Samples dropped after a switch of the full scale range of the IMU, see rangedrop.h.
+
+*****************************************************************************/
+
+#include <string.h>
+
+#include "rangedrop.h"
+
+
+
+void RangeDrop_init(RangeDrop_t *d)
+{
+   memset(d, 0, sizeof(*d));
+}
+
+
+/*
+The ranges were switched in this read, after counting the samples of the burst and before reading them.
+'samples' is the number of samples after the counted ones which must be dropped: those in the FIFO 
+after the switch which were not counted, and the next one.
+*/
+void RangeDrop_switched(RangeDrop_t *d, int samples)
+{
+   if (samples > d->pending) d->pending = samples;
+}
+
+
+/*
+Called once in each read, with the burst just read in buf and the time of each sample in dt.
+It drops the first samples of the burst which were taken before or during a switch of range done 
+in a previous read. Their time is added to the next sample (or to the first one of the next burst).
+Returns the number of samples left.
+*/
+int RangeDrop_apply(RangeDrop_t *d, char *buf, int samples, double *dt)
+{
+int n, i;
+
+   n = d->drop < samples ? d->drop : samples;
+   if (n > 0) {
+      for (i=0; i<n; i++) d->carry_dt += dt[i];
+      memmove(buf, buf + RANGEDROP_LINE*n, RANGEDROP_LINE*(samples-n));
+      memmove(dt, dt + n, (samples-n)*sizeof(double));
+      samples -= n;
+      d->drop -= n;
+   }
+   if (samples && d->carry_dt > 0) {
+      dt[0] += d->carry_dt;
+      d->carry_dt = 0;
+   }
+   // The samples of a switch in this read are at the start of the next bursts, as those still to drop
+   if (d->pending > d->drop) d->drop = d->pending;
+   d->pending = 0;
+   return samples;
+}
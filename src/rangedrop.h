@@ -0,0 +1,32 @@
+#ifndef RANGEDROP_H
+#define RANGEDROP_H
+
+/*************************************************************************
+Samples of the IMU FIFO which must be dropped after a switch of the full scale range (see
+set_range() in imu.c). The number of samples of a burst is read before switching the ranges,
+and the samples counted are read after it: they are all in the old ranges. The samples taken
+between counting and switching (in the old ranges, but they would be decoded in the new ones),
+and the one being taken during the switch (in an unknown range), are the first ones of the next
+bursts, so they are dropped then. Their time is added to the following sample.
+tools/range_test checks it with sequences of bursts through range switches.
+
+*****************************************************************************/
+
+#include <stdbool.h>
+
+
+#define RANGEDROP_LINE 12   // Bytes of each line of the FIFO: gyroscope and accelerometer, 3 axes each
+
+typedef struct {
+  int pending;        // Samples to drop because of the switch done in this read
+  int drop;           // Samples still to drop at the start of the next bursts
+  double carry_dt;    // Time of the dropped samples not yet added to a sample, in seconds
+} RangeDrop_t;
+
+
+void RangeDrop_init(RangeDrop_t *d);
+void RangeDrop_switched(RangeDrop_t *d, int samples);
+int RangeDrop_apply(RangeDrop_t *d, char *buf, int samples, double *dt);
+
+
+#endif // RANGEDROP_H
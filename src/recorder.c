@@ -0,0 +1,141 @@
+/*************************************************************************
+
+Recorder of raw IMU data. The real time thread which reads the IMU pushes the
+frames into a lock-free ring (see ring.h), which never blocks; if the ring is full,
+the frame is dropped and counted. A writer thread drains the ring periodically
+and writes the frames to the file, so no formatting or disk I/O is done in the
+real time thread.
+Recorder_start() and Recorder_stop() are called from any other thread (eg the wiimote one).
+
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "recorder.h"
+#include "ring.h"
+
+
+#define ERR(ret, format, arg...)                                       \
+   {                                                                   \
+         fprintf(stderr, "%s: " format "\n" , __func__ , ## arg);      \
+         return ret;                                                   \
+   }
+
+#define RING_FRAMES 4096   // Power of 2. About 14 seconds of data with ODR_AG=238 Hz, ODR_M=40 Hz
+#define WRITE_FRAMES 256   // Frames written to the file at a time
+#define WRITER_PERIOD 50   // Period of the writer thread, in ms
+
+static RecFrame_t ring_frames[RING_FRAMES];
+static Ring_t ring;
+
+static _Atomic bool active;        // The producer only pushes frames if true
+static _Atomic unsigned dropped;   // Frames lost because the ring was full
+static _Atomic bool running;       // Writer thread goes on while true
+static pthread_t writer_thread;
+static pthread_mutex_t control_mutex = PTHREAD_MUTEX_INITIALIZER;  // Serializes start and stop
+static FILE *rec_fp;
+static unsigned long written;
+
+
+/* Write all frames in the ring to the file. Returns false if the ring was empty */
+static bool drain(void)
+{
+RecFrame_t frames[WRITE_FRAMES];
+size_t n = 0;
+
+   while (n < WRITE_FRAMES && Ring_pop(&ring, &frames[n])) n++;
+   if (n == 0) return false;
+   if (fwrite(frames, sizeof(RecFrame_t), n, rec_fp) != n)
+      ERR(false, "Cannot write recording: %s", strerror(errno));
+   written += n;
+   return true;
+}
+
+
+static void* writer_loop(void *arg)
+{
+struct timespec period = {0, WRITER_PERIOD*1000000};
+
+   while (atomic_load(&running)) {
+      while (drain());
+      nanosleep(&period, NULL);
+   }
+   while (drain());  // Frames pushed before stopping
+   return NULL;
+}
+
+
+/* Open the file, write the header and start the writer thread. The frames pushed from now on are recorded */
+int Recorder_start(const char *filename, const RecHeader_t *header)
+{
+RecHeader_t h = *header;
+
+   pthread_mutex_lock(&control_mutex);
+   if (atomic_load(&active)) {
+      pthread_mutex_unlock(&control_mutex);
+      ERR(-1, "Already recording");
+   }
+   if (ring.data == NULL) Ring_init(&ring, ring_frames, RING_FRAMES, sizeof(RecFrame_t));
+   Ring_flush(&ring);  // Frames pushed after the last stop; the writer thread is not running, so this is the consumer
+
+   rec_fp = fopen(filename, "wb");
+   if (rec_fp == NULL) {
+      pthread_mutex_unlock(&control_mutex);
+      ERR(-1, "Cannot open file %s: %s", filename, strerror(errno));
+   }
+   memcpy(h.magic, REC_MAGIC, sizeof(h.magic));
+   h.version = REC_VERSION;
+   h.reserved = 0;
+   fwrite(&h, sizeof(h), 1, rec_fp);
+
+   written = 0;
+   atomic_store(&dropped, 0);
+   atomic_store(&running, true);
+   if (pthread_create(&writer_thread, NULL, writer_loop, NULL)) {
+      fclose(rec_fp);
+      rec_fp = NULL;
+      pthread_mutex_unlock(&control_mutex);
+      ERR(-1, "Cannot create recorder thread");
+   }
+   atomic_store_explicit(&active, true, memory_order_release);
+   pthread_mutex_unlock(&control_mutex);
+   return 0;
+}
+
+
+/* Stop recording: the writer thread writes the remaining frames and the file is closed */
+void Recorder_stop(void)
+{
+   pthread_mutex_lock(&control_mutex);
+   if (!atomic_load(&active)) {
+      pthread_mutex_unlock(&control_mutex);
+      return;
+   }
+   atomic_store_explicit(&active, false, memory_order_release);
+   atomic_store(&running, false);
+   pthread_join(writer_thread, NULL);
+   fclose(rec_fp);
+   rec_fp = NULL;
+   printf("Recording stopped: %lu frames written, %u dropped\n", written, atomic_load(&dropped));
+   pthread_mutex_unlock(&control_mutex);
+}
+
+
+bool Recorder_active(void)
+{
+   return atomic_load_explicit(&active, memory_order_acquire);
+}
+
+
+/* Called only from the thread which reads the IMU. It never blocks */
+void Recorder_push(const RecFrame_t *frame)
+{
+   if (!atomic_load_explicit(&active, memory_order_acquire)) return;
+   if (!Ring_push(&ring, frame)) atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+}
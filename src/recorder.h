@@ -0,0 +1,61 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+/*************************************************************************
+Recorder of raw IMU data into a binary file.
+The file has a header (RecHeader_t) followed by frames (RecFrame_t), both in the
+byte order of the Pi (little endian). Use tools/imu2csv to convert it to CSV.
+
+*****************************************************************************/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define REC_MAGIC "IMUREC"
+#define REC_VERSION 2
+
+/* Sensor setup and calibration when the recording started. The structure has no padding */
+typedef struct {
+  char magic[6];            // REC_MAGIC, without the terminating 0
+  uint16_t version;         // REC_VERSION
+  float odr_ag, odr_m;      // ODR of accel/gyro and of magnetometer, in Hz
+  float aRes, gRes, mRes;   // Resolution of accelerometer (g/LSB), gyroscope (dps/LSB) and magnetometer (G/LSB)
+  int16_t err_AL[3];        // Accelerometer offset
+  int16_t reserved;
+  float bias_GY[3];         // Gyroscope bias
+  float mag_center[3];      // Magnetometer hardiron offset
+  float mag_matrix[3][3];   // Magnetometer inverse softiron matrix
+} RecHeader_t;
+
+enum {REC_FRAME_AG, REC_FRAME_M};
+
+/*
+A raw sample of accel/gyro (gx, gy, gz, ax, ay, az) or of magnetometer (mx, my, mz, 0, 0, 0),
+with the axis already aligned with the car (X forwards, Y to the left).
+The accel/gyro samples of a FIFO burst share the tick of the read; index and count
+give the position of the sample in the burst. The values are raw counts of the full scale 
+range given by 'range'; multiply them by rec_accel_mult and rec_gyro_mult to get counts 
+of the lowest range, which is the one of aRes and gRes in the header.
+*/
+typedef struct {
+  uint32_t tick;     // gpioTick() when the sample was read, in microseconds
+  uint8_t type;      // REC_FRAME_AG or REC_FRAME_M
+  uint8_t index;     // Position of the sample in the FIFO burst
+  uint8_t count;     // Samples in the FIFO burst
+  uint8_t range;     // Bits 0-1: range of the accelerometer, bits 2-3: range of the gyroscope
+  int16_t v[6];
+} RecFrame_t;
+
+/* Ratio of the sensitivity of each range to the lowest one: 2, 4, 8, 16 g and 245, 500, 2000 dps */
+static const int rec_accel_mult[] = {1, 2, 4, 12};
+static const int rec_gyro_mult[] = {1, 2, 8};
+
+
+int Recorder_start(const char *filename, const RecHeader_t *header);
+void Recorder_stop(void);
+bool Recorder_active(void);
+void Recorder_push(const RecFrame_t *frame);
+
+
+#endif // RECORDER_H
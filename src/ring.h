@@ -0,0 +1,74 @@
+#ifndef RING_H
+#define RING_H
+
+/*************************************************************************
+Lock-free ring buffer for a single producer and a single consumer thread.
+The elements have a fixed size and are copied in and out of the ring.
+The producer only writes head, the consumer only writes tail; the number of
+elements must be a power of 2, so the indexes can wrap around freely.
+No function blocks, so the producer can be a real time callback.
+
+*****************************************************************************/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+
+
+typedef struct {
+  _Atomic uint32_t head;  // Next element to write, only changed by the producer
+  _Atomic uint32_t tail;  // Next element to read, only changed by the consumer
+  uint32_t mask;          // Number of elements - 1
+  uint32_t elem_size;
+  char *data;             // (mask+1)*elem_size bytes, provided by the user
+} Ring_t;
+
+
+// num_elems must be a power of 2; data must have room for num_elems*elem_size bytes
+static inline int Ring_init(Ring_t *r, void *data, uint32_t num_elems, uint32_t elem_size)
+{
+   if (num_elems == 0 || (num_elems & (num_elems-1)) || data == NULL) return -1;
+   atomic_init(&r->head, 0);
+   atomic_init(&r->tail, 0);
+   r->mask = num_elems - 1;
+   r->elem_size = elem_size;
+   r->data = data;
+   return 0;
+}
+
+
+// Producer side. Returns false if the ring is full, the element is not stored
+static inline bool Ring_push(Ring_t *r, const void *elem)
+{
+uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+   if (head - tail > r->mask) return false;
+   memcpy(r->data + (head & r->mask)*r->elem_size, elem, r->elem_size);
+   atomic_store_explicit(&r->head, head+1, memory_order_release);
+   return true;
+}
+
+
+// Consumer side. Returns false if the ring is empty
+static inline bool Ring_pop(Ring_t *r, void *elem)
+{
+uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+   if (head == tail) return false;
+   memcpy(elem, r->data + (tail & r->mask)*r->elem_size, r->elem_size);
+   atomic_store_explicit(&r->tail, tail+1, memory_order_release);
+   return true;
+}
+
+
+// Consumer side. Discard all the elements in the ring
+static inline void Ring_flush(Ring_t *r)
+{
+   atomic_store_explicit(&r->tail, atomic_load_explicit(&r->head, memory_order_acquire), memory_order_release);
+}
+
+
+#endif // RING_H
@@ -6,8 +6,17 @@ robot.h
 #ifndef ROBOT_H
 #define ROBOT_H
 
+#include <stdint.h>
+#include <stdbool.h>
+
 
 void closedown(void);
 
+// State of the motors, used by other modules (eg imu.c) to know if the car is stopped
+uint32_t getEncoderPulses(void);
+void getWheelEncoders(uint32_t *left, uint32_t *right, int *left_dir, int *right_dir);
+bool motorsStopped(void);
+void stopMotors(void);
+
 
 #endif
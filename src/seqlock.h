@@ -0,0 +1,60 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+/*************************************************************************
+Sequence lock, to publish a record written by a single thread and read by any number of threads.
+The writer never waits: it makes the sequence number odd, writes the record and makes it even again.
+A reader copies the record and checks that the sequence number was even and did not change
+during the copy; otherwise it copies it again. Readers do not modify anything, so they do not
+disturb the writer nor each other.
+
+Writer:                           Reader:
+   SeqLock_writeBegin(&lock);        do {
+   record = ...;                        seq = SeqLock_readBegin(&lock);
+   SeqLock_writeEnd(&lock);             copy = record;
+                                     } while (SeqLock_readRetry(&lock, seq));
+
+*****************************************************************************/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+
+typedef struct {
+  _Atomic uint32_t seq;   // Odd while the record is being written
+} SeqLock_t;
+
+
+static inline void SeqLock_writeBegin(SeqLock_t *s)
+{
+   atomic_store_explicit(&s->seq, atomic_load_explicit(&s->seq, memory_order_relaxed) + 1, memory_order_relaxed);
+   atomic_thread_fence(memory_order_release);  // The record is not written before seq is odd
+}
+
+
+static inline void SeqLock_writeEnd(SeqLock_t *s)
+{
+   atomic_store_explicit(&s->seq, atomic_load_explicit(&s->seq, memory_order_relaxed) + 1, memory_order_release);
+}
+
+
+// Returns the sequence number to be passed to SeqLock_readRetry(). It spins while the writer is writing
+static inline uint32_t SeqLock_readBegin(const SeqLock_t *s)
+{
+uint32_t seq;
+
+   while ((seq = atomic_load_explicit(&((SeqLock_t *)s)->seq, memory_order_acquire)) & 1) ;
+   return seq;
+}
+
+
+// True if the record read since SeqLock_readBegin() may be inconsistent, and must be read again
+static inline bool SeqLock_readRetry(const SeqLock_t *s, uint32_t seq)
+{
+   atomic_thread_fence(memory_order_acquire);  // The record is read before seq is checked again
+   return atomic_load_explicit(&((SeqLock_t *)s)->seq, memory_order_relaxed) != seq;
+}
+
+
+#endif // SEQLOCK_H
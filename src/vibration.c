@@ -0,0 +1,249 @@
+/*************************************************************************
+
+Streaming spectrum analysis of the accelerometer samples. The real time thread which 
+reads the IMU pushes each sample into a lock-free ring (see ring.h), which never blocks;
+if the ring is full, the sample is dropped and counted. A low priority thread drains 
+the ring into a sliding window of VIB_WINDOW samples and, every VIB_HOP new samples, 
+computes the power spectrum of each axis with a Hann window and a radix-2 real FFT, 
+in place and in float. The spectra of the 3 axis are added, so the result does not depend 
+on the orientation of the car. The energy of each band is published under a seqlock.
+With ODR=238 Hz, the resolution is 0.9 Hz and the spectrum is published at 3.7 Hz.
+
+*****************************************************************************/
+
+#define _GNU_SOURCE   // SCHED_IDLE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <complex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#include "vibration.h"
+#include "ring.h"
+#include "seqlock.h"
+
+
+#define ERR(ret, format, arg...)                                       \
+   {                                                                   \
+         fprintf(stderr, "%s: " format "\n" , __func__ , ## arg);      \
+         return ret;                                                   \
+   }
+
+#define VIB_WINDOW 256      // Samples of the FFT window, power of 2
+#define VIB_HOP 64          // New samples between spectra
+#define RING_SAMPLES 1024   // Power of 2. About 4 seconds of data with ODR=238 Hz
+#define ANALYSIS_PERIOD 100 // Period of the analysis thread, in ms
+
+/* Edges of the bands, in Hz. The last band ends at the Nyquist frequency */
+static const double vib_band_edges[VIB_BANDS] = {1, 5, 10, 20, 40, 80};
+
+typedef struct {
+   float a[3];
+} VibSample_t;
+
+static VibSample_t ring_samples[RING_SAMPLES];
+static Ring_t ring;
+
+static _Atomic bool active;        // The producer only pushes samples if true
+static _Atomic unsigned dropped;   // Samples lost because the ring was full
+static _Atomic bool running;       // Analysis thread goes on while true
+static pthread_t analysis_thread;
+static double sample_rate;
+
+static float window[3][VIB_WINDOW];   // Last samples of each axis, circular with window_pos
+static unsigned window_pos, window_fill, new_samples;
+static float hann[VIB_WINDOW];
+static float complex fft_buf[VIB_WINDOW/2];
+static float complex twiddle[VIB_WINDOW/2];  // exp(-2*pi*i*k/VIB_WINDOW)
+
+static SeqLock_t result_lock;
+static Vibration_t result;   // Published with result_lock
+
+
+/* In place radix-2 complex FFT of n points (power of 2). tw has the twiddles of a 2*n points FFT */
+static void fft(float complex *x, unsigned n, const float complex *tw)
+{
+unsigned i, j, k, len, step;
+float complex t, u, w;
+
+   for (i=1, j=0; i<n; i++) {  // Bit reversal permutation
+      k = n>>1;
+      for (; j&k; k>>=1) j ^= k;
+      j ^= k;
+      if (i < j) {
+         t = x[i]; x[i] = x[j]; x[j] = t;
+      }
+   }
+   for (len=2; len<=n; len<<=1) {
+      step = 2*n/len;
+      for (i=0; i<n; i+=len)
+         for (k=0; k<len/2; k++) {
+            w = tw[k*step];
+            u = x[i+k];
+            t = w*x[i+k+len/2];
+            x[i+k] = u + t;
+            x[i+k+len/2] = u - t;
+         }
+   }
+}
+
+
+/*
+Add the power spectrum |X[k]|^2, k=0..N/2, of the N real samples of one axis to 'power'.
+The N real samples are packed as N/2 complex ones (even samples real, odd samples imaginary),
+transformed with an N/2 points FFT, and the spectrum of the real signal is separated afterwards.
+*/
+static void add_power_spectrum(const float *x, float *power)
+{
+const unsigned N = VIB_WINDOW, M = VIB_WINDOW/2;
+unsigned k;
+float mean = 0;
+float complex zk, zm, e, o;
+
+   for (k=0; k<N; k++) mean += x[(window_pos+k)%N];
+   mean /= N;
+   for (k=0; k<M; k++) 
+      fft_buf[k] = (x[(window_pos+2*k)%N] - mean)*hann[2*k] + I*(x[(window_pos+2*k+1)%N] - mean)*hann[2*k+1];
+   fft(fft_buf, M, twiddle);
+   
+   for (k=0; k<=M; k++) {
+      zk = fft_buf[k%M];
+      zm = conjf(fft_buf[(M-k)%M]);
+      e = (zk + zm)/2;            // Spectrum of the even samples
+      o = -I*(zk - zm)/2;         // Spectrum of the odd samples
+      if (k < M) zk = e + twiddle[k]*o;
+      else zk = e - o;            // twiddle[M] would be -1
+      power[k] += crealf(zk)*crealf(zk) + cimagf(zk)*cimagf(zk);
+   }
+}
+
+
+/* Compute the spectrum of the window and publish the energy of the bands */
+static void analyse(void)
+{
+static float power[VIB_WINDOW/2+1];
+const unsigned N = VIB_WINDOW;
+unsigned k, b;
+double f, df = sample_rate/N, w2 = 0, scale, e, peak = 0;
+Vibration_t r;
+
+   memset(power, 0, sizeof(power));
+   for (k=0; k<3; k++) add_power_spectrum(window[k], power);
+   
+   /* By Parseval, the mean square of the windowed signal is sum(|X|^2)/N^2; the one sided 
+      spectrum counts twice the bins between DC and Nyquist. The window power is compensated */
+   for (k=0; k<N; k++) w2 += hann[k]*hann[k];
+   scale = 1.0/(N*w2);
+   
+   memset(&r, 0, sizeof(r));
+   r.odr = sample_rate;
+   for (b=0; b<VIB_BANDS; b++) r.edges[b] = vib_band_edges[b];
+   r.edges[VIB_BANDS] = sample_rate/2;
+   for (k=1; k<=N/2; k++) {
+      f = k*df;
+      e = (k < N/2 ? 2 : 1) * power[k]*scale;
+      r.total += e;
+      if (e > peak) {
+         peak = e;
+         r.peak = f;
+      }
+      for (b=0; b<VIB_BANDS; b++) 
+         if (f >= r.edges[b] && f < r.edges[b+1]) r.band[b] += e;
+   }
+   
+   SeqLock_writeBegin(&result_lock);
+   r.windows = result.windows + 1;
+   result = r;
+   SeqLock_writeEnd(&result_lock);
+}
+
+
+static void* analysis_loop(void *arg)
+{
+struct timespec period = {0, ANALYSIS_PERIOD*1000000};
+struct sched_param param = {0};
+VibSample_t s;
+int i;
+
+   pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);  // Only when the CPU has nothing else to do
+   while (atomic_load(&running)) {
+      while (Ring_pop(&ring, &s)) {
+         for (i=0; i<3; i++) window[i][window_pos] = s.a[i];
+         window_pos = (window_pos + 1) % VIB_WINDOW;  // Now the oldest sample
+         if (window_fill < VIB_WINDOW) window_fill++;
+         if (++new_samples >= VIB_HOP && window_fill == VIB_WINDOW) {
+            new_samples = 0;
+            analyse();
+         }
+      }
+      nanosleep(&period, NULL);
+   }
+   return NULL;
+}
+
+
+/* Start the analysis of the samples pushed from now on, taken at 'odr' Hz */
+int Vibration_start(double odr)
+{
+unsigned k;
+
+   if (atomic_load(&active)) ERR(-1, "Vibration analysis already started");
+   if (odr/2 <= vib_band_edges[VIB_BANDS-1]) ERR(-1, "ODR too low for the vibration bands: %.1f Hz", odr);
+   if (ring.data == NULL) Ring_init(&ring, ring_samples, RING_SAMPLES, sizeof(VibSample_t));
+   Ring_flush(&ring);
+   
+   sample_rate = odr;
+   for (k=0; k<VIB_WINDOW; k++) hann[k] = 0.5 - 0.5*cos(2*M_PI*k/VIB_WINDOW);
+   for (k=0; k<VIB_WINDOW/2; k++) twiddle[k] = cexpf(-2*I*(float)M_PI*k/VIB_WINDOW);
+   window_pos = window_fill = new_samples = 0;
+   memset(&result, 0, sizeof(result));
+   atomic_store(&dropped, 0);
+   
+   atomic_store(&running, true);
+   if (pthread_create(&analysis_thread, NULL, analysis_loop, NULL)) ERR(-1, "Cannot create vibration analysis thread");
+   atomic_store_explicit(&active, true, memory_order_release);
+   return 0;
+}
+
+
+void Vibration_stop(void)
+{
+   if (!atomic_load(&active)) return;
+   atomic_store_explicit(&active, false, memory_order_release);
+   atomic_store(&running, false);
+   pthread_join(analysis_thread, NULL);
+   printf("Vibration analysis: %u spectra, %u samples dropped\n", result.windows, atomic_load(&dropped));
+}
+
+
+bool Vibration_active(void)
+{
+   return atomic_load_explicit(&active, memory_order_acquire);
+}
+
+
+/* Called only from the thread which reads the IMU, with the acceleration in g. It never blocks */
+void Vibration_push(float ax, float ay, float az)
+{
+VibSample_t s = {{ax, ay, az}};
+
+   if (!atomic_load_explicit(&active, memory_order_acquire)) return;
+   if (!Ring_push(&ring, &s)) atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+}
+
+
+/* Consistent copy of the last spectrum, from any thread. Returns -1 if there is none yet */
+int Vibration_get(Vibration_t *v)
+{
+uint32_t seq;
+
+   do {
+      seq = SeqLock_readBegin(&result_lock);
+      *v = result;
+   } while (SeqLock_readRetry(&result_lock, seq));
+   return v->windows ? 0 : -1;
+}
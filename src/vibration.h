@@ -0,0 +1,35 @@
+#ifndef VIBRATION_H
+#define VIBRATION_H
+
+/*************************************************************************
+Streaming spectrum analysis of the vibration measured by the accelerometer,
+to detect the type of terrain, wheel imbalance or motor faults.
+The thread which reads the IMU only pushes the samples into a lock-free ring;
+a low priority thread computes the spectrum and publishes the energy of each band.
+
+*****************************************************************************/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define VIB_BANDS 6   // Number of frequency bands, see vib_band_edges in vibration.c
+
+typedef struct {
+  uint32_t windows;          // Number of windows analysed, it increases with each spectrum
+  double odr;                // Sample rate of the accelerometer, in Hz
+  double band[VIB_BANDS];    // Energy (mean square of the acceleration) in each band, in g^2
+  double edges[VIB_BANDS+1]; // Frequency edges of the bands, in Hz
+  double peak;               // Frequency of the strongest component, in Hz
+  double total;              // Energy of all components, except DC, in g^2
+} Vibration_t;
+
+
+int Vibration_start(double odr);
+void Vibration_stop(void);
+bool Vibration_active(void);
+void Vibration_push(float ax, float ay, float az);
+int Vibration_get(Vibration_t *v);
+
+
+#endif // VIBRATION_H
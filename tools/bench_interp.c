@@ -0,0 +1,142 @@
+/*************************************************************************
+
+Benchmark of the upsampling of magnetometer data done in imuRead().
+It compares the zero-stuffing FIR filter (Filter_t) with the polyphase
+interpolator (Interpolator_t), for all the ODR_AG/ODR_M combinations
+the interpolating filter is designed for.
+Each FIFO batch has 'upsampling factor' samples, and both X, Y and Z are filtered.
+The outputs of both methods are also compared, they must be equal.
+
+Usage: bench_interp [-n batches] [-f cpu_MHz]
+If the CPU frequency is not given, it is read from sysfs (if possible) to show cycles.
+
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+
+#include "filter.h"
+
+extern char *optarg;
+
+
+static const struct {
+   double odr_m, odr_ag;
+} combinations[] = {
+   {80, 476}, {80, 238}, {40, 238}, {40, 119}, {20, 119}, {20, 59.5}, {10, 59.5}
+};
+
+#define NTAPS (sizeof(LP_20_240_filter_taps)/sizeof(double))
+
+
+static double elapsed_ns(const struct timespec *t0, const struct timespec *t1)
+{
+   return (t1->tv_sec - t0->tv_sec)*1E9 + (t1->tv_nsec - t0->tv_nsec);
+}
+
+
+static double read_cpu_mhz(void)
+{
+FILE *fp;
+long khz;
+
+   fp = fopen("/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq", "r");
+   if (!fp) return 0;
+   if (fscanf(fp, "%ld", &khz) != 1) khz = 0;
+   fclose(fp);
+   return khz/1000.0;
+}
+
+
+int main(int argc, char *argv[])
+{
+int c, i, n, k, factor, batches = 20000;
+double mhz = 0, in[3], out_fir[3], out_pol[3], max_diff, ns_fir, ns_pol, sink = 0;
+double taps[NTAPS];
+struct timespec t0, t1;
+Filter_t fir[3];
+Interpolator_t pol[3];
+double *input;
+
+   while ((c = getopt(argc, argv, "n:f:")) != -1)
+      switch (c) {
+         case 'n': batches = atoi(optarg); break;
+         case 'f': mhz = atof(optarg); break;
+         default:
+            fprintf(stderr, "Usage: %s [-n batches] [-f cpu_MHz]\n", argv[0]);
+            exit(1);
+      }
+   if (batches <= 0) batches = 1;
+   if (mhz == 0) mhz = read_cpu_mhz();
+
+   /* Magnetometer input values, one per FIFO batch and axis */
+   input = malloc(3*batches*sizeof(double));
+   if (!input) exit(1);
+   srand(1);
+   for (i = 0; i < 3*batches; i++) input[i] = 0.5*rand()/RAND_MAX - 0.25;  // Gauss
+
+   printf("ODR_M  ODR_AG  factor   FIR ns/batch  polyphase ns/batch  speedup  max diff");
+   printf(mhz>0 ? "   FIR cycles  polyphase cycles\n" : "\n");
+
+   for (c = 0; c < sizeof(combinations)/sizeof(combinations[0]); c++) {
+      factor = lround(combinations[c].odr_ag/combinations[c].odr_m);
+
+      /* Zero-stuffing FIR, as it was done in imuRead(). Taps are copied, as setDCgain modifies them */
+      for (i = 0; i < NTAPS; i++) taps[i] = LP_20_240_filter_taps[i];
+      for (k = 0; k < 3; k++) LPFilter_init(&fir[k], taps, NTAPS);
+      LPFilter_setDCgain(&fir[0], factor);
+      for (k = 0; k < 3; k++) Interpolator_init(&pol[k], LP_20_240_filter_taps, NTAPS, factor);
+
+      /* Check that both give the same output */
+      max_diff = 0;
+      for (n = 0; n < batches; n++) {
+         for (i = 0; i < factor; i++) {
+            for (k = 0; k < 3; k++) {
+               LPFilter_put(&fir[k], i==0 ? input[3*n+k] : 0);
+               out_fir[k] = LPFilter_get(&fir[k]);
+               out_pol[k] = Interpolator_get(&pol[k], input[3*n+k]);
+               if (fabs(out_fir[k]-out_pol[k]) > max_diff) max_diff = fabs(out_fir[k]-out_pol[k]);
+            }
+         }
+      }
+
+      /* Time zero-stuffing FIR */
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      for (n = 0; n < batches; n++) {
+         for (i = 0; i < factor; i++) {
+            for (k = 0; k < 3; k++) in[k] = i==0 ? input[3*n+k] : 0;
+            LPFilter_put(&fir[0], in[0]); LPFilter_put(&fir[1], in[1]); LPFilter_put(&fir[2], in[2]);
+            sink += LPFilter_get(&fir[0]) + LPFilter_get(&fir[1]) + LPFilter_get(&fir[2]);
+         }
+      }
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      ns_fir = elapsed_ns(&t0, &t1)/batches;
+
+      /* Time polyphase interpolator */
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      for (n = 0; n < batches; n++) {
+         for (i = 0; i < factor; i++) {
+            sink += Interpolator_get(&pol[0], input[3*n]) + Interpolator_get(&pol[1], input[3*n+1]) +
+                    Interpolator_get(&pol[2], input[3*n+2]);
+         }
+      }
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      ns_pol = elapsed_ns(&t0, &t1)/batches;
+
+      printf("%5.1f  %6.1f  %6d  %13.0f  %18.0f  %7.2f  %8.1e", combinations[c].odr_m, combinations[c].odr_ag,
+             factor, ns_fir, ns_pol, ns_fir/ns_pol, max_diff);
+      if (mhz > 0) printf("  %11.0f  %16.0f", ns_fir*mhz/1000, ns_pol*mhz/1000);
+      printf("\n");
+
+      for (k = 0; k < 3; k++) {
+         LPFilter_close(&fir[k]);
+         Interpolator_close(&pol[k]);
+      }
+   }
+
+   free(input);
+   return sink == 0.12345;  // Use result, so that the compiler does not remove the loops
+}
@@ -0,0 +1,165 @@
+/*************************************************************************
+
+Test of the software collision detector of the IMU (src/collision.c) with synthetic signals,
+for all the combinations of ODRs of the accelerometer (119 Hz and above) and of the magnetometer
+(the FIFO is read once per magnetometer sample) which setupLSM9DS1() accepts.
+The input is the acceleration without gravity, with white noise, as imu.c gives it to the detector.
+
+Impacts (half sines, from several directions, with several phases with respect to the reads):
+the interrupt generator of the accelerometer is assumed to fire at the start of the impact, as
+the earliest case. Each impact must be detected once, within Collision_latency() of its start,
+in the read which confirms the interrupt within Collision_confirmTime() (see confirm_collision() 
+in imu.c), and the direction must be right.
+The weakest impact is the threshold of the interrupt generator, 1 g during 20 ms.
+Other signals must not be detected: noise alone, a vertical bump, and a smooth acceleration of the car.
+Lower ODRs are not tested, their samples are too far apart to see an impact of 20 ms.
+
+Usage: collision_test [-v]
+With -v, it prints the delay of each detection. The exit status is 0 if all the tests pass.
+
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "collision.h"
+
+
+static const double odr_ag_modes[] = {119, 238, 476, 952};
+static const double odr_m_modes[] = {0.625, 1.25, 2.5, 5, 10, 20, 40, 80};
+#define FIFO_LINES 32
+#define NUM(a) ((int)(sizeof(a)/sizeof(a[0])))
+
+static const double noise = 0.02;   // Standard deviation of the noise, in g
+
+static const struct {
+   double peak, width;   // In g and seconds
+} impacts[] = {{1.0, 0.020}, {2.0, 0.020}, {1.0, 0.050}, {4.0, 0.010}};
+static const double directions[] = {0, 45, 90, -90, 135, 180, -150};
+
+typedef enum {SIGNAL_IMPACT, SIGNAL_NOISE, SIGNAL_BUMP, SIGNAL_SPEED_UP} Signal_t;
+static const char *signal_names[] = {"impact", "noise", "vertical bump", "smooth acceleration"};
+
+static bool verbose;
+
+
+static double gaussian(void)
+{
+double u1 = (rand() + 1.0)/(RAND_MAX + 2.0), u2 = (rand() + 1.0)/(RAND_MAX + 2.0);
+
+   return sqrt(-2*log(u1))*cos(2*M_PI*u2);
+}
+
+
+static double half_sine(double t, double peak, double width)
+{
+   return t >= 0 && t < width ? peak*sin(M_PI*t/width) : 0;
+}
+
+
+/*
+Run the detector over 3 seconds of a signal, reading it in bursts of 'factor' samples.
+The event starts at t0. Returns the number of collisions detected, in 'late' whether the first one
+was detected after the latency of the detector, and in 'confirmed' whether it was seen in a read 
+within the confirm time after t0
+*/
+static int run(double odr, int factor, Signal_t signal, double t0, double peak, double width, double dir,
+               bool *late, bool *confirmed, double *direction)
+{
+Collision_t c;
+double a[3], t, v, confirm;
+long n, num = lround(3*odr);
+int detections = 0;
+bool last = false, seen = false;
+
+   if (Collision_init(&c, odr) < 0) exit(1);
+   c.armed = true;
+   confirm = Collision_confirmTime(&c, factor/odr);
+   *confirmed = *late = false;
+   for (n = 0; n < num; n++) {
+      t = n/odr;
+      a[0] = noise*gaussian(); a[1] = noise*gaussian(); a[2] = noise*gaussian();
+      switch (signal) {
+         case SIGNAL_IMPACT:  // The acceleration is opposite to the direction of the impact
+            v = half_sine(t - t0, peak, width);
+            a[0] -= v*cos(dir*M_PI/180);
+            a[1] -= v*sin(dir*M_PI/180);
+            break;
+         case SIGNAL_BUMP:
+            a[2] += half_sine(t - t0, 2.0, 0.020);
+            a[0] += half_sine(t - t0, 0.3, 0.020);
+            break;
+         case SIGNAL_SPEED_UP:
+            a[0] += half_sine(t - t0, 0.4, 1.0);
+            break;
+         case SIGNAL_NOISE:
+            break;
+      }
+      Collision_update(&c, a, 1/odr);
+      if (c.active && !last && ++detections == 1) *late = t - t0 > Collision_latency(&c);
+      last = c.active;
+      // End of a burst: the read which could confirm the interrupt
+      if ((n+1) % factor == 0 && detections == 1 && !seen) {
+         seen = true;
+         *confirmed = t - t0 < confirm;
+         if (verbose) printf("   detected in the read %.1f ms after the impact (confirm time %.1f ms)\n",
+                             (t - t0)*1000, confirm*1000);
+      }
+   }
+   *direction = c.direction;
+   Collision_close(&c);
+   return detections;
+}
+
+
+int main(int argc, char *argv[])
+{
+int c, i, j, k, m, phase, factor, detections, tests = 0, failures = 0;
+double odr, t0, dir;
+bool late, confirmed;
+Signal_t s;
+
+   while ((c = getopt(argc, argv, "v")) != -1)
+      switch (c) {
+         case 'v': verbose = true; break;
+         default:
+            fprintf(stderr, "Usage: %s [-v]\n", argv[0]);
+            exit(1);
+      }
+   srand(1);
+
+   for (i = 0; i < NUM(odr_ag_modes); i++)
+      for (m = 0; m < NUM(odr_m_modes); m++) {
+         odr = odr_ag_modes[i];
+         factor = lround(odr/odr_m_modes[m]);
+         if (factor >= FIFO_LINES || fabs(odr/(odr_m_modes[m]*factor) - 1) > 0.01) continue;  // As setupLSM9DS1()
+         printf("ODR %g Hz, read every %d samples (%.1f ms)\n", odr, factor, factor/odr*1000);
+         for (j = 0; j < NUM(impacts); j++)
+            for (k = 0; k < NUM(directions); k++)
+               for (phase = 0; phase < 4; phase++) {
+                  t0 = 1 + phase*factor/(4*odr);
+                  detections = run(odr, factor, SIGNAL_IMPACT, t0, impacts[j].peak, impacts[j].width, directions[k], &late, &confirmed, &dir);
+                  tests++;
+                  if (detections != 1 || late || !confirmed || fabs(remainder(dir - directions[k], 360)) > 15) {
+                     failures++;
+                     printf("   FAILED: impact of %g g during %g ms from %g degrees: %d detections%s, %s, direction %.0f degrees\n",
+                            impacts[j].peak, impacts[j].width*1000, directions[k], detections, late ? " (late)" : "",
+                            confirmed ? "confirmed" : "not confirmed", dir);
+                  }
+               }
+         for (s = SIGNAL_NOISE; s <= SIGNAL_SPEED_UP; s++) {
+            detections = run(odr, factor, s, 1, 0, 0, 0, &late, &confirmed, &dir);
+            tests++;
+            if (detections != 0) {
+               failures++;
+               printf("   FAILED: %s: %d detections\n", signal_names[s], detections);
+            }
+         }
+      }
+
+   printf("%d tests, %d failed\n", tests, failures);
+   return failures ? 1 : 0;
+}
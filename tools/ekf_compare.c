@@ -0,0 +1,213 @@
+/*************************************************************************
+
+Comparison of the double (ekf.c) and single precision (ekf32.c) versions of the DCM EKF,
+on a recording of raw IMU data (imu_XXXXXX.rec, see src/recorder.h).
+Both filters are run over all the accel/gyro samples of the recording. It shows the difference
+of the attitude they estimate (maximum and RMS, in degrees), and the time of an update,
+with the CPU load it would take to run the filter at the ODR of the LSM9DS1.
+The time of each sample is taken from the recording, as in imu2csv.
+
+Usage: ekf_compare [-n runs] [-f cpu_MHz] imu_XXXXXX.rec
+The filters are run 'runs' times to measure the time. If the CPU frequency is not given,
+it is read from sysfs (if possible) to show cycles.
+
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+
+#include "recorder.h"
+#include "ekf.h"
+#include "ekf32.h"
+
+extern char *optarg;
+extern int optind;
+
+
+/* Calibrated accel/gyro samples of the recording */
+typedef struct {
+   float g[3];   // Gyroscope, in rad/s
+   float a[3];   // Accelerometer, in m/s^2
+   float dt;     // Time since the previous sample, in s
+} Sample_t;
+
+
+static double elapsed_ns(const struct timespec *t0, const struct timespec *t1)
+{
+   return (t1->tv_sec - t0->tv_sec)*1E9 + (t1->tv_nsec - t0->tv_nsec);
+}
+
+
+static double read_cpu_mhz(void)
+{
+FILE *fp;
+long khz;
+
+   fp = fopen("/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq", "r");
+   if (!fp) return 0;
+   if (fscanf(fp, "%ld", &khz) != 1) khz = 0;
+   fclose(fp);
+   return khz/1000.0;
+}
+
+
+/* Read the accel/gyro samples of a recording. Returns the number of samples, or -1 */
+static long read_recording(const char *file, RecHeader_t *h, Sample_t **samples)
+{
+FILE *fp;
+RecFrame_t f;
+Sample_t *s = NULL, *p;
+long n = 0, size = 0;
+int i, am, gm;
+bool first = true;
+uint32_t tick0 = 0;
+double t, t_prev = 0;
+
+   fp = fopen(file, "rb");
+   if (!fp) {
+      fprintf(stderr, "Cannot open file %s\n", file);
+      return -1;
+   }
+   if (fread(h, sizeof(*h), 1, fp) != 1 || memcmp(h->magic, REC_MAGIC, sizeof(h->magic))) {
+      fprintf(stderr, "%s is not an IMU recording\n", file);
+      fclose(fp);
+      return -1;
+   }
+   if (h->version != REC_VERSION && h->version != 1) {  // Version 1 had no ranges, its samples are in the lowest one
+      fprintf(stderr, "Unsupported version %d of recording %s\n", h->version, file);
+      fclose(fp);
+      return -1;
+   }
+
+   while (fread(&f, sizeof(f), 1, fp) == 1) {
+      if (f.type != REC_FRAME_AG) continue;
+      if (first) {
+         tick0 = f.tick;
+         first = false;
+      }
+      t = (uint32_t)(f.tick - tick0)/1E6 - (f.count - 1 - f.index)/h->odr_ag;
+      if (n == size) {
+         size = size? 2*size : 4096;
+         s = realloc(s, size*sizeof(Sample_t));
+         if (!s) {
+            fprintf(stderr, "Not enough memory\n");
+            fclose(fp);
+            return -1;
+         }
+      }
+      p = &s[n];
+      am = rec_accel_mult[f.range&0x03];
+      gm = rec_gyro_mult[(f.range>>2)%3];
+      for (i=0; i<3; i++) {
+         p->g[i] = (gm*f.v[i] - h->bias_GY[i])*h->gRes*M_PI/180;
+         p->a[i] = (am*f.v[i+3] - h->err_AL[i])*h->aRes*EKF_GRAVITY;
+      }
+      p->dt = (n == 0 || t <= t_prev)? 1/h->odr_ag : t - t_prev;  // Use the ODR if the tick is not monotonic
+      t_prev = t;
+      n++;
+   }
+   fclose(fp);
+   *samples = s;
+   return n;
+}
+
+
+static double angle_diff(double a, double b)
+{
+   return remainder(a - b, 360);
+}
+
+
+int main(int argc, char *argv[])
+{
+int c, i, k, runs = 10;
+long n, num;
+double mhz = 0, ns_d, ns_f, d, max_d[3] = {0}, sum_d[3] = {0}, ang_d[3], ang_f[3], sink = 0;
+const char *file;
+RecHeader_t h;
+Sample_t *s;
+EKF_t ekf;
+EKF32_t ekf32;
+struct timespec t0, t1;
+
+   while ((c = getopt(argc, argv, "n:f:")) != -1)
+      switch (c) {
+         case 'n': runs = atoi(optarg); break;
+         case 'f': mhz = atof(optarg); break;
+         default:
+            fprintf(stderr, "Usage: %s [-n runs] [-f cpu_MHz] imu_XXXXXX.rec\n", argv[0]);
+            exit(1);
+      }
+   if (optind >= argc || runs < 1) {
+      fprintf(stderr, "Usage: %s [-n runs] [-f cpu_MHz] imu_XXXXXX.rec\n", argv[0]);
+      exit(1);
+   }
+   file = argv[optind];
+   num = read_recording(file, &h, &s);
+   if (num < 0) exit(1);
+   if (num == 0) {
+      fprintf(stderr, "%s has no accel/gyro samples\n", file);
+      exit(1);
+   }
+   if (mhz == 0) mhz = read_cpu_mhz();
+   printf("%ld accel/gyro samples at %.1f Hz\n", num, h.odr_ag);
+
+   /* Accuracy: both filters side by side */
+   EKF_init(&ekf, NULL);
+   EKF32_init(&ekf32, NULL);
+   for (n = 0; n < num; n++) {
+      EKF_update(&ekf, s[n].g[0], s[n].g[1], s[n].g[2], s[n].a[0], s[n].a[1], s[n].a[2], s[n].dt);
+      EKF32_update(&ekf32, s[n].g[0], s[n].g[1], s[n].g[2], s[n].a[0], s[n].a[1], s[n].a[2], s[n].dt);
+      EKF_getAttitude(&ekf, &ang_d[0], &ang_d[1], &ang_d[2]);
+      EKF32_getAttitude(&ekf32, &ang_f[0], &ang_f[1], &ang_f[2]);
+      for (k = 0; k < 3; k++) {
+         d = fabs(angle_diff(ang_f[k], ang_d[k]));
+         if (d > max_d[k]) max_d[k] = d;
+         sum_d[k] += d*d;
+      }
+   }
+   printf("Difference float - double, in degrees:\n");
+   printf("  yaw:   max %.4f, RMS %.4f\n", max_d[0], sqrt(sum_d[0]/num));
+   printf("  pitch: max %.4f, RMS %.4f\n", max_d[1], sqrt(sum_d[1]/num));
+   printf("  roll:  max %.4f, RMS %.4f\n", max_d[2], sqrt(sum_d[2]/num));
+
+   /* Speed: each filter alone */
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+   for (i = 0; i < runs; i++) {
+      EKF_init(&ekf, NULL);
+      for (n = 0; n < num; n++)
+         EKF_update(&ekf, s[n].g[0], s[n].g[1], s[n].g[2], s[n].a[0], s[n].a[1], s[n].a[2], s[n].dt);
+      sink += ekf.yaw;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   ns_d = elapsed_ns(&t0, &t1)/((double)runs*num);
+
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+   for (i = 0; i < runs; i++) {
+      EKF32_init(&ekf32, NULL);
+      for (n = 0; n < num; n++)
+         EKF32_update(&ekf32, s[n].g[0], s[n].g[1], s[n].g[2], s[n].a[0], s[n].a[1], s[n].a[2], s[n].dt);
+      sink += ekf32.yaw;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   ns_f = elapsed_ns(&t0, &t1)/((double)runs*num);
+
+   printf("Time per update, and CPU load at 476 and 952 Hz:\n");
+   printf("  double: %7.1f ns", ns_d);
+   if (mhz > 0) printf(" (%6.0f cycles)", ns_d*mhz/1000);
+   printf(", %5.2f%%, %5.2f%%\n", ns_d*476E-7, ns_d*952E-7);
+   printf("  float:  %7.1f ns", ns_f);
+   if (mhz > 0) printf(" (%6.0f cycles)", ns_f*mhz/1000);
+   printf(", %5.2f%%, %5.2f%%\n", ns_f*476E-7, ns_f*952E-7);
+   printf("  speedup: %.2f\n", ns_d/ns_f);
+   if (sink == 12345) printf(" ");  // Keep the results alive
+
+   free(s);
+   return 0;
+}
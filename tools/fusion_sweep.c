@@ -0,0 +1,597 @@
+/*************************************************************************
+
+Offline tuning of the attitude fusion engines (src/fusion.c) on a recording of raw IMU data
+(imu_XXXXXX.rec, see src/recorder.h). It runs on any Linux box, no robot hardware is needed.
+
+Each parameter set (feedback gain of Madgwick/Mahony, variances of the EKF, cutoff frequency of
+the low pass filter of the accelerometer) is run over the whole recording, as imuRead() does:
+the accelerometer through the FIR filter, the gyroscope as is, the magnetometer held between its
+samples. The sets are evaluated by a pool of threads, one per core by default.
+Each run starts as in imuRead(), with the warm start (see warm_start() in imu.c): after averaging
+the first 0.2 seconds, the attitude is set to the one of the 3D compass, and the feedback gain 
+starts at 10 times the one of the set and decays to it with a time constant of 0.3 seconds.
+
+Each set is scored against reference segments of the recording:
+ - Static periods: the car does not move for at least 1 second (small rotation rate, and
+   acceleration close to 1 g). The roll and pitch must be the ones of the mean acceleration,
+   and the yaw must not change.
+ - Turns between two static periods, of a multiple of 90 degrees (the rotation measured by the
+   gyroscope is within 20 degrees of it): the change of the yaw must be that multiple.
+The error of a set is the RMS of all these errors, in degrees. Its convergence time is the time
+until the roll and pitch stay within 1 degree of the reference in the first static period, which
+must start with the recording (the car is still when the IMU starts).
+The segments are found automatically, or read from a file (-s) with lines like:
+   static <t0> <t1>           Static period, times in seconds from the start of the recording
+   turn <t0> <t1> <angle>     The yaw changes 'angle' degrees from t0 to t1 (the car is still at both)
+
+It prints the Pareto front of error against convergence time: the sets which no other set
+improves in both. With -o, the results of all sets are written in a CSV file.
+
+Usage: fusion_sweep [-e engine] [-r sets] [-t threads] [-s segments] [-o results.csv] imu_XXXXXX.rec
+The engine is madgwick (default), mahony, ekf, ekf32, ekf-mag or ekf32-mag. Without -r, a grid
+of parameters is evaluated (for ekf-mag and ekf32-mag, it includes the variance of the heading of
+the magnetometer); with -r, 'sets' random sets (log-uniform around the defaults).
+
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <math.h>
+
+#include "recorder.h"
+#include "filter.h"
+#include "fusion.h"
+
+extern char *optarg;
+extern int optind;
+
+
+#define STATIC_RATE (3*M_PI/180)   // Maximum rotation rate of a static period, in rad/s
+#define STATIC_ACCEL 0.05          // Maximum deviation of the acceleration from 1 g in a static period
+#define STATIC_TIME 1.0            // Minimum duration of a static period, in s
+#define TURN_TOLERANCE 20          // Maximum difference of a turn with a multiple of 90 degrees
+#define CONVERGED 1.0              // Error of roll and pitch of a converged filter, in degrees
+#define MAX_SEGMENTS 1000
+#define WARM_START_TIME 0.2        // Seconds of samples averaged for the attitude of the warm start, as in imu.c
+#define WARM_START_GAIN 10.0       // Initial multiplier of the feedback gain after the warm start
+#define WARM_START_TAU 0.3         // Time constant of the decay of the gain, in s
+
+/* Calibrated samples of the recording */
+typedef struct {
+   float g[3];   // Gyroscope, in rad/s
+   float a[3];   // Accelerometer, in g
+   float m[3];   // Magnetometer, in Gauss, held from its last sample
+   float dt;     // Time since the previous sample, in s
+} Sample_t;
+
+/* Reference segment. The errors are evaluated in the second half of the static periods, when the filters have settled */
+typedef struct {
+   enum {SEG_STATIC, SEG_TURN} type;
+   long i0, i1;             // Samples of the static period, or of the static periods before and after a turn
+   double roll, pitch;      // Reference of a static period, in degrees
+   double angle;            // Change of yaw of a turn, in degrees
+} Segment_t;
+
+typedef struct {
+   double gain;             // Multiplier of beta (Madgwick) or Kp (Mahony)
+   double cutoff;           // Cutoff of the low pass filter of the accelerometer, in Hz
+   EKFParams_t ekf;         // Parameters of the EKF engines
+} Params_t;
+
+typedef struct {
+   double error;            // RMS error against the segments, in degrees
+   double conv;             // Convergence time, in s
+   double cost;             // Mean time of an update, in us
+} Result_t;
+
+
+static Sample_t *samples;
+static long num_samples;
+static double odr;
+static Segment_t segments[MAX_SEGMENTS];
+static int num_segments;
+static long conv_end = -1;   // End of the first static period, if it starts with the recording
+static double conv_roll, conv_pitch;
+static const FusionEngine_t *engine;
+static bool is_ekf, uses_mag;
+static Params_t *sets;
+static Result_t *results;
+static int num_sets;
+static atomic_int next_set;
+
+
+
+/* Read the accel/gyro samples of a recording, with the last magnetometer sample. Returns the number of samples, or -1 */
+static long read_recording(const char *file, RecHeader_t *h, Sample_t **samples)
+{
+FILE *fp;
+RecFrame_t f;
+Sample_t *s = NULL, *p;
+long n = 0, size = 0;
+int i, j, am, gm;
+bool first = true;
+uint32_t tick0 = 0;
+double t, t_prev = 0, m[3] = {0}, d[3];
+
+   fp = fopen(file, "rb");
+   if (!fp) {
+      fprintf(stderr, "Cannot open file %s\n", file);
+      return -1;
+   }
+   if (fread(h, sizeof(*h), 1, fp) != 1 || memcmp(h->magic, REC_MAGIC, sizeof(h->magic))) {
+      fprintf(stderr, "%s is not an IMU recording\n", file);
+      fclose(fp);
+      return -1;
+   }
+   if (h->version != REC_VERSION && h->version != 1) {  // Version 1 had no ranges, its samples are in the lowest one
+      fprintf(stderr, "Unsupported version %d of recording %s\n", h->version, file);
+      fclose(fp);
+      return -1;
+   }
+
+   while (fread(&f, sizeof(f), 1, fp) == 1) {
+      if (f.type == REC_FRAME_M) {
+         for (i=0; i<3; i++) d[i] = f.v[i] - h->mag_center[i];
+         for (i=0; i<3; i++)
+            for (j=0, m[i]=0; j<3; j++) m[i] += h->mag_matrix[i][j]*d[j]*h->mRes;
+         continue;
+      }
+      if (f.type != REC_FRAME_AG) continue;
+      if (first) {
+         tick0 = f.tick;
+         first = false;
+      }
+      t = (uint32_t)(f.tick - tick0)/1E6 - (f.count - 1 - f.index)/h->odr_ag;
+      if (n == size) {
+         size = size? 2*size : 4096;
+         s = realloc(s, size*sizeof(Sample_t));
+         if (!s) {
+            fprintf(stderr, "Not enough memory\n");
+            fclose(fp);
+            return -1;
+         }
+      }
+      p = &s[n];
+      am = rec_accel_mult[f.range&0x03];
+      gm = rec_gyro_mult[(f.range>>2)%3];
+      for (i=0; i<3; i++) {
+         p->g[i] = (gm*f.v[i] - h->bias_GY[i])*h->gRes*M_PI/180;
+         p->a[i] = (am*f.v[i+3] - h->err_AL[i])*h->aRes;
+         p->m[i] = m[i];
+      }
+      p->dt = (n == 0 || t <= t_prev)? 1/h->odr_ag : t - t_prev;  // Use the ODR if the tick is not monotonic
+      t_prev = t;
+      n++;
+   }
+   fclose(fp);
+   *samples = s;
+   return n;
+}
+
+
+static double angle_diff(double a, double b)
+{
+   return remainder(a - b, 360);
+}
+
+
+/* Roll and pitch of the mean acceleration of samples i0 to i1-1, as updateOrientation() in imu.c */
+static void static_reference(long i0, long i1, double *roll, double *pitch)
+{
+double a[3] = {0};
+long i;
+int k;
+
+   for (i = i0; i < i1; i++)
+      for (k = 0; k < 3; k++) a[k] += samples[i].a[k];
+   *roll = 180/M_PI*atan2(a[1], a[2]);
+   *pitch = 180/M_PI*atan(-a[0]/sqrt(a[1]*a[1] + a[2]*a[2]));
+}
+
+
+static long sample_at(double t)
+{
+long i;
+double ti = 0;
+
+   for (i = 0; i < num_samples && ti < t; i++) ti += samples[i].dt;
+   return i;
+}
+
+
+static int add_static(long i0, long i1)
+{
+Segment_t *s;
+
+   if (num_segments == MAX_SEGMENTS || i1 <= i0) return -1;
+   s = &segments[num_segments++];
+   s->type = SEG_STATIC;
+   s->i0 = i0; s->i1 = i1;
+   static_reference(i0, i1, &s->roll, &s->pitch);
+   if (i0 == 0) {
+      conv_end = i1;
+      conv_roll = s->roll; conv_pitch = s->pitch;
+   }
+   return num_segments-1;
+}
+
+
+static void add_turn(long i0, long i1, double angle)
+{
+Segment_t *s;
+
+   if (num_segments == MAX_SEGMENTS) return;
+   s = &segments[num_segments++];
+   s->type = SEG_TURN;
+   s->i0 = i0; s->i1 = i1;
+   s->angle = angle;
+}
+
+
+/* Find the static periods and the turns of multiples of 90 degrees between them */
+static void find_segments(void)
+{
+long i, j, start = 0;
+int k, prev = -1, cur;
+double g, a, up[3], turn, t_quiet = 0;
+const Segment_t *s;
+
+   for (i = 0; i <= num_samples; i++) {
+      if (i < num_samples) {
+         g = sqrt(samples[i].g[0]*samples[i].g[0] + samples[i].g[1]*samples[i].g[1] + samples[i].g[2]*samples[i].g[2]);
+         a = sqrt(samples[i].a[0]*samples[i].a[0] + samples[i].a[1]*samples[i].a[1] + samples[i].a[2]*samples[i].a[2]);
+         if (g < STATIC_RATE && fabs(a - 1) < STATIC_ACCEL) {
+            if (t_quiet == 0) start = i;
+            t_quiet += samples[i].dt;
+            continue;
+         }
+      }
+      if (t_quiet >= STATIC_TIME) {
+         cur = add_static(start, i);
+         if (cur < 0) break;
+         if (prev >= 0) {
+            // Rotation around the vertical (the acceleration of the previous static period),
+            // from the middle of the previous static period to the middle of this one
+            s = &segments[prev];
+            up[0] = -sin(s->pitch*M_PI/180);
+            up[1] = cos(s->pitch*M_PI/180)*sin(s->roll*M_PI/180);
+            up[2] = cos(s->pitch*M_PI/180)*cos(s->roll*M_PI/180);
+            for (turn = 0, j = (s->i0+s->i1)/2; j < (start+i)/2; j++)
+               for (k = 0; k < 3; k++) turn += 180/M_PI*samples[j].g[k]*up[k]*samples[j].dt;
+            if (fabs(turn) > 90 - TURN_TOLERANCE && fabs(angle_diff(turn, 90*lround(turn/90))) < TURN_TOLERANCE)
+               add_turn(prev, cur, 90*lround(turn/90));
+         }
+         prev = cur;
+      }
+      t_quiet = 0;
+   }
+}
+
+
+/* Read the segments from a file, see the header */
+static int read_segments(const char *file)
+{
+FILE *fp;
+char line[128];
+double t0, t1, angle;
+int a, b;
+
+   fp = fopen(file, "r");
+   if (!fp) {
+      fprintf(stderr, "Cannot open file %s\n", file);
+      return -1;
+   }
+   while (fgets(line, sizeof(line), fp)) {
+      if (sscanf(line, "static %lf %lf", &t0, &t1) == 2) add_static(sample_at(t0), sample_at(t1));
+      else if (sscanf(line, "turn %lf %lf %lf", &t0, &t1, &angle) == 3) {
+         // Each end of a turn is a short static period, so that it is evaluated as the automatic ones
+         a = add_static(sample_at(t0 - 0.2), sample_at(t0 + 0.2));
+         b = add_static(sample_at(t1 - 0.2), sample_at(t1 + 0.2));
+         if (a >= 0 && b >= 0) add_turn(a, b, angle);
+      }
+   }
+   fclose(fp);
+   return 0;
+}
+
+
+
+/* Attitude of the 3D compass, in radians, as updateOrientation() in imu.c (without the declination) */
+static void compass_attitude(const double a[3], const double m[3], double *yaw, double *pitch, double *roll)
+{
+double rootayaz = sqrt(a[1]*a[1] + a[2]*a[2]), rootaxayaz = sqrt(a[0]*a[0] + a[1]*a[1] + a[2]*a[2]);
+double sinroll = a[1]/rootayaz, cosroll = a[2]/rootayaz, sinpitch = -a[0]/rootaxayaz, cospitch = rootayaz/rootaxayaz;
+
+   *roll = atan2(a[1], a[2] + 0.05*a[0]);
+   *pitch = atan(-a[0]/rootayaz);
+   *yaw = atan2(m[2]*sinroll - m[1]*cosroll, m[0]*cospitch + m[1]*sinpitch*sinroll + m[2]*sinpitch*cosroll);
+}
+
+
+/* Run a parameter set over the recording, and score it */
+static int evaluate(const Params_t *par, float (*att)[3], Result_t *res)
+{
+Fusion_t f;
+FIRf_t lp[3];
+double *taps, yaw, pitch, roll, sum2 = 0, e, y0, y1, t = 0, t_warm = -1, warm_a[3] = {0}, warm_m[3] = {0};
+unsigned num_taps;
+long i, n = 0, last_bad = 0, warm_n = 0;
+int k, j;
+const Segment_t *s, *s0, *s1;
+
+   taps = LPFilter_design(par->cutoff, 1.5*par->cutoff, odr, &num_taps);
+   if (taps == NULL) return -1;
+   for (k = 0; k < 3; k++) FIRf_init(&lp[k], taps, num_taps);
+   free(taps);
+   Fusion_init(&f, engine, 1/odr);
+   if (is_ekf) Fusion_setEKFParams(&f, &par->ekf);
+
+   for (i = 0; i < num_samples; i++) {
+      const Sample_t *p = &samples[i];
+      for (k = 0; k < 3; k++) FIRf_put(&lp[k], p->a[k]);
+      Fusion_update(&f, FIRf_get(&lp[0]), FIRf_get(&lp[1]), FIRf_get(&lp[2]), p->g[0], p->g[1], p->g[2],
+                    p->m[0], p->m[1], p->m[2], p->dt);
+      t += p->dt;
+      if (t_warm < 0) {  // Warm start: average the raw samples, then set the attitude of the compass
+         for (k = 0; k < 3; k++) {
+            warm_a[k] += p->a[k];
+            warm_m[k] += p->m[k];
+         }
+         warm_n++;
+         if (t >= WARM_START_TIME) {
+            for (k = 0; k < 3; k++) {
+               warm_a[k] /= warm_n;
+               warm_m[k] /= warm_n;
+            }
+            compass_attitude(warm_a, warm_m, &yaw, &pitch, &roll);
+            Fusion_setAttitude(&f, yaw, pitch, roll);
+            t_warm = t;
+         }
+      }
+      if (t_warm >= 0 && t - t_warm <= 5*WARM_START_TAU)
+         Fusion_setGain(&f, par->gain*(1 + (WARM_START_GAIN-1)*exp(-(t - t_warm)/WARM_START_TAU)));
+      else Fusion_setGain(&f, par->gain);
+      Fusion_getAttitude(&f, &yaw, &pitch, &roll);
+      att[i][0] = 180/M_PI*yaw; att[i][1] = 180/M_PI*pitch; att[i][2] = 180/M_PI*roll;
+      if (i < conv_end && (fabs(att[i][1] - conv_pitch) > CONVERGED || fabs(angle_diff(att[i][2], conv_roll)) > CONVERGED))
+         last_bad = i+1;
+   }
+   res->cost = Fusion_cost(&f);
+   for (k = 0; k < 3; k++) FIRf_close(&lp[k]);
+
+   res->conv = 0;
+   for (i = 0; i < last_bad; i++) res->conv += samples[i].dt;
+
+   for (j = 0; j < num_segments; j++) {
+      s = &segments[j];
+      if (s->type == SEG_STATIC) {
+         for (i = (s->i0+s->i1)/2; i < s->i1; i++) {
+            e = att[i][1] - s->pitch; sum2 += e*e;
+            e = angle_diff(att[i][2], s->roll); sum2 += e*e;
+            e = angle_diff(att[i][0], att[(s->i0+s->i1)/2][0]); sum2 += e*e;
+            n += 3;
+         }
+      }
+      else {
+         s0 = &segments[s->i0]; s1 = &segments[s->i1];
+         y0 = att[(s0->i0+3*s0->i1)/4][0];
+         y1 = att[(s1->i0+3*s1->i1)/4][0];
+         e = angle_diff(y1 - y0, s->angle);
+         sum2 += e*e*(s1->i1 - s1->i0)/2;  // Weighted as a static period, so that turns are not negligible
+         n += (s1->i1 - s1->i0)/2;
+      }
+   }
+   res->error = n? sqrt(sum2/n) : 0;
+   return 0;
+}
+
+
+static void* worker(void *arg)
+{
+float (*att)[3];
+int i;
+
+   att = malloc(num_samples*sizeof(*att));
+   if (att == NULL) {  // The sets are left to the other threads; those which none evaluates keep an infinite error
+      fprintf(stderr, "Not enough memory for a thread\n");
+      return NULL;
+   }
+   while ((i = atomic_fetch_add(&next_set, 1)) < num_sets)
+      if (evaluate(&sets[i], att, &results[i]) < 0) results[i].error = results[i].conv = INFINITY;
+   free(att);
+   return NULL;
+}
+
+
+
+static double log_uniform(double lo, double hi)
+{
+   return lo*exp(log(hi/lo)*rand()/(double)RAND_MAX);
+}
+
+
+/* Grid of parameters, or random sets. Returns the number of sets */
+static int make_sets(int random_sets)
+{
+static const double gains[] = {0.1, 0.2, 0.5, 1, 2, 5, 10};
+static const double cutoffs[] = {5, 10, 20, 40};
+static const double scales[] = {0.1, 1, 10};
+EKFParams_t def;
+int n = 0, i, a, b, c, d, m, num;
+
+   EKF_defaultParams(&def);
+   if (random_sets) num = random_sets;
+   else if (is_ekf) num = (uses_mag? 81 : 27)*4;
+   else num = 7*4;
+   sets = calloc(num, sizeof(Params_t));
+   results = calloc(num, sizeof(Result_t));
+   if (!sets || !results) return -1;
+   for (i = 0; i < num; i++) results[i].error = results[i].conv = INFINITY;  // Until the set is evaluated
+
+   if (random_sets) {
+      for (i = 0; i < num; i++) {
+         sets[i].ekf = def;
+         sets[i].cutoff = log_uniform(3, 50);
+         if (is_ekf) {
+            sets[i].gain = 1;
+            sets[i].ekf.q_dcm2 = def.q_dcm2*log_uniform(0.01, 100);
+            sets[i].ekf.r_acc2 = def.r_acc2*log_uniform(0.01, 100);
+            sets[i].ekf.r_a2 = def.r_a2*log_uniform(0.01, 100);
+            sets[i].ekf.r_mag2 = def.r_mag2*log_uniform(0.01, 100);
+         }
+         else sets[i].gain = log_uniform(0.05, 20);
+      }
+      return num;
+   }
+
+   for (d = 0; d < 4; d++) {
+      if (is_ekf) {
+         for (a = 0; a < 3; a++)
+            for (b = 0; b < 3; b++)
+               for (c = 0; c < 3; c++)
+                  for (m = 0; m < (uses_mag? 3 : 1); m++) {
+                     sets[n].gain = 1;
+                     sets[n].cutoff = cutoffs[d];
+                     sets[n].ekf = def;
+                     sets[n].ekf.q_dcm2 = def.q_dcm2*scales[a];
+                     sets[n].ekf.r_acc2 = def.r_acc2*scales[b];
+                     sets[n].ekf.r_a2 = def.r_a2*scales[c];
+                     if (uses_mag) sets[n].ekf.r_mag2 = def.r_mag2*scales[m];
+                     n++;
+                  }
+      }
+      else {
+         for (a = 0; a < 7; a++) {
+            sets[n].ekf = def;
+            sets[n].gain = gains[a];
+            sets[n].cutoff = cutoffs[d];
+            n++;
+         }
+      }
+   }
+   return n;
+}
+
+
+static void print_set(FILE *fp, const char *sep, const Params_t *p, const Result_t *r)
+{
+   if (is_ekf) fprintf(fp, "%8.3g%s%8.3g%s%8.3g%s%8.3g%s%6.1f%s", p->ekf.q_dcm2, sep, p->ekf.r_acc2, sep, p->ekf.r_a2, sep,
+                       p->ekf.r_mag2, sep, p->cutoff, sep);
+   else fprintf(fp, "%8.3f%s%6.1f%s", p->gain, sep, p->cutoff, sep);
+   fprintf(fp, "%9.4f%s%8.3f%s%7.2f\n", r->error, sep, r->conv, sep, r->cost);
+}
+
+
+static int by_error(const void *a, const void *b)
+{
+const Result_t *ra = &results[*(const int*)a], *rb = &results[*(const int*)b];
+
+   return (ra->error > rb->error) - (ra->error < rb->error);
+}
+
+
+
+int main(int argc, char *argv[])
+{
+int c, i, j, num_threads = 0, random_sets = 0, turns = 0, *order;
+const char *file, *seg_file = NULL, *out_file = NULL, *name = "madgwick";
+RecHeader_t h;
+pthread_t *threads;
+FILE *fp;
+bool dominated;
+
+   while ((c = getopt(argc, argv, "e:r:t:s:o:")) != -1)
+      switch (c) {
+         case 'e': name = optarg; break;
+         case 'r': random_sets = atoi(optarg); break;
+         case 't': num_threads = atoi(optarg); break;
+         case 's': seg_file = optarg; break;
+         case 'o': out_file = optarg; break;
+         default:
+            fprintf(stderr, "Usage: %s [-e engine] [-r sets] [-t threads] [-s segments] [-o results.csv] imu_XXXXXX.rec\n", argv[0]);
+            exit(1);
+      }
+   if (optind >= argc) {
+      fprintf(stderr, "Usage: %s [-e engine] [-r sets] [-t threads] [-s segments] [-o results.csv] imu_XXXXXX.rec\n", argv[0]);
+      exit(1);
+   }
+   file = argv[optind];
+   engine = Fusion_find(name);
+   if (engine == NULL) exit(1);
+   is_ekf = !strncmp(name, "ekf", 3);
+   uses_mag = is_ekf && strstr(name, "-mag") != NULL;
+   if (num_threads <= 0) num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+   if (num_threads <= 0) num_threads = 1;
+
+   num_samples = read_recording(file, &h, &samples);
+   if (num_samples < 0) exit(1);
+   if (num_samples == 0) {
+      fprintf(stderr, "%s has no accel/gyro samples\n", file);
+      exit(1);
+   }
+   odr = h.odr_ag;
+   if (seg_file) {
+      if (read_segments(seg_file) < 0) exit(1);
+   }
+   else find_segments();
+   for (i = 0; i < num_segments; i++) turns += segments[i].type == SEG_TURN;
+   printf("%ld accel/gyro samples at %.1f Hz, %d static periods, %d turns\n", num_samples, odr, num_segments-turns, turns);
+   if (num_segments == 0) {
+      fprintf(stderr, "There are no reference segments in the recording\n");
+      exit(1);
+   }
+   if (conv_end < 0) printf("The recording does not start with a static period, the convergence time is not measured\n");
+
+   num_sets = make_sets(random_sets);
+   if (num_sets <= 0) exit(1);
+   printf("Evaluating %d parameter sets of %s with %d threads\n", num_sets, engine->name, num_threads);
+   threads = calloc(num_threads, sizeof(pthread_t));
+   for (i = 0; i < num_threads; i++)
+      if (pthread_create(&threads[i], NULL, worker, NULL)) break;
+   if (i == 0) worker(NULL);
+   while (i > 0) pthread_join(threads[--i], NULL);
+   free(threads);
+   for (i = 0, j = 0; i < num_sets; i++) j += !isinf(results[i].error);
+   if (j == 0) {
+      fprintf(stderr, "No parameter set could be evaluated\n");
+      exit(1);
+   }
+
+   // Pareto front of error and convergence time, sorted by error
+   order = malloc(num_sets*sizeof(int));
+   for (i = 0; i < num_sets; i++) order[i] = i;
+   qsort(order, num_sets, sizeof(int), by_error);
+   printf("\nPareto front (error in degrees, convergence in s, cost of an update in us):\n");
+   if (is_ekf) printf("  q_dcm2   r_acc2     r_a2   r_mag2 cutoff    error    conv   cost\n");
+   else printf("    gain cutoff    error    conv   cost\n");
+   for (i = 0; i < num_sets; i++) {
+      const Result_t *r = &results[order[i]];
+      for (j = 0, dominated = false; j < num_sets && !dominated; j++) {
+         const Result_t *o = &results[order[j]];
+         dominated = o->error <= r->error && o->conv <= r->conv && (o->error < r->error || o->conv < r->conv);
+      }
+      if (!dominated) print_set(stdout, " ", &sets[order[i]], r);
+   }
+
+   if (out_file) {
+      fp = fopen(out_file, "w");
+      if (!fp) {
+         fprintf(stderr, "Cannot create file %s\n", out_file);
+         exit(1);
+      }
+      if (is_ekf) fprintf(fp, "q_dcm2;r_acc2;r_a2;r_mag2;cutoff;error;conv;cost\n");
+      else fprintf(fp, "gain;cutoff;error;conv;cost\n");
+      for (i = 0; i < num_sets; i++) print_set(fp, ";", &sets[order[i]], &results[order[i]]);
+      fclose(fp);
+      printf("Results of all sets written in %s\n", out_file);
+   }
+
+   free(order); free(sets); free(results); free(samples);
+   return 0;
+}
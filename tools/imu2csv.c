@@ -0,0 +1,138 @@
+/*************************************************************************
+
+Conversion of a recording of raw IMU data (imu_XXXXXX.rec, see src/recorder.h)
+into two CSV files: <prefix>_ag.csv with the accel/gyro samples and <prefix>_m.csv
+with the magnetometer samples. The prefix is the name of the recording without ".rec".
+The values are calibrated with the data in the header of the recording, and given
+in dps, g and Gauss; with -r, the raw values are written instead, as counts of the lowest 
+full scale range (the IMU switches ranges automatically).
+The time is in seconds from the first frame. The accel/gyro samples of a FIFO burst
+are read at the same time, so their time is spread backwards with the ODR.
+
+Usage: imu2csv [-r] imu_XXXXXX.rec [prefix]
+
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "recorder.h"
+
+extern char *optarg;
+extern int optind;
+
+
+static FILE *open_csv(const char *prefix, const char *suffix, const char *header)
+{
+char name[256];
+FILE *fp;
+
+   snprintf(name, sizeof(name), "%s%s", prefix, suffix);
+   fp = fopen(name, "w");
+   if (!fp) {
+      fprintf(stderr, "Cannot create file %s\n", name);
+      return NULL;
+   }
+   fprintf(fp, "%s\n", header);
+   printf("Writing %s\n", name);
+   return fp;
+}
+
+
+int main(int argc, char *argv[])
+{
+int c, i, j, am, gm, v[6];
+bool raw = false, first = true;
+const char *file;
+char prefix[240];
+FILE *fp, *fp_ag, *fp_m;
+RecHeader_t h;
+RecFrame_t f;
+uint32_t tick0 = 0;
+unsigned long n_ag = 0, n_m = 0;
+double t, d[3], m[3];
+
+   while ((c = getopt(argc, argv, "r")) != -1)
+      switch (c) {
+         case 'r': raw = true; break;
+         default:
+            fprintf(stderr, "Usage: %s [-r] imu_XXXXXX.rec [prefix]\n", argv[0]);
+            exit(1);
+      }
+   if (optind >= argc) {
+      fprintf(stderr, "Usage: %s [-r] imu_XXXXXX.rec [prefix]\n", argv[0]);
+      exit(1);
+   }
+   file = argv[optind];
+   if (optind+1 < argc) snprintf(prefix, sizeof(prefix), "%s", argv[optind+1]);
+   else {
+      snprintf(prefix, sizeof(prefix), "%s", file);
+      if (strlen(prefix) > 4 && !strcmp(prefix+strlen(prefix)-4, ".rec")) prefix[strlen(prefix)-4] = 0;
+   }
+
+   fp = fopen(file, "rb");
+   if (!fp) {
+      fprintf(stderr, "Cannot open file %s\n", file);
+      exit(1);
+   }
+   if (fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, REC_MAGIC, sizeof(h.magic))) {
+      fprintf(stderr, "%s is not an IMU recording\n", file);
+      exit(1);
+   }
+   if (h.version != REC_VERSION && h.version != 1) {  // Version 1 had no ranges, its samples are in the lowest one
+      fprintf(stderr, "Unsupported version %d of recording %s\n", h.version, file);
+      exit(1);
+   }
+   printf("ODR accel/gyro: %.1f Hz, ODR magnetometer: %.3f Hz\n", h.odr_ag, h.odr_m);
+   printf("Accelerometer offset: %d, %d, %d\n", h.err_AL[0], h.err_AL[1], h.err_AL[2]);
+   printf("Gyroscope bias: %.2f, %.2f, %.2f\n", h.bias_GY[0], h.bias_GY[1], h.bias_GY[2]);
+   printf("Magnetometer center: %.1f, %.1f, %.1f\n", h.mag_center[0], h.mag_center[1], h.mag_center[2]);
+
+   fp_ag = open_csv(prefix, "_ag.csv", "T; GX; GY; GZ; AX; AY; AZ");
+   fp_m = open_csv(prefix, "_m.csv", "T; MX; MY; MZ");
+   if (!fp_ag || !fp_m) exit(1);
+
+   while (fread(&f, sizeof(f), 1, fp) == 1) {
+      if (first) {
+         tick0 = f.tick;
+         first = false;
+      }
+      t = (uint32_t)(f.tick - tick0)/1E6;  // The tick wraps around every 72 minutes
+      switch (f.type) {
+         case REC_FRAME_AG:
+            t -= (f.count - 1 - f.index)/h.odr_ag;
+            am = rec_accel_mult[f.range&0x03];
+            gm = rec_gyro_mult[(f.range>>2)%3];
+            for (i=0; i<3; i++) {
+               v[i] = gm*f.v[i];
+               v[i+3] = am*f.v[i+3];
+            }
+            if (raw) fprintf(fp_ag, "%.6f;%d;%d;%d;%d;%d;%d\n", t, v[0], v[1], v[2], v[3], v[4], v[5]);
+            else fprintf(fp_ag, "%.6f;%.4f;%.4f;%.4f;%.5f;%.5f;%.5f\n", t,
+                    (v[0]-h.bias_GY[0])*h.gRes, (v[1]-h.bias_GY[1])*h.gRes, (v[2]-h.bias_GY[2])*h.gRes,
+                    (v[3]-h.err_AL[0])*h.aRes, (v[4]-h.err_AL[1])*h.aRes, (v[5]-h.err_AL[2])*h.aRes);
+            n_ag++;
+            break;
+         case REC_FRAME_M:
+            if (raw) fprintf(fp_m, "%.6f;%d;%d;%d\n", t, f.v[0], f.v[1], f.v[2]);
+            else {
+               for (i=0; i<3; i++) d[i] = f.v[i] - h.mag_center[i];
+               for (i=0; i<3; i++)
+                  for (j=0, m[i]=0; j<3; j++) m[i] += h.mag_matrix[i][j]*d[j]*h.mRes;
+               fprintf(fp_m, "%.6f;%.5f;%.5f;%.5f\n", t, m[0], m[1], m[2]);
+            }
+            n_m++;
+            break;
+         default:
+            fprintf(stderr, "Unknown frame type %d\n", f.type);
+      }
+   }
+   printf("%lu accel/gyro samples, %lu magnetometer samples\n", n_ag, n_m);
+
+   fclose(fp); fclose(fp_ag); fclose(fp_m);
+   return 0;
+}
@@ -0,0 +1,151 @@
+/*************************************************************************
+
+Offline refit of the magnetometer calibration, from the samples recorded
+in mag_data.csv during calibration (robot -c).
+It prints the hardiron and softiron lines of the calibration file (MGH, MGS, MGX),
+which can be copied into it.
+With -b, it benchmarks the fit: the double precision reference and the single precision
+version with 1 to 4 threads. It also checks that the results do not depend on the number of threads.
+
+Usage: magfit [-t threads] [-F field] [-b repetitions] [mag_data.csv]
+The field is the magnitude of the magnetic field in IMU units (default: 0.457 Gauss with 4 Gauss scale).
+
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+
+#include "magcal.h"
+
+extern char *optarg;
+extern int optind;
+
+
+static double elapsed_ns(const struct timespec *t0, const struct timespec *t1)
+{
+   return (t1->tv_sec - t0->tv_sec)*1E9 + (t1->tv_nsec - t0->tv_nsec);
+}
+
+
+/* Read the samples from a file in the format of mag_data.csv: a header line and then X;Y;Z lines */
+static int read_samples(const char *file, SampleList_t *s)
+{
+FILE *fp;
+char line[64];
+int x, y, z, size = 0;
+
+   fp = fopen(file, "r");
+   if (!fp) {
+      fprintf(stderr, "Cannot open file %s\n", file);
+      return -1;
+   }
+   s->num_elems = 0;
+   while (fgets(line, sizeof(line), fp)) {
+      if (sscanf(line, "%d;%d;%d", &x, &y, &z) != 3) continue;  // Header
+      if (s->num_elems == size) {
+         size = size ? 2*size : 1024;
+         s->xvalues = realloc(s->xvalues, size*sizeof(int));
+         s->yvalues = realloc(s->yvalues, size*sizeof(int));
+         s->zvalues = realloc(s->zvalues, size*sizeof(int));
+         if (!s->xvalues || !s->yvalues || !s->zvalues) {
+            fclose(fp);
+            return -1;
+         }
+      }
+      s->xvalues[s->num_elems] = x; s->yvalues[s->num_elems] = y; s->zvalues[s->num_elems] = z;
+      s->num_elems++;
+   }
+   fclose(fp);
+   return 0;
+}
+
+
+/* Initial estimation from maximum and minimum values, as calibrate_magnetometer() does */
+static void initial_estimation(const SampleList_t *s, MagCal_t *cal)
+{
+int i, k, min[3], max[3], v[3];
+double rad_mean = 0;
+
+   memset(cal, 0, sizeof(*cal));
+   for (k=0; k<3; k++) {
+      min[k] = INT32_MAX;
+      max[k] = INT32_MIN;
+   }
+   for (i=0; i<s->num_elems; i++) {
+      v[0] = s->xvalues[i]; v[1] = s->yvalues[i]; v[2] = s->zvalues[i];
+      for (k=0; k<3; k++) {
+         if (v[k] < min[k]) min[k] = v[k];
+         if (v[k] > max[k]) max[k] = v[k];
+      }
+   }
+   for (k=0; k<3; k++) {
+      cal->center[k] = (min[k] + max[k])/2;
+      rad_mean += (max[k] - min[k])/2/3.0;
+   }
+   for (k=0; k<3; k++) cal->matrix[k][k] = rad_mean/((max[k] - min[k])/2);
+}
+
+
+int main(int argc, char *argv[])
+{
+int c, t, n, threads = 0, reps = 0;
+double field = lround(0.457/(4.0/32768)), err, ns, ns_ref = 0;
+const char *file = "mag_data.csv";
+char label[8];
+SampleList_t samples = {NULL, NULL, NULL, 0};
+MagCal_t init, cal, cal_1;
+struct timespec t0, t1;
+
+   while ((c = getopt(argc, argv, "t:F:b:")) != -1)
+      switch (c) {
+         case 't': threads = atoi(optarg); break;
+         case 'F': field = atof(optarg); break;
+         case 'b': reps = atoi(optarg); break;
+         default:
+            fprintf(stderr, "Usage: %s [-t threads] [-F field] [-b repetitions] [mag_data.csv]\n", argv[0]);
+            exit(1);
+      }
+   if (optind < argc) file = argv[optind];
+   if (read_samples(file, &samples) < 0) exit(1);
+   printf("%d samples read from %s\n", samples.num_elems, file);
+   initial_estimation(&samples, &init);
+
+   if (reps > 0) {
+      printf("Threads  ms/fit  ms/pass  speedup  passes  mean cuad. error\n");
+      for (t = 0; t <= 4; t++) {
+         MagCal_setThreads(t);
+         clock_gettime(CLOCK_MONOTONIC, &t0);
+         for (n = 0; n < reps; n++) {
+            cal = init;
+            err = MagCal_fit(&samples, field, &cal);
+         }
+         clock_gettime(CLOCK_MONOTONIC, &t1);
+         ns = elapsed_ns(&t0, &t1)/reps;
+         if (t == 0) ns_ref = ns;
+         snprintf(label, sizeof(label), t ? "%d" : "ref", t);
+         printf("%7s  %6.2f  %7.3f  %7.2f  %6d  %.3e\n", label, ns/1E6, ns/1E6/cal.passes, ns_ref/ns, cal.passes, err);
+         if (t == 1) cal_1 = cal;
+         if (t > 1 && memcmp(&cal, &cal_1, sizeof(cal)))
+            fprintf(stderr, "Result with %d threads differs from result with 1 thread\n", t);
+      }
+   }
+
+   if (threads) MagCal_setThreads(threads);
+   cal = init;
+   printf("Initial mean cuadratic error: %.3e\n", MagCal_cost(&samples, field, &init));
+   err = MagCal_fit(&samples, field, &cal);
+   if (err < 0) exit(1);
+   printf("Final mean cuadratic error: %.3e, residuals: rms=%.4f, max=%.4f, %d passes\n",
+          err, cal.rms_residual, cal.max_residual, cal.passes);
+   printf("MGH: %ld, %ld, %ld\n", lrint(cal.center[0]), lrint(cal.center[1]), lrint(cal.center[2]));
+   printf("MGS: %f, %f, %f\n", cal.matrix[0][0], cal.matrix[1][1], cal.matrix[2][2]);
+   printf("MGX: %f, %f, %f\n", cal.matrix[0][1], cal.matrix[0][2], cal.matrix[1][2]);
+
+   free(samples.xvalues); free(samples.yvalues); free(samples.zvalues);
+   return 0;
+}
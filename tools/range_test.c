@@ -0,0 +1,144 @@
+/*************************************************************************
+
+Test of the samples dropped after a switch of the full scale range of the IMU (src/rangedrop.c),
+with simulated sequences of FIFO bursts, as imuRead() reads them: it reads the number of samples
+in the FIFO, switches the ranges if needed (see set_range() in imu.c) and then reads the samples
+counted, which are decoded in the ranges in use before the switch.
+The sensor takes a sample every 1/ODR seconds; a sample taken while switching is in an unknown range.
+After a switch, the number of samples is read again, to know how many arrived since they were counted.
+The reads are done once per magnetometer sample, with jitter, so some bursts have no samples, and
+the ranges are switched in random reads, sometimes in consecutive ones.
+Each kept sample must be decoded in the range it was taken in, at most one good sample may be dropped 
+in each switch, and the time of the dropped samples must be added to the next ones.
+
+Usage: range_test [-v]
+With -v, it prints the statistics of each sequence. The exit status is 0 if all the tests pass.
+
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "rangedrop.h"
+
+
+static const double odr_ag_modes[] = {119, 238, 476, 952};
+static const double odr_m_modes[] = {0.625, 1.25, 2.5, 5, 10, 20, 40, 80};
+#define FIFO_LINES 32
+#define NUM(a) ((int)(sizeof(a)/sizeof(a[0])))
+#define NUM_READS 2000
+#define UNKNOWN_RANGE 0xFF   // Range of a sample taken while switching
+
+static const double switch_probability[] = {0.02, 0.2, 0.5};  // Probability of a switch in each read
+static const double read_jitter = 0.1;      // Jitter of the reads, as a fraction of the read period (no FIFO overruns)
+static const double switch_delay = 0.3E-3;  // Longest time from reading the number of samples to the switch, in s
+static const double i2c_read_time = 0.1E-3; // Time to read the number of samples again after the switch, in s
+
+static bool verbose;
+
+
+static double uniform(double a, double b)
+{
+   return a + (b - a)*rand()/(double)RAND_MAX;
+}
+
+
+/* Samples completed until time t, counting from sample 'first', as FIFO_SRC gives them */
+static int fifo_count(double odr, long first, double t)
+{
+int n;
+
+   for (n = 0; (first + n + 1)/odr <= t && n < FIFO_LINES; n++) ;
+   return n;
+}
+
+
+/*
+Run NUM_READS reads of a sensor at ODR odr, one every 'factor' samples. Each sample has in its FIFO line
+the range it was taken in. Returns the number of errors found
+*/
+static int run(double odr, int factor, double p_switch)
+{
+char buf[RANGEDROP_LINE*FIFO_LINES];
+double dt[FIFO_LINES], t_count, t_switch[NUM_READS+1], time_read = 0, time_kept = 0;
+unsigned char range[NUM_READS+1], fifo_range;
+long next_sample = 0, bad = 0, dropped = 0;
+int read, n, samples, kept, switches = 0, s = 0, errors = 0;
+RangeDrop_t d;
+
+   RangeDrop_init(&d);
+   t_switch[0] = -1; range[0] = 0;   // Switch s sets range[s] at t_switch[s]
+   for (read = 1; read <= NUM_READS; read++) {
+      /* Count the samples taken until now, then switch the range, if needed, and count them again */
+      t_count = (read + uniform(-read_jitter, read_jitter))*factor/odr;
+      samples = fifo_count(odr, next_sample, t_count);
+      fifo_range = range[switches];
+      if (uniform(0, 1) < p_switch) {
+         switches++;
+         t_switch[switches] = t_count + uniform(0, switch_delay);
+         range[switches] = (fifo_range + 1) % 3;
+         RangeDrop_switched(&d, fifo_count(odr, next_sample, t_switch[switches] + i2c_read_time) - samples + 1);
+      }
+
+      /* Read the samples counted. Sample k is taken from k/odr to (k+1)/odr */
+      for (n = 0; n < samples; n++, next_sample++) {
+         while (s < switches && t_switch[s+1] <= next_sample/odr) s++;
+         if (s < switches && t_switch[s+1] <= (next_sample + 1)/odr) buf[RANGEDROP_LINE*n] = UNKNOWN_RANGE;
+         else buf[RANGEDROP_LINE*n] = range[s];
+         if ((unsigned char)buf[RANGEDROP_LINE*n] != fifo_range) bad++;
+         dt[n] = 1/odr;
+         time_read += dt[n];
+      }
+      kept = RangeDrop_apply(&d, buf, samples, dt);
+      dropped += samples - kept;
+      for (n = 0; n < kept; n++) {
+         time_kept += dt[n];
+         if ((unsigned char)buf[RANGEDROP_LINE*n] != fifo_range) errors++;
+      }
+   }
+   time_kept += d.carry_dt;
+   if (dropped > bad + switches) errors++;   // At most one good sample is dropped in each switch
+   if (fabs(time_kept - time_read) > 1E-9*time_read) errors++;
+   if (verbose || errors)
+      printf("   %d switches, %ld samples taken before or during them, %ld dropped, %d errors\n",
+             switches, bad, dropped, errors);
+   return errors;
+}
+
+
+int main(int argc, char *argv[])
+{
+int c, i, m, k, factor, tests = 0, failures = 0;
+double odr;
+
+   while ((c = getopt(argc, argv, "v")) != -1)
+      switch (c) {
+         case 'v': verbose = true; break;
+         default:
+            fprintf(stderr, "Usage: %s [-v]\n", argv[0]);
+            exit(1);
+      }
+   srand(1);
+
+   for (i = 0; i < NUM(odr_ag_modes); i++)
+      for (m = 0; m < NUM(odr_m_modes); m++) {
+         odr = odr_ag_modes[i];
+         factor = lround(odr/odr_m_modes[m]);
+         if (factor >= FIFO_LINES || fabs(odr/(odr_m_modes[m]*factor) - 1) > 0.01) continue;  // As setupLSM9DS1()
+         printf("ODR %g Hz, read every %d samples (%.1f ms)\n", odr, factor, factor/odr*1000);
+         for (k = 0; k < NUM(switch_probability); k++) {
+            tests++;
+            if (run(odr, factor, switch_probability[k])) {
+               failures++;
+               printf("   FAILED: switching in %.0f%% of the reads\n", 100*switch_probability[k]);
+            }
+         }
+      }
+
+   printf("%d tests, %d failed\n", tests, failures);
+   return failures ? 1 : 0;
+}